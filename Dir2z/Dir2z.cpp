@@ -7,77 +7,70 @@
 #include <fcntl.h>
 #include <io.h>
 
-#include <bit7z/bit7zlibrary.hpp>
-#include <bit7z/bitfilecompressor.hpp>
+#include "../common/JobScheduler.h"
+#include "../common/ProgressMeter.h"
+#include "../common/ZipWriter.h"
 
 namespace fs = std::filesystem;
 
-// UTF-8変換（bit7zへのパス受け渡し用）
-std::string ToUtf8(const std::wstring& wstr) {
-    if (wstr.empty()) return std::string();
-    int size_needed = WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), NULL, 0, NULL, NULL);
-    std::string strTo(size_needed, 0);
-    WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), &strTo[0], size_needed, NULL, NULL);
-    return strTo;
-}
-
 // 個別圧縮処理
 // 個別圧縮処理
-bool CompressIndividual(bit7z::Bit7zLibrary& lib, const fs::path& targetPath) {
+bool CompressIndividual(const fs::path& targetPath, ProgressMeter& meter, ProgressMeter::Task& task) {
     try {
         if (!fs::is_directory(targetPath)) return false;
 
-        // 絶対パスに変換しておく（カレントディレクトリ移動に備えて）
         fs::path absTargetPath = fs::absolute(targetPath);
         fs::path zipPath = absTargetPath;
         zipPath.replace_extension(L".zip");
 
         if (fs::exists(zipPath)) {
-            std::wcout << L"Skipped: " << zipPath.filename().wstring() << L" already exists." << std::endl;
+            meter.Print(L"Skipped: " + zipPath.filename().wstring() + L" already exists.");
             return false;
         }
 
-        bit7z::BitFileCompressor compressor{ lib, bit7z::BitFormat::Zip };
-
-        // 進捗表示
+        // 進捗表示用に元データの合計サイズを求めておく
         uint64_t totalSize = 0;
-        compressor.setTotalCallback([&totalSize](uint64_t total) { totalSize = total; });
-        compressor.setProgressCallback([&totalSize](uint64_t completed) {
-            if (totalSize > 0) {
-                int percent = static_cast<int>((completed * 100) / totalSize);
-                std::wcout << L"\rCompressing: " << percent << L"% " << std::flush;
-            }
+        for (const auto& entry : fs::recursive_directory_iterator(absTargetPath)) {
+            if (entry.is_regular_file()) totalSize += entry.file_size();
+        }
+
+        // コールバックは数を書き換えるだけ（表示はProgressMeterのスレッドがまとめて行う）
+        task.SetTotal(totalSize);
+
+        ZipWriter zip;
+        zip.SetProgressCallback([&task](uint64_t completed) {
+            task.Update(completed);
             return true;
             });
 
-        std::wcout << L"Target: " << absTargetPath.filename().wstring() << std::endl;
-
-        // --- 【改善ポイント】ワイルドカードを使わない方式 ---
-        // 1. 現在のディレクトリを保存
-        fs::path oldPath = fs::current_path();
+        meter.Print(L"Target: " + absTargetPath.filename().wstring());
 
-        // 2. 圧縮したいフォルダの中へ移動
-        fs::current_path(absTargetPath);
+        if (!zip.Open(zipPath, Z_DEFAULT_COMPRESSION, JobScheduler::ThreadBudget())) {
+            meter.Printf(true, L"Failed to create: %s", zipPath.wstring().c_str());
+            return false;
+        }
 
-        try {
-            // 3. 移動後の場所で "." （現在のディレクトリすべて）を指定して圧縮
-            // これにより、ルートディレクトリ名を含まずに中身だけが圧縮されます
-            compressor.compress({ "." }, ToUtf8(zipPath.wstring()));
+        // フォルダの中身だけを圧縮する（ルートディレクトリ名は含めない）
+        // 大きなファイルはブロックごとに並列deflateされる
+        fs::path failedPath;
+        if (!ZipAddDirectoryContents(zip, absTargetPath, &failedPath)) {
+            zip.Abort();
+            meter.Printf(true, L"Failed to add: %s", failedPath.wstring().c_str());
+            return false;
         }
-        catch (...) {
-            fs::current_path(oldPath); // エラー時もディレクトリを戻す
-            throw;
+        if (!zip.Close()) {
+            meter.Printf(true, L"Failed to write: %s", zipPath.wstring().c_str());
+            return false;
         }
 
-        // 4. 元のディレクトリに戻す
-        fs::current_path(oldPath);
-        // --------------------------------------------------
-
-        std::wcout << L"\nSuccess: " << zipPath.filename().wstring() << std::endl;
+        meter.Print(L"Success: " + zipPath.filename().wstring());
+        if (zip.StoreStats().entries > 0) {
+            meter.Print(L"  " + zip.StoreStats().Summary());
+        }
         return true;
     }
-    catch (const bit7z::BitException& ex) {
-        fwprintf(stderr, L"\nbit7z Error: %S\n", ex.what());
+    catch (const std::exception& ex) {
+        meter.Printf(true, L"Error: %S", ex.what());
         return false;
     }
 }
@@ -85,21 +78,29 @@ int main() {
     _setmode(_fileno(stdout), _O_U16TEXT);
     _setmode(_fileno(stderr), _O_U16TEXT);
 
-    try {
-        bit7z::Bit7zLibrary lib{ "7z.dll" };
-        int wargc;
-        wchar_t** wargv = CommandLineToArgvW(GetCommandLineW(), &wargc);
-        if (!wargv) return 1;
+    int wargc;
+    wchar_t** wargv = CommandLineToArgvW(GetCommandLineW(), &wargc);
+    if (!wargv) return 1;
 
-        for (int i = 1; i < wargc; ++i) {
-            fs::path p = wargv[i];
-            if (fs::exists(p)) CompressIndividual(lib, p);
-        }
-        LocalFree(wargv);
+    std::vector<fs::path> targets;
+    for (int i = 1; i < wargc; ++i) {
+        fs::path p = wargv[i];
+        if (fs::is_directory(p)) targets.push_back(p);
     }
-    catch (const bit7z::BitException& ex) {
-        fwprintf(stderr, L"Fatal Error: %S\n", ex.what());
-        return 1;
+
+    // 進捗は全フォルダの合計を1行で表示する（0.1秒ごと）
+    ProgressMeter meter(targets.size(), L"Compressing");
+    // フォルダごとの圧縮はCPU主体なのでコア数まで同時に動かす
+    JobScheduler scheduler;
+    for (const auto& p : targets) {
+        scheduler.Add(JobKind::Cpu, p, [p, &meter] {
+            ProgressMeter::Task& task = meter.Begin();
+            CompressIndividual(p, meter, task);
+            meter.End(task);
+            });
     }
+    scheduler.Run();
+    meter.Stop();
+    LocalFree(wargv);
     return 0;
 }
\ No newline at end of file
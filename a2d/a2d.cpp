@@ -2,9 +2,18 @@
 #include <filesystem>
 #include <iostream>
 #include <string>
+#include <cstring>
+#include <cwchar>
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <mutex>
+#include <new>
+#include "../common/ArchiveIndex.h"
+#include "../common/JobScheduler.h"
+#include "../common/ProgressMeter.h"
+#include "../common/SevenZipList.h"
+#include "../common/ZipReader.h"
 
 namespace fs = std::filesystem;
 
@@ -16,39 +25,6 @@ struct ArcInfo
     bool enabled;
 
     ArcInfo() : isDir(false), isRootDir(false), enabled(false) {}
-
-    bool Parse(const std::wstring& line)
-    {
-        // 7z.exeの出力形式:
-        //   Date      Time    Attr         Size   Compressed  Name
-        // 2024-05-18 09:35:57 D...A            0            0  フォルダ名
-        enabled = false;
-        if (line.length() < 53) return false;
-
-        try
-        {
-            // 属性チェック (位置20-24)
-            if (line.length() < 53) return false;
-            
-            wchar_t attrD = line[20];
-            wchar_t attrA = line[24];
-
-            if ((attrD != L'D') && (attrD != L'.')) return false;
-            if ((attrA != L'A') && (attrA != L'.')) return false;
-
-            // ファイル名取得 (位置53以降)
-            name = line.substr(53);
-            isDir = (attrD == L'D');
-            isRootDir = (name.find(L'\\') == std::wstring::npos && name.find(L'/') == std::wstring::npos);
-            enabled = true;
-            return true;
-        }
-        catch (...)
-        {
-            enabled = false;
-            return false;
-        }
-    }
 };
 
 std::wstring LoadSevenZipPath()
@@ -101,79 +77,259 @@ std::vector<ArcInfo> Listup(const std::wstring& archiveFile, const std::wstring&
         return fileList;
     }
 
-    std::wstring arguments = L"\"" + sevenZipPath + L"\" l \"" + archiveFile + L"\"";
+    // 変わっていない書庫はインデックスの一覧を使い、なければ 7z l -slt -sccUTF-8 の出力を届いた分から順に解析する
+    std::vector<ArchiveIndexEntry> items;
+    ArchiveIndex::Shared().List(archiveFile, items, [&](std::vector<ArchiveIndexEntry>& out)
+    {
+        return SevenZipList(sevenZipPath, archiveFile, [&out](const SevenZipItem& item)
+        {
+            out.push_back({ item.path, item.isDir, item.size, item.packedSize, item.modified });
+        });
+    });
+    for (const auto& item : items)
+    {
+        ArcInfo ai;
+        ai.name = item.path;
+        ai.isDir = item.isDir;
+        ai.isRootDir = (ai.name.find(L'\\') == std::wstring::npos && ai.name.find(L'/') == std::wstring::npos);
+        ai.enabled = true;
+        fileList.push_back(ai);
+    }
 
-    HANDLE hReadPipe, hWritePipe;
-    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
-    
-    if (!CreatePipe(&hReadPipe, &hWritePipe, &sa, 0))
+    return fileList;
+}
+
+// ZIPはセントラルディレクトリを直接読んで一覧を作る（7z.exeを起動しない）
+void ListupZip(const ZipReader& zip, std::vector<ArcInfo>& fileList)
+{
+    fileList.clear();
+    for (const auto& entry : zip.Entries())
     {
-        return fileList;
+        ArcInfo ai;
+        ai.name = entry.WideName();
+        ai.isDir = entry.IsDirectory();
+        // 7zの一覧と同じく末尾の区切りは外してから判定する
+        while (!ai.name.empty() && (ai.name.back() == L'/' || ai.name.back() == L'\\'))
+        {
+            ai.name.pop_back();
+        }
+        ai.isRootDir = (ai.name.find(L'\\') == std::wstring::npos && ai.name.find(L'/') == std::wstring::npos);
+        ai.enabled = true;
+        fileList.push_back(ai);
     }
+}
 
-    STARTUPINFOW si = { sizeof(si) };
-    si.dwFlags = STARTF_USESTDHANDLES;
-    si.hStdOutput = hWritePipe;
-    si.hStdError = hWritePipe;
-    PROCESS_INFORMATION pi = {};
+// パスの1要素をWindowsで作れる名前にする（7-Zipと同じ規則）
+// 使えない文字と制御文字、末尾の'.'と空白は'_'にし、デバイス名（CON、COM1など）は先頭に'_'を付ける
+std::wstring CorrectNamePart(std::wstring part)
+{
+    for (auto& c : part)
+    {
+        if (c < 0x20 || std::wcschr(L"<>:\"|?*", c)) c = L'_';
+    }
+    if (!part.empty() && (part.back() == L'.' || part.back() == L' ')) part.back() = L'_';
+
+    std::wstring base = part.substr(0, part.find(L'.'));
+    std::transform(base.begin(), base.end(), base.begin(), ::towupper);
+    bool reserved = base == L"CON" || base == L"PRN" || base == L"AUX" || base == L"NUL"
+        || (base.size() == 4 && (base.compare(0, 3, L"COM") == 0 || base.compare(0, 3, L"LPT") == 0)
+            && base[3] >= L'1' && base[3] <= L'9');
+    if (reserved) part = L"_" + part;
+    return part;
+}
 
-    if (CreateProcessW(
-        nullptr,
-        const_cast<LPWSTR>(arguments.c_str()),
-        nullptr,
-        nullptr,
-        TRUE,
-        CREATE_NO_WINDOW,
-        nullptr,
-        nullptr,
-        &si,
-        &pi))
+// エントリ名を展開先からの相対パスにする。".."を含む名前はfalse
+bool SafeRelativePath(const std::wstring& name, fs::path& rel)
+{
+    rel.clear();
+    size_t start = 0;
+    while (start <= name.size())
     {
-        CloseHandle(hWritePipe);
+        size_t end = name.find_first_of(L"/\\", start);
+        if (end == std::wstring::npos) end = name.size();
+        std::wstring part = name.substr(start, end - start);
+        if (part == L"..") return false;
+        if (!part.empty() && part != L".") rel /= CorrectNamePart(part);
+        start = end + 1;
+    }
+    return !rel.empty();
+}
 
-        char buffer[4096];
-        DWORD bytesRead;
-        std::string output;
+// ZIPに記録されたMS-DOS形式（ローカル時刻）の日時をFILETIME（UTC）にする
+bool DosToFileTime(uint16_t dosDate, uint16_t dosTime, FILETIME& utc)
+{
+    FILETIME local;
+    return DosDateTimeToFileTime(dosDate, dosTime, &local) && LocalFileTimeToFileTime(&local, &utc);
+}
 
-        while (ReadFile(hReadPipe, buffer, sizeof(buffer) - 1, &bytesRead, nullptr) && bytesRead > 0)
+// ZIPに記録されたMS-DOS形式（ローカル時刻）の日時を更新日時に設定する（フォルダ用）
+void SetDosFileTime(const fs::path& path, uint16_t dosDate, uint16_t dosTime)
+{
+    FILETIME utc;
+    if (!DosToFileTime(dosDate, dosTime, utc))
+    {
+        return;
+    }
+    HANDLE h = CreateFileW(path.wstring().c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return;
+    SetFileTime(h, nullptr, nullptr, &utc);
+    CloseHandle(h);
+}
+
+// 展開したエントリを書き出す
+// 展開後のサイズは分かっているので先に領域を確保し（小さな書き込みで少しずつ伸ばすとHDDで断片化する）、
+// 固定サイズの整列したバッファにためてまとめて書く。更新日時は閉じる前に同じハンドルで1回だけ設定する
+// バッファは書庫1つにつき1つを使い回すので、エントリの大きさによらず使うメモリは一定
+class EntryWriter
+{
+public:
+    static constexpr size_t kBufferSize = 4 * 1024 * 1024;
+    static constexpr size_t kAlignment = 4096;
+
+    EntryWriter()
+        : buffer_(static_cast<uint8_t*>(::operator new(kBufferSize, std::align_val_t(kAlignment))))
+    {
+    }
+
+    ~EntryWriter()
+    {
+        Abort();
+        ::operator delete(buffer_, std::align_val_t(kAlignment));
+    }
+
+    EntryWriter(const EntryWriter&) = delete;
+    EntryWriter& operator=(const EntryWriter&) = delete;
+
+    bool Open(const fs::path& path, uint64_t size)
+    {
+        used_ = 0;
+        h_ = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h_ == INVALID_HANDLE_VALUE) return false;
+
+        // 1回の書き込みで済む大きさなら確保しなくても断片化しない
+        // 確保できないファイルシステム（ネットワークドライブなど）ではそのまま書く
+        if (size > kBufferSize)
         {
-            buffer[bytesRead] = '\0';
-            output += buffer;
+            FILE_ALLOCATION_INFO alloc = {};
+            alloc.AllocationSize.QuadPart = (LONGLONG)size;
+            SetFileInformationByHandle(h_, FileAllocationInfo, &alloc, sizeof(alloc));
         }
+        return true;
+    }
 
-        WaitForSingleObject(pi.hProcess, INFINITE);
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
-        CloseHandle(hReadPipe);
+    bool Write(const uint8_t* p, size_t n)
+    {
+        while (n > 0)
+        {
+            size_t m = (std::min)(n, kBufferSize - used_);
+            std::memcpy(buffer_ + used_, p, m);
+            used_ += m;
+            p += m;
+            n -= m;
+            if (used_ == kBufferSize && !Flush()) return false;
+        }
+        return true;
+    }
+
+    // 残りを書いて更新日時を設定し、閉じる（確保した領域の余りは閉じたときに解放される）
+    bool Close(const FILETIME* modified)
+    {
+        bool ok = Flush();
+        if (ok && modified) SetFileTime(h_, nullptr, nullptr, modified);
+        ok = CloseHandle(h_) && ok;
+        h_ = INVALID_HANDLE_VALUE;
+        return ok;
+    }
+
+    // 書きかけのまま閉じる（ファイルの削除は呼び出し側で行う）
+    void Abort()
+    {
+        if (h_ == INVALID_HANDLE_VALUE) return;
+        CloseHandle(h_);
+        h_ = INVALID_HANDLE_VALUE;
+    }
 
-        // Shift-JISからワイド文字に変換
-        int wideSize = MultiByteToWideChar(CP_OEMCP, 0, output.c_str(), -1, nullptr, 0);
-        if (wideSize > 0)
+private:
+    bool Flush()
+    {
+        if (used_ == 0) return true;
+        DWORD written = 0;
+        bool ok = WriteFile(h_, buffer_, (DWORD)used_, &written, nullptr) && written == used_;
+        used_ = 0;
+        return ok;
+    }
+
+    uint8_t* buffer_;
+    size_t used_ = 0;
+    HANDLE h_ = INVALID_HANDLE_VALUE;
+};
+
+// 内蔵リーダでZIPを展開する（*.scrは除く）
+// 7-Zipが対応していないzstd（メソッド93）のエントリもここで展開できる
+// 展開できないエントリがあっても報告して残りを続け、1つでも失敗したらfalse
+bool ExtractZip(ZipReader& zip, const fs::path& outDir, ProgressMeter& meter)
+{
+    std::vector<std::pair<fs::path, const ZipEntry*>> dirs;
+    EntryWriter out;
+    bool failed = false;
+    for (const auto& entry : zip.Entries())
+    {
+        fs::path rel;
+        if (!SafeRelativePath(entry.WideName(), rel))
+        {
+            meter.Print(L"Skipped unsafe path: " + entry.WideName(), true);
+            continue;
+        }
+        fs::path dest = outDir / rel;
+        if (entry.IsDirectory())
         {
-            std::vector<wchar_t> wideBuffer(wideSize);
-            MultiByteToWideChar(CP_OEMCP, 0, output.c_str(), -1, wideBuffer.data(), wideSize);
+            fs::create_directories(dest);
+            dirs.push_back({ dest, &entry });
+            continue;
+        }
 
-            std::wstring wideOutput(wideBuffer.data());
-            std::wistringstream stream(wideOutput);
-            std::wstring line;
+        std::wstring ext = rel.extension().wstring();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+        if (ext == L".scr") continue;
 
-            while (std::getline(stream, line))
-            {
-                ArcInfo ai;
-                if (ai.Parse(line))
-                {
-                    fileList.push_back(ai);
-                }
-            }
+        fs::create_directories(dest.parent_path());
+        if (!out.Open(dest, entry.usize))
+        {
+            meter.Print(L"Failed to create: " + dest.wstring(), true);
+            failed = true;
+            continue;
+        }
+        std::wstring error;
+        bool ok = zip.Extract(entry, [&out](const uint8_t* p, size_t n)
+        {
+            return out.Write(p, n);
+        }, &error);
+        FILETIME modified;
+        bool hasTime = ok && DosToFileTime(entry.dosDate, entry.dosTime, modified);
+        if (ok)
+        {
+            ok = out.Close(hasTime ? &modified : nullptr);
+        }
+        else
+        {
+            out.Abort();
+        }
+        if (!ok)
+        {
+            meter.Print(L"Failed to extract: " + entry.WideName() + L" (" + (error.empty() ? L"write error" : error) + L")", true);
+            std::error_code ec;
+            fs::remove(dest, ec);
+            failed = true;
         }
     }
-    else
+
+    // フォルダの日時は中身を書き終えてから設定する
+    for (const auto& d : dirs)
     {
-        CloseHandle(hWritePipe);
-        CloseHandle(hReadPipe);
+        SetDosFileTime(d.first, d.second->dosDate, d.second->dosTime);
     }
-
-    return fileList;
+    return !failed;
 }
 
 bool HasScrFileInArchive(const std::vector<ArcInfo>& fileList)
@@ -195,7 +351,11 @@ bool HasScrFileInArchive(const std::vector<ArcInfo>& fileList)
     return false;
 }
 
-bool ArcToDir(const std::wstring& filePath, const std::wstring& sevenZipPath)
+// 書庫を展開する。メッセージは並列に動く他のジョブと混ざらないようmeterを通して出す
+// interactiveがfalseなら7z.exeの出力は捨て、パスワードは空（-p）にして入力待ちにしない
+// そのとき7z.exeが失敗したら*retryをtrueにする（呼び出し側で、他の書庫が終わってから1つずつやり直す）
+bool ArcToDir(const std::wstring& filePath, const std::wstring& sevenZipPath, ProgressMeter& meter,
+              bool interactive, bool* retry)
 {
     try
     {
@@ -203,7 +363,7 @@ bool ArcToDir(const std::wstring& filePath, const std::wstring& sevenZipPath)
         
         if (!fs::exists(archiveFile) || !fs::is_regular_file(archiveFile))
         {
-            std::wcerr << L"Archive file not found: " << filePath << std::endl;
+            meter.Print(L"Archive file not found: " + filePath, true);
             return false;
         }
 
@@ -212,12 +372,31 @@ bool ArcToDir(const std::wstring& filePath, const std::wstring& sevenZipPath)
         
         if (ext != L".rar" && ext != L".zip")
         {
-            std::wcerr << L"Unsupported archive format: " << ext << std::endl;
+            meter.Print(L"Unsupported archive format: " + ext, true);
             return false;
         }
 
-        // アーカイブの内容をリストアップ
-        std::vector<ArcInfo> list = Listup(filePath, sevenZipPath);
+        // アーカイブの内容をリストアップ（ZIPはネイティブに読み、それ以外や読めない場合は7z）
+        // 7-Zipが展開できないzstdのエントリを含むZIPだけは内蔵リーダで展開する（ほかの方式がすべて展開できる場合）
+        // それ以外のZIPの展開は7z.exeに任せる
+        std::vector<ArcInfo> list;
+        ZipReader zip;
+        bool native = false;
+        if (ext == L".zip" && zip.Open(filePath))
+        {
+            ListupZip(zip, list);
+            native = std::any_of(zip.Entries().begin(), zip.Entries().end(), [](const ZipEntry& e)
+            {
+                return !e.IsDirectory() && e.method == 93;
+            }) && std::all_of(zip.Entries().begin(), zip.Entries().end(), [](const ZipEntry& e)
+            {
+                return e.IsDirectory() || e.IsExtractable();
+            });
+        }
+        else
+        {
+            list = Listup(filePath, sevenZipPath);
+        }
 
         int rc = 0; // ルートディレクトリ数
         int fc = 0; // ファイル数
@@ -237,6 +416,14 @@ bool ArcToDir(const std::wstring& filePath, const std::wstring& sevenZipPath)
         }
 
         std::wstring tmpDirStr = tmpDir.wstring();
+
+        if (native)
+        {
+            if (!ExtractZip(zip, tmpDir, meter)) return false;
+            meter.Print(L"Extracted to: " + tmpDirStr);
+            return true;
+        }
+
         // 引数を一気に組み立てる（スペースの入れ忘れを防止）
         std::wstringstream ss;
         ss << L"\"" << sevenZipPath << L"\"";
@@ -245,25 +432,42 @@ bool ArcToDir(const std::wstring& filePath, const std::wstring& sevenZipPath)
         ss << L" \"" << filePath << L"\"";         // アーカイブファイルパス
         ss << L" -o\"" << tmpDirStr << L"\"";      // 展開先
         ss << L" -y";                              // 全て「はい」
+        if (!interactive)
+        {
+            ss << L" -p";                          // パスワードは空（入力待ちにしない）
+        }
 
         std::wstring arguments = ss.str();
 
+        // 並列に動かすときは出力をNULに捨てる（他の7z.exeの進捗やこちらのメッセージと混ざらない）
         STARTUPINFOW si = { sizeof(si) };
         PROCESS_INFORMATION pi = {};
+        HANDLE hNul = INVALID_HANDLE_VALUE;
+        if (!interactive)
+        {
+            SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+            hNul = CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, nullptr);
+            si.dwFlags = STARTF_USESTDHANDLES;
+            si.hStdInput = hNul;
+            si.hStdOutput = hNul;
+            si.hStdError = hNul;
+        }
 
-        if (!CreateProcessW(
+        BOOL started = CreateProcessW(
             nullptr,
             const_cast<LPWSTR>(arguments.c_str()),
             nullptr,
             nullptr,
-            FALSE,
-            0,
+            !interactive,
+            interactive ? 0 : CREATE_NO_WINDOW,
             nullptr,
             nullptr,
             &si,
-            &pi))
+            &pi);
+        if (hNul != INVALID_HANDLE_VALUE) CloseHandle(hNul);
+        if (!started)
         {
-            std::wcerr << L"Failed to start 7z.exe" << std::endl;
+            meter.Print(L"Failed to start 7z.exe", true);
             return false;
         }
 
@@ -277,26 +481,148 @@ bool ArcToDir(const std::wstring& filePath, const std::wstring& sevenZipPath)
 
         if (exitCode == 0)
         {
-            std::wcout << L"Extracted to: " << tmpDirStr << std::endl;
+            meter.Print(L"Extracted to: " + tmpDirStr);
             return true;
         }
+        else if (!interactive && retry)
+        {
+            // パスワード付きの書庫などは、あとで7z.exeの出力を表示してやり直す
+            *retry = true;
+            return false;
+        }
         else
         {
-            std::wcerr << L"7z.exe failed with exit code: " << exitCode << std::endl;
+            meter.Printf(true, L"7z.exe failed with exit code: %lu (%ls)", (unsigned long)exitCode, filePath.c_str());
             return false;
         }
     }
     catch (const std::exception& ex)
     {
-        std::cerr << "Error: " << ex.what() << std::endl;
+        meter.Printf(true, L"Error: %S", ex.what());
         return false;
     }
 }
 
+// 7z.exe t で書庫をテストする（ZIP以外、または内蔵リーダで展開できない方式のZIP）
+// 並列に動かすので7z.exeの出力は捨て、パスワードは空（-p）にして入力待ちにしない
+bool TestWithSevenZip(const std::wstring& filePath, const std::wstring& sevenZipPath)
+{
+    std::wstring arguments = L"\"" + sevenZipPath + L"\" t -y -p \"" + filePath + L"\"";
+
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+    HANDLE hNul = CreateFileW(L"NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, nullptr);
+
+    STARTUPINFOW si = { sizeof(si) };
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdOutput = hNul;
+    si.hStdError = hNul;
+    PROCESS_INFORMATION pi = {};
+
+    BOOL started = CreateProcessW(nullptr, const_cast<LPWSTR>(arguments.c_str()), nullptr, nullptr, TRUE,
+                                  CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi);
+    if (hNul != INVALID_HANDLE_VALUE) CloseHandle(hNul);
+    if (!started) return false;
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD exitCode = 1;
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+    return exitCode == 0;
+}
+
+// 書庫のすべてのエントリを試しに展開し、壊れているものを報告する
+// ZIPは内蔵リーダでinflateしてCRC32を確かめ、それ以外は7z.exe t に任せる
+// 書庫ごとにCPUジョブとして並列に実行する
+int VerifyArchives(const std::vector<std::wstring>& files, const std::wstring& sevenZipPath)
+{
+    std::mutex outMtx;
+    std::vector<std::wstring> corruptFiles;
+    bool hasSevenZip = fs::exists(sevenZipPath);
+
+    JobScheduler scheduler;
+    for (const auto& filePath : files)
+    {
+        scheduler.Add(JobKind::Cpu, filePath, [&, filePath]
+        {
+            std::vector<std::wstring> problems;
+            bool ok = true;
+            bool native = false;
+
+            std::wstring ext = fs::path(filePath).extension().wstring();
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+            ZipReader reader;
+            if (ext == L".zip" && reader.Open(filePath))
+            {
+                native = std::all_of(reader.Entries().begin(), reader.Entries().end(), [](const ZipEntry& e)
+                {
+                    return e.IsDirectory() || e.IsExtractable();
+                });
+            }
+
+            if (native)
+            {
+                for (const auto& e : reader.Entries())
+                {
+                    if (e.IsDirectory()) continue;
+                    std::wstring error;
+                    if (!reader.Extract(e, [](const uint8_t*, size_t) { return true; }, &error))
+                    {
+                        ok = false;
+                        problems.push_back(e.WideName() + L": " + error);
+                    }
+                }
+            }
+            else if (hasSevenZip)
+            {
+                ok = TestWithSevenZip(filePath, sevenZipPath);
+            }
+            else
+            {
+                ok = false;
+                problems.push_back(L"7-Zip not found.");
+            }
+
+            std::lock_guard<std::mutex> lock(outMtx);
+            if (ok)
+            {
+                std::wcout << L"OK: " << filePath << std::endl;
+                return;
+            }
+            corruptFiles.push_back(filePath);
+            std::wcout << L"NG: " << filePath << std::endl;
+            for (const auto& p : problems)
+            {
+                std::wcout << L"    " << p << std::endl;
+            }
+        });
+    }
+    scheduler.Run();
+
+    std::wcout << L"Verified " << files.size() << L" archives, " << corruptFiles.size() << L" corrupt." << std::endl;
+    for (const auto& f : corruptFiles)
+    {
+        std::wcout << L"  " << f << std::endl;
+    }
+    return corruptFiles.empty() ? 0 : 2;
+}
+
 int wmain(int argc, wchar_t* argv[])
 {
     std::wstring sevenZipPath = LoadSevenZipPath();
-    
+
+    // --verify: 展開せずに書庫の整合性だけを調べる
+    if (argc > 1 && std::wstring(argv[1]) == L"--verify")
+    {
+        if (argc <= 2)
+        {
+            std::wcout << L"no params" << std::endl;
+            return 1;
+        }
+        return VerifyArchives(std::vector<std::wstring>(argv + 2, argv + argc), sevenZipPath);
+    }
+
     if (!fs::exists(sevenZipPath))
     {
         std::wcout << L"7-Zip not found." << std::endl;
@@ -309,10 +635,40 @@ int wmain(int argc, wchar_t* argv[])
         return 1;
     }
 
-    for (int i = 1; i < argc; i++)
+    // 展開は書き込みが主なので、同じ物理ディスクに対しては数を絞って同時に動かす
+    // 進捗は終わった書庫の数を1行で表示する（0.1秒ごと）
+    std::vector<std::wstring> retries;
+    std::mutex retryMtx;
+    {
+        ProgressMeter meter((size_t)(argc - 1), L"Extracting");
+        JobScheduler scheduler;
+        for (int i = 1; i < argc; i++)
+        {
+            fs::path filePath = argv[i];
+            scheduler.Add(JobKind::Io, filePath, [filePath, &sevenZipPath, &meter, &retries, &retryMtx]
+            {
+                ProgressMeter::Task& task = meter.Begin();
+                bool retry = false;
+                ArcToDir(filePath.wstring(), sevenZipPath, meter, false, &retry);
+                if (retry)
+                {
+                    std::lock_guard<std::mutex> lock(retryMtx);
+                    retries.push_back(filePath.wstring());
+                }
+                meter.End(task);
+            });
+        }
+        scheduler.Run();
+    }
+
+    // 7z.exeが失敗した書庫は、コンソールを1つずつ使ってやり直す（パスワードの入力もここで行う）
+    ProgressMeter console(retries.size(), L"Extracting");  // Beginしないので進捗は表示せず、メッセージを出すだけ
+    for (const auto& filePath : retries)
     {
-        ArcToDir(argv[i], sevenZipPath);
+        console.Print(L"Retrying with 7-Zip output: " + filePath);
+        ArcToDir(filePath, sevenZipPath, console, true, nullptr);
     }
+    ArchiveIndex::Shared().Save();
 
     return 0;
 }
\ No newline at end of file
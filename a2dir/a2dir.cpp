@@ -8,15 +8,27 @@
 #include <io.h>
 #include <iomanip>
 #include <cwchar> // fwprintf 用
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <chrono>
+#include <ctime>
 
 #include <bit7z/bit7zlibrary.hpp>
 #include <bit7z/bitfileextractor.hpp>
 #include <bit7z/bitinputarchive.hpp>
 
+#include "../common/ArchiveIndex.h"
+#include "../common/JobScheduler.h"
+#include "../common/ProgressMeter.h"
+
 namespace fs = std::filesystem;
 
+// これより小さいZIPは並列にしない（スレッドごとに書庫を開くコストの方が大きい）
+constexpr uint64_t kParallelExtractThreshold = 32ull * 1024 * 1024;
+
 // 安全なワイド文字出力ヘルパー
-void SafeWriteError(const std::string& msg) {
+void SafeWriteError(ProgressMeter& meter, const std::string& msg) {
     // string (UTF-8) を一度 wstring に戻す（表示用）
     int wsize = MultiByteToWideChar(CP_UTF8, 0, msg.c_str(), -1, NULL, 0);
     std::wstring wmsg(wsize, 0);
@@ -24,7 +36,7 @@ void SafeWriteError(const std::string& msg) {
 
     // std::wcerr が有効か確認
     if (std::wcerr.rdbuf() != nullptr) {
-        std::wcerr << L"bit7z Error: " << wmsg << std::endl;
+        meter.Print(L"bit7z Error: " + wmsg, true);
     }
     else {
         // ストリームが死んでいる場合は Windows のデバッガまたは標準エラー出力へ直接
@@ -42,50 +54,171 @@ std::string ToUtf8(const std::wstring& wstr) {
     return strTo;
 }
 
-// 単一ルートフォルダ判定
-bool HasSingleRootFolder(bit7z::Bit7zLibrary& lib, const fs::path& archivePath, const bit7z::BitInFormat& format) {
+std::wstring FromUtf8(const std::string& str) {
+    if (str.empty()) return std::wstring();
+    int size_needed = MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), NULL, 0);
+    std::wstring wstrTo(size_needed, 0);
+    MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), &wstrTo[0], size_needed);
+    return wstrTo;
+}
+
+// 更新日時を 7z -slt と同じ "YYYY-MM-DD hh:mm:ss"（ローカル時刻）にする
+// インデックスはr2zと共有していて、r2zはこの文字列をZIPのエントリの日時にするので空のまま記録しない
+// 書庫に日時が記録されていなければ空
+std::wstring ModifiedString(const bit7z::BitArchiveItem& item) {
     try {
-        bit7z::BitFileExtractor handler{ lib, format };
-        bit7z::BitInputArchive inputArchive{ handler, ToUtf8(archivePath.wstring()) };
+        std::time_t t = std::chrono::system_clock::to_time_t(item.lastWriteTime());
+        std::tm local = {};
+        if (localtime_s(&local, &t) != 0) return std::wstring();
+        wchar_t buf[32];
+        if (std::wcsftime(buf, sizeof(buf) / sizeof(buf[0]), L"%Y-%m-%d %H:%M:%S", &local) == 0) return std::wstring();
+        return buf;
+    }
+    catch (...) {
+        return std::wstring();
+    }
+}
+
+// 書庫の一覧（並びはbit7zのエントリ番号順なので、一覧での位置がそのままエントリ番号になる）
+// 一覧は共通のインデックスから取り、変わった書庫だけbit7zで開き直す
+bool ListArchive(bit7z::Bit7zLibrary& lib, const fs::path& archivePath, const bit7z::BitInFormat& format,
+                 std::vector<ArchiveIndexEntry>& items) {
+    return ArchiveIndex::Shared().List(archivePath, items, [&](std::vector<ArchiveIndexEntry>& out) {
+        try {
+            bit7z::BitFileExtractor handler{ lib, format };
+            bit7z::BitInputArchive inputArchive{ handler, ToUtf8(archivePath.wstring()) };
+            for (const auto& item : inputArchive) {
+                out.push_back({ FromUtf8(item.path()), item.isDir(), item.size(), item.packSize(), ModifiedString(item) });
+            }
+            return true;
+        }
+        catch (...) {
+            return false;
+        }
+    });
+}
+
+// 単一ルートフォルダ判定
+bool HasSingleRootFolder(const std::vector<ArchiveIndexEntry>& items) {
+    std::wstring commonRoot;
+    bool firstItem = true;
+    for (const auto& item : items) {
+        if (item.isDir) continue;
+
+        std::wstring path = item.path;
+        std::replace(path.begin(), path.end(), L'\\', L'/');
+
+        size_t pos = path.find_first_of(L'/');
+        if (pos == std::wstring::npos) return false; // ルート直下にファイルがある
+
+        std::wstring currentRoot = path.substr(0, pos);
+        if (firstItem) {
+            commonRoot = currentRoot;
+            firstItem = false;
+        }
+        else if (commonRoot != currentRoot) {
+            return false; // 複数のルートフォルダがある
+        }
+    }
+    return !commonRoot.empty();
+}
+
+// ZIPをエントリ単位で並列展開する
+// ZIPのエントリは互いに独立しているので、圧縮後サイズで偏りなくスレッドに振り分け、
+// スレッドごとに書庫を開いて自分の担当分だけを書き出す
+// 量の判定と振り分けはListArchiveの一覧で行い、書庫を開くのは展開するときだけ
+// 並列にするほどの量がない場合はfalseを返し、呼び出し側で通常の展開を行う
+bool ExtractZipParallel(bit7z::Bit7zLibrary& lib, const fs::path& archivePath, const std::vector<ArchiveIndexEntry>& items,
+                        ProgressMeter& meter, ProgressMeter::Task& task) {
+    struct Item {
+        uint32_t index;
+        uint64_t packSize;
+    };
+    std::vector<Item> files;
+    std::vector<uint32_t> dirs;
+    uint64_t totalSize = 0;
+
+    for (uint32_t index = 0; index < (uint32_t)items.size(); index++) {
+        const auto& item = items[index];
+        if (item.isDir) {
+            dirs.push_back(index);
+            continue;
+        }
+        std::wstring lower = item.path;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::towlower);
+        if (lower.size() >= 4 && lower.compare(lower.size() - 4, 4, L".scr") == 0) continue;
 
-        std::string commonRoot = "";
-        bool firstItem = true;
+        files.push_back({ index, item.packedSize });
+        totalSize += item.size;
+    }
 
-        for (const auto& item : inputArchive) {
-            if (item.isDir()) continue;
+    // 同時に動いている他の展開ジョブとコアを分け合う（ジョブ数×コア数のスレッドを立てない）
+    unsigned threads = (unsigned)(std::min)((size_t)JobScheduler::ThreadBudget(), files.size());
+    if (threads < 2 || totalSize < kParallelExtractThreshold) return false;
 
-            std::string path = item.path();
-            std::replace(path.begin(), path.end(), '\\', '/');
+    fs::path outputDir = HasSingleRootFolder(items) ? archivePath.parent_path() : archivePath.parent_path() / archivePath.stem();
+    if (!fs::exists(outputDir)) fs::create_directories(outputDir);
 
-            size_t pos = path.find_first_of('/');
-            if (pos == std::string::npos) return false; // ルート直下にファイルがある
+    // 圧縮後サイズの大きいものから、いちばん空いているスレッドに割り当てる
+    std::sort(files.begin(), files.end(), [](const Item& a, const Item& b) { return a.packSize > b.packSize; });
+    std::vector<std::vector<uint32_t>> indices(threads);
+    std::vector<uint64_t> load(threads, 0);
+    for (const auto& f : files) {
+        size_t t = std::min_element(load.begin(), load.end()) - load.begin();
+        indices[t].push_back(f.index);
+        load[t] += f.packSize + 1;
+    }
+    // 空のフォルダも作られるようにフォルダは先頭のスレッドに任せる
+    indices[0].insert(indices[0].end(), dirs.begin(), dirs.end());
 
-            std::string currentRoot = path.substr(0, pos);
-            if (firstItem) {
-                commonRoot = currentRoot;
-                firstItem = false;
+    meter.Print(L"Processing: " + archivePath.filename().wstring() + L" (" + std::to_wstring(threads) + L" threads)");
+    task.SetTotal(totalSize);
+
+    // スレッドごとの進み具合の差分だけをジョブの合計に足す（ロックも出力もしない）
+    std::vector<std::atomic<uint64_t>> completed(threads);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            try {
+                bit7z::BitFileExtractor handler{ lib, bit7z::BitFormat::Zip };
+                handler.setProgressCallback([&, t](uint64_t done) {
+                    uint64_t prev = completed[t].exchange(done, std::memory_order_relaxed);
+                    if (done > prev) task.Add(done - prev);
+                    return true;
+                    });
+                bit7z::BitInputArchive inputArchive{ handler, ToUtf8(archivePath.wstring()) };
+                inputArchive.extractTo(ToUtf8(outputDir.wstring()), indices[t]);
             }
-            else if (commonRoot != currentRoot) {
-                return false; // 複数のルートフォルダがある
+            catch (...) {
+                errors[t] = std::current_exception();
             }
-        }
-        return !commonRoot.empty();
+            });
     }
-    catch (...) {
-        return false;
+    for (auto& w : workers) w.join();
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
     }
+
+    meter.Print(L"Success: " + archivePath.filename().wstring());
+    return true;
 }
 
 // 展開処理
-bool ExtractIndividual(bit7z::Bit7zLibrary& lib, const fs::path& archivePath) {
+bool ExtractIndividual(bit7z::Bit7zLibrary& lib, const fs::path& archivePath, ProgressMeter& meter, ProgressMeter::Task& task) {
     try {
         std::wstring ext = archivePath.extension().wstring();
         std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
         if (ext != L".zip" && ext != L".rar") return false;
 
         const auto& format = (ext == L".rar") ? bit7z::BitFormat::Rar : bit7z::BitFormat::Zip;
+        std::vector<ArchiveIndexEntry> items;
+        bool listed = ListArchive(lib, archivePath, format, items);
+
+        // ZIPで量が多ければエントリ単位で並列に展開する（RARはソリッド圧縮があるので順番に）
+        if (listed && ext == L".zip" && ExtractZipParallel(lib, archivePath, items, meter, task)) return true;
 
-        fs::path outputDir = HasSingleRootFolder(lib, archivePath, format)
+        fs::path outputDir = listed && HasSingleRootFolder(items)
             ? archivePath.parent_path()
             : archivePath.parent_path() / archivePath.stem();
 
@@ -94,22 +227,18 @@ bool ExtractIndividual(bit7z::Bit7zLibrary& lib, const fs::path& archivePath) {
         bit7z::BitFileExtractor extractor{ lib, format };
 
         // --- プログレス表示の設定 ---
-        uint64_t totalSize = 0;
-        extractor.setTotalCallback([&totalSize](uint64_t total) {
-            totalSize = total;
+        // 数を書き換えるだけ（表示はProgressMeterのスレッドが全書庫の合計をまとめて行う）
+        extractor.setTotalCallback([&task](uint64_t total) {
+            task.SetTotal(total);
             });
 
-        extractor.setProgressCallback([&totalSize](uint64_t completed) {
-            if (totalSize > 0) {
-                int percent = static_cast<int>((completed * 100) / totalSize);
-                std::wcout << L"\rProgress: " << percent << L"% ("
-                    << (completed / 1024) << L" / " << (totalSize / 1024) << L" KB)" << std::flush;
-            }
+        extractor.setProgressCallback([&task](uint64_t completed) {
+            task.Update(completed);
             return true; // false を返すとキャンセル
             });
         // ---------------------------
 
-        std::wcout << L"\nProcessing: " << archivePath.filename().wstring() << std::endl;
+        meter.Print(L"Processing: " + archivePath.filename().wstring());
 
         extractor.extractMatching(
             ToUtf8(archivePath.wstring()),
@@ -118,11 +247,15 @@ bool ExtractIndividual(bit7z::Bit7zLibrary& lib, const fs::path& archivePath) {
             bit7z::FilterPolicy::Exclude
         );
 
-        std::wcout << L"\nSuccess!" << std::endl;
+        meter.Print(L"Success: " + archivePath.filename().wstring());
         return true;
     }
     catch (const bit7z::BitException& ex) {
-        SafeWriteError(ex.what());
+        SafeWriteError(meter, ex.what());
+        return false;
+    }
+    catch (const std::exception& ex) {
+        meter.Printf(true, L"Error: %S", ex.what());
         return false;
     }
 }
@@ -139,10 +272,26 @@ int main() {
         wchar_t** wargv = CommandLineToArgvW(GetCommandLineW(), &wargc);
         if (!wargv) return 1;
 
+        std::vector<fs::path> targets;
         for (int i = 1; i < wargc; ++i) {
             fs::path p = wargv[i];
-            if (fs::exists(p)) ExtractIndividual(lib, p);
+            if (fs::exists(p)) targets.push_back(p);
+        }
+
+        // 進捗は全書庫の合計を1行で表示する（0.1秒ごと）
+        ProgressMeter meter(targets.size(), L"Extracting");
+        // 展開は書き込みが主なので、同じ物理ディスクに対しては数を絞って同時に動かす
+        JobScheduler scheduler;
+        for (const auto& p : targets) {
+            scheduler.Add(JobKind::Io, p, [&lib, &meter, p] {
+                ProgressMeter::Task& task = meter.Begin();
+                ExtractIndividual(lib, p, meter, task);
+                meter.End(task);
+                });
         }
+        scheduler.Run();
+        meter.Stop();
+        ArchiveIndex::Shared().Save();
         LocalFree(wargv);
     }
     catch (const bit7z::BitException& ex) {
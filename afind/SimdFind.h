@@ -0,0 +1,67 @@
+﻿#pragma once
+// バイト列の部分文字列検索（SSE2）
+// 探す文字列の先頭と末尾のバイトを16か所まとめて比べ、両方が一致した位置だけmemcmpで確かめる
+// SSE2が使えない環境ではmemchrとmemcmpで探す
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SIMDFIND_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace simdfind_detail {
+
+// 1ビット目の位置（maskは0でない）
+inline unsigned LowestBit(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+inline const uint8_t* Scalar(const uint8_t* hay, size_t size, const uint8_t* needle, size_t len) {
+    const uint8_t* end = hay + size - len + 1;
+    for (const uint8_t* p = hay; p < end;) {
+        p = static_cast<const uint8_t*>(std::memchr(p, needle[0], (size_t)(end - p)));
+        if (!p) return nullptr;
+        if (std::memcmp(p + 1, needle + 1, len - 1) == 0) return p;
+        p++;
+    }
+    return nullptr;
+}
+
+} // namespace simdfind_detail
+
+// hay[0..size)の中でneedle[0..len)が最初に現れる位置。見つからなければnullptr
+inline const uint8_t* SimdFind(const uint8_t* hay, size_t size, const uint8_t* needle, size_t len) {
+    if (len == 0) return hay;
+    if (size < len) return nullptr;
+    if (len == 1) return static_cast<const uint8_t*>(std::memchr(hay, needle[0], size));
+#ifdef SIMDFIND_USE_SSE2
+    const __m128i first = _mm_set1_epi8((char)needle[0]);
+    const __m128i last = _mm_set1_epi8((char)needle[len - 1]);
+    size_t i = 0;
+    // hay[i + len - 1 + 15]まで読めるあいだ16か所ずつ調べる
+    for (; i + len + 15 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            unsigned bit = simdfind_detail::LowestBit(mask);
+            if (std::memcmp(hay + i + bit + 1, needle + 1, len - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return simdfind_detail::Scalar(hay + i, size - i, needle, len);
+#else
+    return simdfind_detail::Scalar(hay, size, needle, len);
+#endif
+}
@@ -0,0 +1,320 @@
+﻿// afind.cpp : 書庫を展開せずに中のファイル名・テキストを検索する
+// ファイル名はセントラルディレクトリだけを読んで照合し、-t 指定時はテキストのエントリをメモリ上で少しずつ展開しながら探す
+// 書庫は共通のスケジューラで並列に処理し、ディスクには何も書かない
+//
+
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cwctype>
+#include <fcntl.h>
+#include <filesystem>
+#include <io.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../common/JobScheduler.h"
+#include "../common/ZipReader.h"
+#include "SimdFind.h"
+
+namespace fs = std::filesystem;
+
+struct SearchOptions {
+    std::wstring name;                  // エントリ名のパターン（小文字。*と?が使える。なければ部分一致）
+    std::vector<std::string> needles;   // 探すテキストのバイト列（UTF-8とCP932）
+    bool allEntries = false;            // テキスト以外のエントリも中身を探す
+};
+
+// テキストとして中身を探すエントリの拡張子
+const wchar_t* const kTextExtensions[] = {
+    L".txt", L".xml", L".htm", L".html", L".xhtml", L".css", L".js", L".json", L".csv", L".tsv",
+    L".md", L".ini", L".cfg", L".log", L".nfo", L".srt", L".ass", L".opf", L".ncx", L".yaml", L".yml",
+};
+
+std::wstring ToLower(std::wstring s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](wchar_t c) { return (wchar_t)std::towlower(c); });
+    return s;
+}
+
+std::string ToMultiByte(UINT codePage, const std::wstring& s)
+{
+    if (s.empty()) return std::string();
+    int n = WideCharToMultiByte(codePage, 0, s.c_str(), (int)s.size(), nullptr, 0, nullptr, nullptr);
+    std::string ret(n, 0);
+    WideCharToMultiByte(codePage, 0, s.c_str(), (int)s.size(), &ret[0], n, nullptr, nullptr);
+    return ret;
+}
+
+bool IsTextEntry(const std::wstring& lowerName)
+{
+    for (const wchar_t* ext : kTextExtensions)
+    {
+        size_t n = std::wcslen(ext);
+        if (lowerName.size() >= n && lowerName.compare(lowerName.size() - n, n, ext) == 0) return true;
+    }
+    return false;
+}
+
+// *と?のワイルドカード照合（どちらもなければ部分一致）。パス全体とファイル名のどちらかに一致すればよい
+bool NameMatches(const std::wstring& pattern, const std::wstring& text)
+{
+    if (pattern.find_first_of(L"*?") == std::wstring::npos)
+    {
+        return text.find(pattern) != std::wstring::npos;
+    }
+    size_t p = 0, t = 0, star = std::wstring::npos, mark = 0;
+    while (t < text.size())
+    {
+        if (p < pattern.size() && (pattern[p] == L'?' || pattern[p] == text[t]))
+        {
+            p++;
+            t++;
+        }
+        else if (p < pattern.size() && pattern[p] == L'*')
+        {
+            star = p++;
+            mark = t;
+        }
+        else if (star != std::wstring::npos)
+        {
+            p = star + 1;
+            t = ++mark;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == L'*') p++;
+    return p == pattern.size();
+}
+
+// 展開されたデータを少しずつ受け取りながら探す
+// チャンクの境目をまたぐ一致は、前のチャンクの末尾と次のチャンクの先頭をつないだ部分だけで確かめる
+class StreamMatcher
+{
+public:
+    explicit StreamMatcher(const std::vector<std::string>& needles) : needles_(needles)
+    {
+        for (const auto& n : needles_) maxLen_ = (std::max)(maxLen_, n.size());
+    }
+
+    // 見つかったらtrue
+    bool Feed(const uint8_t* data, size_t size)
+    {
+        if (found_) return true;
+        if (!tail_.empty())
+        {
+            size_t head = (std::min)(size, maxLen_ - 1);
+            joint_.assign(tail_.begin(), tail_.end());
+            joint_.insert(joint_.end(), data, data + head);
+            if (Search(joint_.data(), joint_.size())) return found_ = true;
+        }
+        if (Search(data, size)) return found_ = true;
+
+        // 次のチャンクとの境目用に末尾を残す
+        size_t keep = maxLen_ - 1;
+        if (size >= keep)
+        {
+            tail_.assign(data + size - keep, data + size);
+        }
+        else
+        {
+            tail_.insert(tail_.end(), data, data + size);
+            if (tail_.size() > keep) tail_.erase(tail_.begin(), tail_.end() - keep);
+        }
+        return false;
+    }
+
+    bool Found() const { return found_; }
+
+private:
+    bool Search(const uint8_t* data, size_t size) const
+    {
+        for (const auto& n : needles_)
+        {
+            if (SimdFind(data, size, reinterpret_cast<const uint8_t*>(n.data()), n.size())) return true;
+        }
+        return false;
+    }
+
+    const std::vector<std::string>& needles_;
+    size_t maxLen_ = 1;
+    std::vector<uint8_t> tail_;
+    std::vector<uint8_t> joint_;
+    bool found_ = false;
+};
+
+// 1つの書庫を調べて、一致したエントリ名を返す
+bool SearchArchive(const fs::path& archive, const SearchOptions& options, std::vector<std::wstring>& matches)
+{
+    ZipReader reader;
+    if (!reader.Open(archive)) return false;
+
+    for (const auto& entry : reader.Entries())
+    {
+        if (entry.IsDirectory()) continue;
+        std::wstring name = entry.WideName();
+        std::wstring lower = ToLower(name);
+        if (!options.name.empty() && !NameMatches(options.name, lower)
+            && !NameMatches(options.name, lower.substr(lower.find_last_of(L"/\\") + 1)))
+        {
+            continue;
+        }
+
+        if (options.needles.empty())
+        {
+            matches.push_back(name);
+            continue;
+        }
+        if (!entry.IsExtractable() || (!options.allEntries && !IsTextEntry(lower))) continue;
+
+        // 見つかった時点でsinkがfalseを返して展開を打ち切る
+        StreamMatcher matcher(options.needles);
+        reader.Extract(entry, [&matcher](const uint8_t* p, size_t n) { return !matcher.Feed(p, n); });
+        if (matcher.Found()) matches.push_back(name);
+    }
+    return true;
+}
+
+bool IsZipPath(const fs::path& path)
+{
+    std::wstring ext = ToLower(path.extension().wstring());
+    return ext == L".zip" || ext == L".cbz";
+}
+
+// 引数のファイルと、フォルダの中（サブフォルダも含む）のzip/cbzを集める
+std::vector<fs::path> CollectArchives(const std::vector<std::wstring>& targets)
+{
+    std::vector<fs::path> files;
+    for (const auto& t : targets)
+    {
+        fs::path path(t);
+        std::error_code ec;
+        if (fs::is_directory(path, ec))
+        {
+            for (auto it = fs::recursive_directory_iterator(path, fs::directory_options::skip_permission_denied, ec);
+                 !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+            {
+                if (it->is_regular_file(ec) && IsZipPath(it->path())) files.push_back(it->path());
+            }
+        }
+        else if (fs::is_regular_file(path, ec))
+        {
+            files.push_back(path);
+        }
+        else
+        {
+            std::wcerr << L"Not found: " << t << std::endl;
+        }
+    }
+    return files;
+}
+
+void Usage()
+{
+    std::wcout << L"Usage: afind [-n <name>] [-t <text>] [-a] [-j <n>] <archive|dir>..." << std::endl;
+    std::wcout << L"  -n <name> : match entry names (case-insensitive, * and ? allowed, otherwise substring)" << std::endl;
+    std::wcout << L"  -t <text> : search the contents of text entries (UTF-8 and Shift_JIS)" << std::endl;
+    std::wcout << L"  -a        : with -t, search every entry instead of text entries only" << std::endl;
+    std::wcout << L"  -j <n>    : number of archives searched in parallel with -t (default: cores)" << std::endl;
+    std::wcout << L"Folders are searched recursively for *.zip and *.cbz. Nothing is extracted to disk." << std::endl;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    _setmode(_fileno(stdout), _O_U16TEXT);
+    _setmode(_fileno(stderr), _O_U16TEXT);
+
+    SearchOptions options;
+    std::wstring text;
+    unsigned jobs = 0;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == L'-'; argi++)
+    {
+        std::wstring op = argv[argi];
+        if (op == L"-n" && argi + 1 < argc)
+        {
+            options.name = ToLower(argv[++argi]);
+        }
+        else if (op == L"-t" && argi + 1 < argc)
+        {
+            text = argv[++argi];
+        }
+        else if (op == L"-a")
+        {
+            options.allEntries = true;
+        }
+        else if (op == L"-j" && argi + 1 < argc)
+        {
+            long n = std::wcstol(argv[++argi], nullptr, 10);
+            if (n <= 0)
+            {
+                Usage();
+                return 1;
+            }
+            jobs = (unsigned)n;
+        }
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+    if (argi >= argc || (options.name.empty() && text.empty()))
+    {
+        Usage();
+        return 1;
+    }
+    if (!text.empty())
+    {
+        // 書庫の中のテキストはUTF-8かShift_JISが多いので両方の表現で探す
+        options.needles.push_back(ToMultiByte(CP_UTF8, text));
+        std::string sjis = ToMultiByte(932, text);
+        if (!sjis.empty() && sjis != options.needles[0]) options.needles.push_back(sjis);
+    }
+
+    std::vector<std::wstring> targets(argv + argi, argv + argc);
+    std::vector<fs::path> archives = CollectArchives(targets);
+    auto t0 = std::chrono::steady_clock::now();
+
+    // 名前だけならセントラルディレクトリを読むだけなのでI/Oジョブ、中身も探すなら展開があるのでCPUジョブにする
+    JobKind kind = options.needles.empty() ? JobKind::Io : JobKind::Cpu;
+    JobScheduler scheduler(jobs, 0);
+    std::mutex outMtx;
+    std::atomic<size_t> matchedArchives{ 0 }, matchedEntries{ 0 }, failed{ 0 };
+    for (const auto& archive : archives)
+    {
+        scheduler.Add(kind, archive, [&, archive] {
+            std::vector<std::wstring> matches;
+            if (!SearchArchive(archive, options, matches))
+            {
+                failed++;
+                std::lock_guard<std::mutex> lock(outMtx);
+                std::wcerr << L"Not a valid ZIP file: " << archive.wstring() << std::endl;
+                return;
+            }
+            if (matches.empty()) return;
+            matchedArchives++;
+            matchedEntries += matches.size();
+            // 書庫ごとにまとめて出力する（他の書庫の行と混ざらない）
+            std::lock_guard<std::mutex> lock(outMtx);
+            for (const auto& m : matches)
+            {
+                std::wcout << archive.wstring() << L": " << m << L"\n";
+            }
+            std::wcout.flush();
+        });
+    }
+    scheduler.Run();
+
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::wcerr << matchedEntries.load() << L" match(es) in " << matchedArchives.load() << L" of " << archives.size()
+        << L" archive(s)";
+    if (failed) std::wcerr << L", " << failed.load() << L" unreadable";
+    std::wcerr << L" (" << sec << L" s)" << std::endl;
+    return matchedEntries ? 0 : 1;
+}
@@ -0,0 +1,393 @@
+﻿#pragma once
+// 書庫の一覧（エントリ表）をディスクに保存して使い回すインデックス
+// 書庫のパス・サイズ・更新日時をキーにするので、変わっていない書庫は7z.exeやbit7zで一覧を取り直さない
+// a2d / r2z / a2dir で同じファイル（%LOCALAPPDATA%\cmds\ArchiveIndex.dat）を共有する
+// ファイルは記録を順に並べたもので、保存時は変わった書庫の記録だけを末尾に追記する（同じ書庫は後の記録が有効）
+// 古い記録がたまったときと1週間ごとに、消えた書庫の記録を除いて一時ファイル経由で書き直す
+// 書き込みはロックファイル（ArchiveIndex.dat.lock）で他のプロセスと順番にする
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cwctype>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+struct ArchiveIndexEntry {
+    std::wstring path;          // 書庫の中のパス（区切りは書庫に記録されたまま）
+    bool isDir = false;
+    uint64_t size = 0;
+    uint64_t packedSize = 0;
+    std::wstring modified;      // 7z -slt と同じ "YYYY-MM-DD hh:mm:ss" 形式（分からなければ空）
+};
+
+class ArchiveIndex {
+public:
+    // プロセス内で共有するインデックス（最初に使ったときに既定の場所から読む）
+    static ArchiveIndex& Shared() {
+        static ArchiveIndex index(DefaultPath());
+        return index;
+    }
+
+    explicit ArchiveIndex(std::filesystem::path file) : file_(std::move(file)) {
+        loaded_ = Load(file_, records_);
+    }
+
+    ArchiveIndex(const ArchiveIndex&) = delete;
+    ArchiveIndex& operator=(const ArchiveIndex&) = delete;
+
+    // 書庫のサイズと更新日時が記録と同じならエントリ表を返す
+    bool Find(const std::filesystem::path& archive, std::vector<ArchiveIndexEntry>& entries) {
+        Stamp stamp;
+        if (!GetStamp(archive, stamp)) return false;
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = records_.find(Key(archive));
+        if (it == records_.end() || it->second.size != stamp.size || it->second.mtime != stamp.mtime) {
+            misses_++;
+            return false;
+        }
+        hits_++;
+        entries = it->second.entries;
+        return true;
+    }
+
+    void Store(const std::filesystem::path& archive, std::vector<ArchiveIndexEntry> entries) {
+        Record r;
+        if (!GetStamp(archive, r)) return;
+        r.entries = std::move(entries);
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::wstring key = Key(archive);
+        records_[key] = std::move(r);
+        changed_.insert(key);
+    }
+
+    // インデックスになければlisterで一覧を作って記録する。listerが失敗したらfalse（記録しない）
+    bool List(const std::filesystem::path& archive, std::vector<ArchiveIndexEntry>& entries,
+              const std::function<bool(std::vector<ArchiveIndexEntry>&)>& lister) {
+        if (Find(archive, entries)) return true;
+        entries.clear();
+        if (!lister(entries)) return false;
+        Store(archive, entries);
+        return true;
+    }
+
+    // 変更があればファイルに書く。他のプロセスが先に保存していた記録も残す
+    bool Save() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (changed_.empty()) return true;
+        std::error_code ec;
+        std::filesystem::create_directories(file_.parent_path(), ec);
+        FileLock fileLock(std::filesystem::path(file_) += L".lock");
+        if (!fileLock.Locked()) return false;
+
+        bool ok = NeedsCompaction() ? Compact() : Append();
+        if (ok) changed_.clear();
+        return ok;
+    }
+
+    size_t Hits() const { return hits_; }
+    size_t Misses() const { return misses_; }
+
+    static std::filesystem::path DefaultPath() {
+#ifdef _WIN32
+        wchar_t* base = nullptr;
+        size_t len = 0;
+        if (_wdupenv_s(&base, &len, L"LOCALAPPDATA") == 0 && base) {
+            std::filesystem::path p = std::filesystem::path(base) / L"cmds" / L"ArchiveIndex.dat";
+            free(base);
+            return p;
+        }
+#endif
+        std::error_code ec;
+        return std::filesystem::temp_directory_path(ec) / L"cmds" / L"ArchiveIndex.dat";
+    }
+
+private:
+    static constexpr uint32_t kMagic = 0x58444941;  // "AIDX"
+    static constexpr uint32_t kVersion = 2;                 // 1はa2dirの記録に更新日時がなかった
+    static constexpr int64_t kCompactInterval = 7 * 24 * 60 * 60;  // 書き直しの間隔（秒）
+    static constexpr size_t kHeaderSize = 16;                  // magic, version, compactedAt
+
+    struct Stamp {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+    };
+    struct Record : Stamp {
+        std::vector<ArchiveIndexEntry> entries;
+    };
+    // ファイルを読んだ結果
+    struct FileState {
+        bool valid = false;         // 形式が合っていた
+        bool damaged = false;       // 途中で読めなくなった（書きかけの追記など）
+        size_t records = 0;         // 同じ書庫の古い記録も含めた数
+        int64_t compactedAt = 0;    // 最後に書き直した時刻（UNIX時間）
+    };
+
+    // 保存中に他のプロセスが書かないようにするロック
+    // Windowsは共有なしでロックファイルを開き、開けなければ少し待ってやり直す
+    class FileLock {
+    public:
+        explicit FileLock(const std::filesystem::path& path) {
+#ifdef _WIN32
+            for (int i = 0; i < 200; i++) {
+                h_ = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (h_ != INVALID_HANDLE_VALUE || GetLastError() != ERROR_SHARING_VIOLATION) break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+#else
+            fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd_ >= 0 && flock(fd_, LOCK_EX) != 0) {
+                close(fd_);
+                fd_ = -1;
+            }
+#endif
+        }
+        ~FileLock() {
+#ifdef _WIN32
+            if (h_ != INVALID_HANDLE_VALUE) CloseHandle(h_);
+#else
+            if (fd_ >= 0) close(fd_);
+#endif
+        }
+        FileLock(const FileLock&) = delete;
+        FileLock& operator=(const FileLock&) = delete;
+
+#ifdef _WIN32
+        bool Locked() const { return h_ != INVALID_HANDLE_VALUE; }
+    private:
+        HANDLE h_ = INVALID_HANDLE_VALUE;
+#else
+        bool Locked() const { return fd_ >= 0; }
+    private:
+        int fd_ = -1;
+#endif
+    };
+
+    static int64_t Now() {
+        return (int64_t)std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // 古い記録が生きている記録より多いか、前回の書き直しから間があいたら書き直す
+    bool NeedsCompaction() const {
+        if (!loaded_.valid || loaded_.damaged) return true;
+        size_t written = loaded_.records + changed_.size();
+        return written > records_.size() * 2 || Now() - loaded_.compactedAt > kCompactInterval;
+    }
+
+    // 記録した書庫の分だけを末尾に書き足す（ファイルロックを持って呼ぶ）
+    bool Append() {
+        {
+            // 他のプロセスが消したり形式の違うものに置き換えたりしていたら書き直す
+            std::ifstream in(file_, std::ios::binary);
+            std::vector<uint8_t> head(kHeaderSize);
+            if (!in.read(reinterpret_cast<char*>(head.data()), (std::streamsize)head.size())) return Compact();
+            Cursor c{ head.data(), head.data() + head.size() };
+            uint32_t magic = 0, version = 0;
+            if (!c.Get(magic) || magic != kMagic || !c.Get(version) || version != kVersion) return Compact();
+        }
+        std::vector<uint8_t> buf;
+        for (const auto& key : changed_) PutRecord(buf, key, records_[key]);
+        std::ofstream out(file_, std::ios::binary | std::ios::app);
+        if (!out.write(reinterpret_cast<const char*>(buf.data()), (std::streamsize)buf.size()) || !out.flush()) {
+            loaded_.damaged = true;  // 書きかけが残ったかもしれないので次は書き直す
+            return false;
+        }
+        loaded_.records += changed_.size();
+        return true;
+    }
+
+    // ファイルを読み直して記録した分とまとめ、消えた書庫の記録を除いて置き換える（ファイルロックを持って呼ぶ）
+    bool Compact() {
+        std::map<std::wstring, Record> merged;
+        Load(file_, merged);
+        for (const auto& key : changed_) merged[key] = records_[key];
+        for (auto it = merged.begin(); it != merged.end();) {
+            std::error_code ec;
+            bool exists = std::filesystem::exists(it->first, ec);
+            if (!exists && !ec) it = merged.erase(it);  // 調べられなかった（ネットワークが切れているなど）ものは残す
+            else ++it;
+        }
+
+        int64_t now = Now();
+        std::vector<uint8_t> buf;
+        Put(buf, kMagic);
+        Put(buf, kVersion);
+        Put(buf, now);
+        for (const auto& r : merged) PutRecord(buf, r.first, r.second);
+
+        std::error_code ec;
+        std::filesystem::path tmp = file_;
+        tmp += L"." + std::to_wstring(ProcessId()) + L".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out.write(reinterpret_cast<const char*>(buf.data()), (std::streamsize)buf.size())) {
+                out.close();
+                std::filesystem::remove(tmp, ec);
+                return false;
+            }
+        }
+        std::filesystem::rename(tmp, file_, ec);
+        if (ec) {
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+        loaded_.valid = true;
+        loaded_.damaged = false;
+        loaded_.records = merged.size();
+        loaded_.compactedAt = now;
+        records_ = std::move(merged);
+        return true;
+    }
+
+    static bool GetStamp(const std::filesystem::path& archive, Stamp& stamp) {
+        std::error_code ec;
+        stamp.size = std::filesystem::file_size(archive, ec);
+        if (ec) return false;
+        auto t = std::filesystem::last_write_time(archive, ec);
+        if (ec) return false;
+        stamp.mtime = (int64_t)t.time_since_epoch().count();
+        return true;
+    }
+
+    // 絶対パス（Windowsは大文字小文字を区別しないので小文字にする）
+    static std::wstring Key(const std::filesystem::path& archive) {
+        std::error_code ec;
+        std::wstring key = std::filesystem::absolute(archive, ec).lexically_normal().wstring();
+#ifdef _WIN32
+        std::transform(key.begin(), key.end(), key.begin(), [](wchar_t c) { return (wchar_t)std::towlower(c); });
+#endif
+        return key;
+    }
+
+    static unsigned long ProcessId() {
+#ifdef _WIN32
+        return GetCurrentProcessId();
+#else
+        return (unsigned long)getpid();
+#endif
+    }
+
+    template <class T>
+    static void Put(std::vector<uint8_t>& buf, T v) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&v);
+        buf.insert(buf.end(), p, p + sizeof(T));
+    }
+
+    static void PutRecord(std::vector<uint8_t>& buf, const std::wstring& key, const Record& r) {
+        PutString(buf, key);
+        Put(buf, r.size);
+        Put(buf, r.mtime);
+        Put(buf, (uint32_t)r.entries.size());
+        for (const auto& e : r.entries) {
+            PutString(buf, e.path);
+            Put(buf, (uint8_t)(e.isDir ? 1 : 0));
+            Put(buf, e.size);
+            Put(buf, e.packedSize);
+            PutString(buf, e.modified);
+        }
+    }
+
+    // UTF-16の符号単位で保存する（Linuxのwchar_tは32bitなので16bitに詰める）
+    static void PutString(std::vector<uint8_t>& buf, const std::wstring& s) {
+        Put(buf, (uint32_t)s.size());
+        for (wchar_t c : s) Put(buf, (uint16_t)c);
+    }
+
+    // 壊れたファイルを読んでも範囲外を読まないよう、残りの長さを確かめながら読む
+    struct Cursor {
+        const uint8_t* p;
+        const uint8_t* end;
+
+        template <class T>
+        bool Get(T& v) {
+            if ((size_t)(end - p) < sizeof(T)) return false;
+            std::memcpy(&v, p, sizeof(T));
+            p += sizeof(T);
+            return true;
+        }
+        bool GetString(std::wstring& s) {
+            uint32_t n;
+            if (!Get(n) || (size_t)(end - p) / 2 < n) return false;
+            s.resize(n);
+            for (uint32_t i = 0; i < n; i++) {
+                uint16_t c = 0;
+                Get(c);
+                s[i] = (wchar_t)c;
+            }
+            return true;
+        }
+    };
+
+    // 読めない・形式が違う場合は空のまま（次の保存で作り直す）
+    // 途中で読めなくなった場合はそこまでの記録を使う
+    static FileState Load(const std::filesystem::path& file, std::map<std::wstring, Record>& records) {
+        FileState state;
+        std::ifstream in(file, std::ios::binary | std::ios::ate);
+        if (!in) return state;
+        std::streamsize size = in.tellg();
+        in.seekg(0, std::ios::beg);
+        std::vector<uint8_t> buf((size_t)(std::max)((std::streamsize)0, size));
+        if (!in.read(reinterpret_cast<char*>(buf.data()), size)) return state;
+
+        Cursor c{ buf.data(), buf.data() + buf.size() };
+        uint32_t magic = 0, version = 0;
+        if (!c.Get(magic) || magic != kMagic || !c.Get(version) || version != kVersion || !c.Get(state.compactedAt)) {
+            return state;
+        }
+        state.valid = true;
+
+        std::map<std::wstring, Record> loaded;
+        while (c.p != c.end) {
+            std::wstring key;
+            Record r;
+            if (!ReadRecord(c, key, r)) {
+                state.damaged = true;
+                break;
+            }
+            loaded[key] = std::move(r);
+            state.records++;
+        }
+        records.swap(loaded);
+        return state;
+    }
+
+    static bool ReadRecord(Cursor& c, std::wstring& key, Record& r) {
+        uint32_t n = 0;
+        if (!c.GetString(key) || !c.Get(r.size) || !c.Get(r.mtime) || !c.Get(n)) return false;
+        if ((size_t)(c.end - c.p) / 25 < n) return false;  // 1エントリは最小25バイト
+        r.entries.resize(n);
+        for (auto& e : r.entries) {
+            uint8_t isDir = 0;
+            if (!c.GetString(e.path) || !c.Get(isDir) || !c.Get(e.size) || !c.Get(e.packedSize)
+                || !c.GetString(e.modified)) {
+                return false;
+            }
+            e.isDir = isDir != 0;
+        }
+        return true;
+    }
+
+    std::filesystem::path file_;
+    std::map<std::wstring, Record> records_;
+    std::set<std::wstring> changed_;    // このプロセスで記録した書庫
+    FileState loaded_;                  // 読んだ・書いたファイルの状態
+    std::mutex mtx_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
@@ -0,0 +1,217 @@
+﻿#pragma once
+// ZIPのCRC32（zlibのcrc32と同じ値）
+// x64はPCLMULQDQによる畳み込み（Chromium zlibのcrc32_sse42_simd_と同じ定数）、ARM64はARMv8のCRC命令、
+// どちらも使えない場合はslicing-by-8の表引きで計算する
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CRC32_USE_PCLMUL 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+#define CRC32_USE_ARMV8 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#endif
+#endif
+
+namespace crc32_detail {
+
+struct Tables {
+    uint32_t t[8][256];
+};
+
+constexpr Tables MakeTables() {
+    Tables tb{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : (c >> 1);
+        tb.t[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) tb.t[k][i] = (tb.t[k - 1][i] >> 8) ^ tb.t[0][tb.t[k - 1][i] & 0xFF];
+    }
+    return tb;
+}
+
+inline constexpr Tables kTables = MakeTables();
+
+// 表引き（8バイトずつ）。crcは反転済みの値を受け取り、反転済みの値を返す
+inline uint32_t Slice8(uint32_t crc, const uint8_t* p, size_t size) {
+    const auto& t = kTables.t;
+    while (size >= 8) {
+        uint32_t one, two;
+        std::memcpy(&one, p, 4);
+        std::memcpy(&two, p + 4, 4);
+        one ^= crc;
+        crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24]
+            ^ t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--) crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32_USE_PCLMUL
+// 64バイト以上・16の倍数の長さだけを受け取る
+// crcは反転済みの値を受け取り、反転済みの値を返す
+#ifndef _MSC_VER
+__attribute__((target("pclmul,sse4.1")))
+#endif
+inline uint32_t FoldPclmul(const uint8_t* buf, size_t len, uint32_t crc) {
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    buf += 64;
+    len -= 64;
+
+    // 64バイトずつ4本並行に畳み込む
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    // 4本を128bitにまとめる
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // 残りを16バイトずつ
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    // 128bit → 64bit
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett還元で32bitにする
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+inline bool HasPclmul() {
+    static const bool has = [] {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        unsigned ecx = (unsigned)info[2];
+#else
+        unsigned eax, ebx, ecx = 0, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+#endif
+        return (ecx & (1u << 1)) != 0 && (ecx & (1u << 19)) != 0;  // PCLMULQDQ / SSE4.1
+    }();
+    return has;
+}
+#endif
+
+#ifdef CRC32_USE_ARMV8
+inline uint32_t ArmV8(uint32_t crc, const uint8_t* p, size_t size) {
+    while (size >= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+        p += 8;
+        size -= 8;
+    }
+    while (size--) crc = __crc32b(crc, *p++);
+    return crc;
+}
+#endif
+
+} // namespace crc32_detail
+
+// zlibのcrc32(crc, data, size)と同じ使い方（初期値は0）
+inline uint32_t Crc32Update(uint32_t crc, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+#if defined(CRC32_USE_PCLMUL)
+    if (size >= 64 && crc32_detail::HasPclmul()) {
+        size_t chunk = size & ~(size_t)15;
+        crc = crc32_detail::FoldPclmul(p, chunk, crc);
+        p += chunk;
+        size -= chunk;
+    }
+    crc = crc32_detail::Slice8(crc, p, size);
+#elif defined(CRC32_USE_ARMV8)
+    crc = crc32_detail::ArmV8(crc, p, size);
+#else
+    crc = crc32_detail::Slice8(crc, p, size);
+#endif
+    return ~crc;
+}
+
+inline uint32_t Crc32(const void* data, size_t size) {
+    return Crc32Update(0, data, size);
+}
+
+// 使われている実装の名前（ベンチマーク表示用）
+inline const wchar_t* Crc32Implementation() {
+#if defined(CRC32_USE_PCLMUL)
+    return crc32_detail::HasPclmul() ? L"pclmul" : L"slice8";
+#elif defined(CRC32_USE_ARMV8)
+    return L"armv8";
+#else
+    return L"slice8";
+#endif
+}
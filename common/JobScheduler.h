@@ -0,0 +1,248 @@
+﻿#pragma once
+// 複数のアーカイブ処理を並列に実行するスケジューラ
+// CPU主体のジョブ（圧縮・変換）はコア数まで、I/O主体のジョブ（展開・コピー）は物理ディスクごとの上限まで同時に動かす
+// 物理ディスクはボリュームからIOCTL_STORAGE_GET_DEVICE_NUMBERで求めるので、同じディスク上の別ドライブもまとめて数える
+// ジョブの中で並列処理するときはThreadBudget()のスレッド数に抑え、ジョブ数×コア数のスレッドが立たないようにする
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#include <winioctl.h>
+#endif
+
+enum class JobKind { Cpu, Io };
+
+// パスが載っている物理ディスクの識別子と、シークの遅いディスク（HDD）かどうか
+struct DiskInfo {
+    std::wstring key;
+    bool seekPenalty = true;
+};
+
+inline DiskInfo QueryDiskInfo(const std::filesystem::path& path) {
+    DiskInfo info;
+#ifdef _WIN32
+    std::error_code ec;
+    std::wstring abs = std::filesystem::absolute(path, ec).wstring();
+    wchar_t volume[MAX_PATH] = {};
+    if (!GetVolumePathNameW(abs.c_str(), volume, MAX_PATH)) {
+        return info;
+    }
+    info.key = volume;
+
+    // "C:\" → "\\.\C:"（UNCやマウントポイントは開けないのでボリューム単位のまま）
+    std::wstring device = volume;
+    if (device.size() >= 2 && device[1] == L':') {
+        device = L"\\\\.\\" + device.substr(0, 2);
+    }
+    else {
+        return info;
+    }
+    HANDLE h = CreateFileW(device.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return info;
+
+    STORAGE_DEVICE_NUMBER sdn = {};
+    DWORD bytes = 0;
+    if (DeviceIoControl(h, IOCTL_STORAGE_GET_DEVICE_NUMBER, nullptr, 0, &sdn, sizeof(sdn), &bytes, nullptr)) {
+        info.key = L"disk" + std::to_wstring(sdn.DeviceType) + L":" + std::to_wstring(sdn.DeviceNumber);
+    }
+
+    STORAGE_PROPERTY_QUERY query = {};
+    query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    query.QueryType = PropertyStandardQuery;
+    DEVICE_SEEK_PENALTY_DESCRIPTOR seek = {};
+    if (DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &seek, sizeof(seek), &bytes, nullptr)
+        && bytes >= sizeof(seek)) {
+        info.seekPenalty = seek.IncursSeekPenalty != FALSE;
+    }
+    CloseHandle(h);
+#else
+    std::error_code ec;
+    info.key = std::filesystem::absolute(path, ec).root_path().wstring();
+#endif
+    return info;
+}
+
+class JobScheduler {
+public:
+    // cpuSlots: CPUジョブの同時実行数（0ならコア数）
+    // ioPerDisk: 1ディスクあたりのI/Oジョブ数（0ならHDDは1、SSDは4）
+    explicit JobScheduler(unsigned cpuSlots = 0, unsigned ioPerDisk = 0) : ioPerDisk_(ioPerDisk) {
+        cpuSlots_ = cpuSlots ? cpuSlots : Cores();
+    }
+
+    JobScheduler(const JobScheduler&) = delete;
+    JobScheduler& operator=(const JobScheduler&) = delete;
+
+    // target: ジョブが読み書きするファイル（ディスクの判定に使う）
+    void Add(JobKind kind, const std::filesystem::path& target, std::function<void()> fn) {
+        Job job;
+        job.kind = kind;
+        job.seq = nextSeq_++;
+        job.fn = std::move(fn);
+        if (kind == JobKind::Cpu) {
+            cpuQueue_.push_back(std::move(job));
+            return;
+        }
+        std::wstring volume = VolumeOf(target);
+        auto it = volumes_.find(volume);
+        if (it == volumes_.end()) {
+            DiskInfo info = QueryDiskInfo(target);
+            auto same = std::find_if(disks_.begin(), disks_.end(), [&](const Disk& d) { return d.key == info.key; });
+            size_t index = (size_t)(same - disks_.begin());
+            if (same == disks_.end()) {
+                Disk disk;
+                disk.key = info.key;
+                disk.limit = ioPerDisk_ ? ioPerDisk_ : (info.seekPenalty ? 1u : 4u);
+                disks_.push_back(std::move(disk));
+            }
+            it = volumes_.emplace(volume, index).first;
+        }
+        job.disk = it->second;
+        disks_[job.disk].queue.push_back(std::move(job));
+    }
+
+    // すべてのジョブが終わるまで待つ
+    // ジョブが例外を投げても残りのジョブは続け、最初の例外を最後に投げ直す
+    void Run() {
+        // 実際に積まれた種類のジョブが同時に動ける数だけスレッドを立てる
+        size_t workers = (std::min)(cpuQueue_.size(), (size_t)cpuSlots_);
+        pending_ = cpuQueue_.size();
+        for (const auto& d : disks_) {
+            workers += (std::min)(d.queue.size(), (size_t)d.limit);
+            pending_ += d.queue.size();
+        }
+        if (pending_ == 0) return;
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < workers; i++) {
+            threads.emplace_back([this] { WorkerLoop(); });
+        }
+        for (auto& t : threads) t.join();
+        if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+
+    // 実行中のジョブが自分の中で使ってよいスレッド数
+    // 同時に動いているジョブ（とすぐに動き出すジョブ）でコア数を分け合う。ジョブの外ではコア数
+    static unsigned ThreadBudget() {
+        unsigned budget = CurrentBudget();
+        return budget ? budget : Cores();
+    }
+
+private:
+    struct Job {
+        JobKind kind = JobKind::Cpu;
+        size_t disk = 0;        // disks_の添字（I/Oジョブのみ）
+        size_t seq = 0;         // 積まれた順番
+        std::function<void()> fn;
+    };
+    // 物理ディスクごとの待ち行列
+    struct Disk {
+        std::wstring key;
+        unsigned limit = 1;
+        unsigned running = 0;
+        std::deque<Job> queue;
+    };
+
+    static unsigned Cores() {
+        return (std::max)(1u, std::thread::hardware_concurrency());
+    }
+
+    static unsigned& CurrentBudget() {
+        static thread_local unsigned budget = 0;
+        return budget;
+    }
+
+    static std::wstring VolumeOf(const std::filesystem::path& path) {
+#ifdef _WIN32
+        std::error_code ec;
+        std::wstring abs = std::filesystem::absolute(path, ec).wstring();
+        wchar_t volume[MAX_PATH] = {};
+        if (GetVolumePathNameW(abs.c_str(), volume, MAX_PATH)) return volume;
+#endif
+        std::error_code ec2;
+        return std::filesystem::absolute(path, ec2).root_path().wstring();
+    }
+
+    // 空きのある待ち行列のうち、先頭が一番先に積まれたもの（なければnullptr）
+    // 調べるのは各行列の先頭だけなので、ジョブ数ではなくディスク数に比例する
+    std::deque<Job>* NextReady() {
+        std::deque<Job>* best = nullptr;
+        if (!cpuQueue_.empty() && cpuRunning_ < cpuSlots_) best = &cpuQueue_;
+        for (auto& d : disks_) {
+            if (d.queue.empty() || d.running >= d.limit) continue;
+            if (!best || d.queue.front().seq < best->front().seq) best = &d.queue;
+        }
+        return best;
+    }
+
+    // 実行中のジョブと、空きがあってすぐに動き出すジョブの数
+    size_t Concurrency() const {
+        size_t n = cpuRunning_ + (std::min)(cpuQueue_.size(), (size_t)(cpuSlots_ - cpuRunning_));
+        for (const auto& d : disks_) {
+            n += d.running + (std::min)(d.queue.size(), (size_t)(d.limit - d.running));
+        }
+        return n;
+    }
+
+    unsigned& Running(const Job& job) {
+        return job.kind == JobKind::Cpu ? cpuRunning_ : disks_[job.disk].running;
+    }
+
+    void WorkerLoop() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (;;) {
+            std::deque<Job>* ready = nullptr;
+            cv_.wait(lock, [&] {
+                ready = NextReady();
+                return ready || pending_ == 0;
+            });
+            if (!ready) break;
+
+            Job job = std::move(ready->front());
+            ready->pop_front();
+            pending_--;
+            Running(job)++;
+            unsigned budget = (unsigned)(std::max)((size_t)1, Cores() / Concurrency());
+
+            lock.unlock();
+            CurrentBudget() = budget;
+            std::exception_ptr error;
+            try {
+                job.fn();
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            CurrentBudget() = 0;
+            lock.lock();
+            if (error && !error_) error_ = error;
+
+            // 空いた枠は1つなので、待っているスレッドも1つだけ起こす
+            Running(job)--;
+            cv_.notify_one();
+        }
+        cv_.notify_all();
+    }
+
+    unsigned cpuSlots_;
+    unsigned ioPerDisk_;
+    std::deque<Job> cpuQueue_;
+    std::vector<Disk> disks_;                   // 物理ディスク
+    std::map<std::wstring, size_t> volumes_;    // ボリューム → disks_の添字
+    size_t nextSeq_ = 0;
+    size_t pending_ = 0;                        // まだ始まっていないジョブの数
+    unsigned cpuRunning_ = 0;
+    std::exception_ptr error_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
@@ -0,0 +1,239 @@
+﻿#pragma once
+// pigz方式の並列deflate
+// 入力をブロックに分けて別スレッドで圧縮し、Z_SYNC_FLUSHで区切った出力を順番に連結して1本のdeflateストリームにする
+// 各ブロックは直前32KBの入力を辞書にしてから圧縮するので、圧縮率は単一スレッドとほとんど変わらない
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "Crc32.h"
+
+class ParallelDeflater {
+public:
+    using Sink = std::function<bool(const uint8_t*, size_t)>;
+    enum class Wrap { Raw, Zlib };
+
+    ParallelDeflater(Sink sink, int level = Z_DEFAULT_COMPRESSION, Wrap wrap = Wrap::Raw,
+                     unsigned threads = 0, size_t blockSize = 256 * 1024)
+        : sink_(std::move(sink)), level_(level), wrap_(wrap), blockSize_(blockSize) {
+        threads_ = threads ? threads : (std::max)(1u, std::thread::hardware_concurrency());
+        check_ = (wrap_ == Wrap::Zlib) ? adler32(0, nullptr, 0) : crc32(0, nullptr, 0);
+        cur_.reserve(blockSize_);
+    }
+
+    ~ParallelDeflater() {
+        StopWorkers();
+    }
+
+    ParallelDeflater(const ParallelDeflater&) = delete;
+    ParallelDeflater& operator=(const ParallelDeflater&) = delete;
+
+    bool Write(const uint8_t* data, size_t size) {
+        while (size > 0 && !failed_) {
+            size_t n = (std::min)(size, blockSize_ - cur_.size());
+            cur_.insert(cur_.end(), data, data + n);
+            data += n;
+            size -= n;
+            if (cur_.size() == blockSize_) {
+                Submit(false);
+                if (!Drain(false)) return false;
+            }
+        }
+        return !failed_;
+    }
+
+    bool Finish() {
+        if (finished_) return !failed_;
+        finished_ = true;
+        Submit(true);
+        bool ok = Drain(true);
+        StopWorkers();
+        if (ok && wrap_ == Wrap::Zlib) {
+            uint8_t trailer[4] = { (uint8_t)(check_ >> 24), (uint8_t)(check_ >> 16), (uint8_t)(check_ >> 8), (uint8_t)check_ };
+            ok = Emit(trailer, 4);
+        }
+        return ok && !failed_;
+    }
+
+    // Raw: 入力全体のCRC32 / Zlib: Adler-32
+    uint32_t Check() const { return check_; }
+    uint64_t TotalIn() const { return totalIn_; }
+    uint64_t TotalOut() const { return totalOut_; }
+
+private:
+    struct Block {
+        std::vector<uint8_t> in;
+        std::vector<uint8_t> dict;
+        std::vector<uint8_t> out;
+        uint32_t check = 0;
+        bool last = false;
+        bool ok = false;
+        bool done = false;
+    };
+
+    void Submit(bool last) {
+        auto b = std::make_shared<Block>();
+        b->in.swap(cur_);
+        b->dict = window_;
+        b->last = last;
+        cur_.reserve(blockSize_);
+
+        // 次のブロックの辞書用に直前32KBを残しておく
+        const size_t kWindow = 32768;
+        if (b->in.size() >= kWindow) {
+            window_.assign(b->in.end() - kWindow, b->in.end());
+        }
+        else {
+            window_.insert(window_.end(), b->in.begin(), b->in.end());
+            if (window_.size() > kWindow) window_.erase(window_.begin(), window_.end() - kWindow);
+        }
+
+        // 1ブロックで終わる小さな入力はスレッドを起こさずにその場で圧縮する
+        if (last && pending_.empty() && workers_.empty()) {
+            z_stream zs = {};
+            if (deflateInit2(&zs, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+                Compress(zs, *b, wrap_);
+                deflateEnd(&zs);
+            }
+            b->done = true;
+            pending_.push_back(b);
+            return;
+        }
+
+        StartWorkers();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            queue_.push_back(b);
+            pending_.push_back(b);
+        }
+        cvWork_.notify_one();
+    }
+
+    // 圧縮済みのブロックを先頭から順に書き出す
+    // all=falseのときは処理中のブロック数がスレッド数の2倍を超えた分だけ待つ
+    bool Drain(bool all) {
+        while (!pending_.empty()) {
+            std::shared_ptr<Block> b = pending_.front();
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (!b->done && !all && pending_.size() <= threads_ * 2) return !failed_;
+                cvDone_.wait(lock, [&] { return b->done; });
+            }
+            pending_.pop_front();
+            if (!b->ok) {
+                failed_ = true;
+                return false;
+            }
+            if (!headerWritten_ && wrap_ == Wrap::Zlib) {
+                const uint8_t header[2] = { 0x78, 0x9C };
+                if (!Emit(header, 2)) return false;
+            }
+            headerWritten_ = true;
+            check_ = (wrap_ == Wrap::Zlib)
+                ? adler32_combine(check_, b->check, (z_off_t)b->in.size())
+                : crc32_combine(check_, b->check, (z_off_t)b->in.size());
+            totalIn_ += b->in.size();
+            if (!Emit(b->out.data(), b->out.size())) return false;
+        }
+        return !failed_;
+    }
+
+    bool Emit(const uint8_t* p, size_t n) {
+        if (n == 0) return true;
+        totalOut_ += n;
+        if (!sink_(p, n)) {
+            failed_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    static void Compress(z_stream& zs, Block& b, Wrap wrap) {
+        b.check = (wrap == Wrap::Zlib)
+            ? adler32(adler32(0, nullptr, 0), b.in.data(), (uInt)b.in.size())
+            : Crc32(b.in.data(), b.in.size());
+
+        if (deflateReset(&zs) != Z_OK) return;
+        if (!b.dict.empty() && deflateSetDictionary(&zs, b.dict.data(), (uInt)b.dict.size()) != Z_OK) return;
+
+        b.out.resize(deflateBound(&zs, (uLong)b.in.size()) + 16);
+        zs.next_in = b.in.data();
+        zs.avail_in = (uInt)b.in.size();
+        zs.next_out = b.out.data();
+        zs.avail_out = (uInt)b.out.size();
+        // 途中のブロックはZ_SYNC_FLUSHでバイト境界に揃えて終わらせ、最後のブロックだけfinalビットを立てる
+        int ret = deflate(&zs, b.last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (b.last ? ret != Z_STREAM_END : ret != Z_OK) return;
+        b.out.resize(b.out.size() - zs.avail_out);
+        b.ok = true;
+    }
+
+    void StartWorkers() {
+        if (!workers_.empty()) return;
+        for (unsigned i = 0; i < threads_; i++) {
+            workers_.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+
+    void StopWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cvWork_.notify_all();
+        for (auto& t : workers_) t.join();
+        workers_.clear();
+    }
+
+    void WorkerLoop() {
+        // z_streamはスレッドごとに使い回す
+        z_stream zs = {};
+        bool init = deflateInit2(&zs, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        for (;;) {
+            std::shared_ptr<Block> b;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cvWork_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) break;
+                b = queue_.front();
+                queue_.pop_front();
+            }
+            if (init) Compress(zs, *b, wrap_);
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                b->done = true;
+            }
+            cvDone_.notify_all();
+        }
+        if (init) deflateEnd(&zs);
+    }
+
+    Sink sink_;
+    int level_;
+    Wrap wrap_;
+    size_t blockSize_;
+    unsigned threads_;
+
+    std::vector<uint8_t> cur_;
+    std::vector<uint8_t> window_;
+    std::deque<std::shared_ptr<Block>> pending_;  // 出力順
+    std::deque<std::shared_ptr<Block>> queue_;    // 圧縮待ち
+    std::vector<std::thread> workers_;
+    std::mutex mtx_;
+    std::condition_variable cvWork_;
+    std::condition_variable cvDone_;
+    bool stop_ = false;
+    bool failed_ = false;
+    bool finished_ = false;
+    bool headerWritten_ = false;
+
+    uint32_t check_ = 0;
+    uint64_t totalIn_ = 0;
+    uint64_t totalOut_ = 0;
+};
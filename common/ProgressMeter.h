@@ -0,0 +1,150 @@
+﻿#pragma once
+// 並列に動くジョブの進捗をまとめて表示する
+// 展開・圧縮のコールバックはアトミック変数を書き換えるだけにして（ロックも出力もしない）、
+// 表示は専用のスレッドが0.1秒ごとに全ジョブの合計を1行に描き直す
+// ジョブのメッセージはPrintで出すと、進捗の行を消してから表示されるので混ざらない
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class ProgressMeter {
+public:
+    // ジョブ1件分の進捗（doneとtotalはどのスレッドからでもロックなしで更新してよい）
+    struct Task {
+        std::atomic<uint64_t> done{ 0 };
+        std::atomic<uint64_t> total{ 0 };
+        std::atomic<bool> finished{ false };
+
+        void SetTotal(uint64_t n) { total.store(n, std::memory_order_relaxed); }
+        void Update(uint64_t n) { done.store(n, std::memory_order_relaxed); }
+        void Add(uint64_t n) { done.fetch_add(n, std::memory_order_relaxed); }  // 複数のスレッドで1つのジョブを進めるとき
+    };
+
+    // jobs: 全体のジョブ数（"3/10" の分母）、label: 行頭の表示
+    explicit ProgressMeter(size_t jobs, std::wstring label = L"Progress",
+                           std::chrono::milliseconds interval = std::chrono::milliseconds(100))
+        : jobs_(jobs), label_(std::move(label)), interval_(interval) {
+        thread_ = std::thread([this] { RenderLoop(); });
+    }
+
+    ~ProgressMeter() { Stop(); }
+
+    ProgressMeter(const ProgressMeter&) = delete;
+    ProgressMeter& operator=(const ProgressMeter&) = delete;
+
+    // ジョブの開始。返したTaskはProgressMeterが破棄されるまで有効
+    Task& Begin(uint64_t total = 0) {
+        std::lock_guard<std::mutex> lock(tasksMtx_);
+        tasks_.emplace_back();
+        tasks_.back().SetTotal(total);
+        return tasks_.back();
+    }
+
+    // ジョブの終了（成功・失敗にかかわらず呼ぶ）
+    void End(Task& task) {
+        task.finished.store(true, std::memory_order_relaxed);
+    }
+
+    // 進捗の行を消してから1行表示する
+    void Print(const std::wstring& line, bool error = false) {
+        std::lock_guard<std::mutex> lock(outMtx_);
+        ClearLine();
+        (error ? std::wcerr : std::wcout) << line << std::endl;
+    }
+
+    // fwprintfと同じ書式で1行表示する（改行は付けなくてよい）
+    void Printf(bool error, const wchar_t* format, ...) {
+        wchar_t buf[1024];
+        va_list args;
+        va_start(args, format);
+        int n = std::vswprintf(buf, sizeof(buf) / sizeof(buf[0]), format, args);
+        va_end(args);
+        if (n < 0) buf[sizeof(buf) / sizeof(buf[0]) - 1] = L'\0';  // 長すぎる分は切り捨て
+        Print(buf, error);
+    }
+
+    // 進捗の行を消して表示スレッドを止める
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(stopMtx_);
+            if (stopped_) return;
+            stopped_ = true;
+        }
+        stopCv_.notify_all();
+        thread_.join();
+        std::lock_guard<std::mutex> lock(outMtx_);
+        ClearLine();
+    }
+
+private:
+    void RenderLoop() {
+        std::unique_lock<std::mutex> lock(stopMtx_);
+        while (!stopCv_.wait_for(lock, interval_, [this] { return stopped_; })) {
+            Render();
+        }
+    }
+
+    void Render() {
+        uint64_t done = 0, total = 0;
+        size_t finished = 0, started = 0;
+        {
+            std::lock_guard<std::mutex> lock(tasksMtx_);
+            for (const auto& t : tasks_) {
+                uint64_t d = t.done.load(std::memory_order_relaxed);
+                uint64_t n = t.total.load(std::memory_order_relaxed);
+                bool f = t.finished.load(std::memory_order_relaxed);
+                // 終わったジョブは途中で止まっていても全体を済んだものとして数える
+                total += n;
+                done += f ? (std::max)(d, n) : (n ? (std::min)(d, n) : d);
+                finished += f ? 1 : 0;
+            }
+            started = tasks_.size();
+        }
+        if (started == 0 || finished >= jobs_) return;
+
+        wchar_t line[160];
+        const double mb = 1024.0 * 1024.0;
+        if (total > 0) {
+            std::swprintf(line, 160, L"%ls: %3d%% (%zu/%zu done, %.1f / %.1f MB)", label_.c_str(),
+                (int)(done * 100 / total), finished, jobs_, done / mb, total / mb);
+        }
+        else {
+            std::swprintf(line, 160, L"%ls: %zu/%zu done, %.1f MB", label_.c_str(), finished, jobs_, done / mb);
+        }
+
+        std::lock_guard<std::mutex> lock(outMtx_);
+        std::wstring text = line;
+        size_t width = text.size();
+        if (text.size() < shown_) text.append(shown_ - text.size(), L' ');  // 前の行の残りを消す
+        std::wcout << L'\r' << text << std::flush;
+        shown_ = width;
+    }
+
+    // outMtx_を持って呼ぶ
+    void ClearLine() {
+        if (shown_ == 0) return;
+        std::wcout << L'\r' << std::wstring(shown_, L' ') << L'\r' << std::flush;
+        shown_ = 0;
+    }
+
+    size_t jobs_;
+    std::wstring label_;
+    std::chrono::milliseconds interval_;
+    std::deque<Task> tasks_;            // dequeは末尾に追加しても既存の要素が動かない
+    std::mutex tasksMtx_;
+    std::mutex outMtx_;
+    size_t shown_ = 0;                  // 表示中の進捗の行の長さ
+    std::mutex stopMtx_;
+    std::condition_variable stopCv_;
+    bool stopped_ = false;
+    std::thread thread_;
+};
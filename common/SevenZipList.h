@@ -0,0 +1,275 @@
+﻿#pragma once
+// 7z.exe の一覧（7z l -slt -sccUTF-8）を読むパーサ
+// 機械可読な「キー = 値」形式をパイプから届いた分ずつ解析し、1エントリ揃うごとにコールバックする
+// 列位置に依存しないので、大きなサイズや長い名前、OEMコードページにない文字でも崩れない
+// あわせて 7z x -so の標準出力（全ファイルの連結）を読むクラスも置く
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cwchar>
+#include <functional>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+struct SevenZipItem {
+    std::wstring path;
+    bool isDir = false;
+    uint64_t size = 0;
+    uint64_t packedSize = 0;
+    std::wstring attributes;
+    std::wstring modified;
+    uint32_t crc = 0;
+    bool hasCrc = false;
+};
+
+inline std::wstring SevenZipFromUtf8(const std::string& s) {
+    if (s.empty()) return std::wstring();
+#ifdef _WIN32
+    int n = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0);
+    std::wstring w(n, 0);
+    MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), &w[0], n);
+    return w;
+#else
+    return std::wstring(s.begin(), s.end());
+#endif
+}
+
+// "Modified = 2024-05-18 09:35:57.1234567" をMS-DOS形式の日時にする
+inline bool SevenZipDosTime(const std::wstring& modified, uint16_t& dosTime, uint16_t& dosDate) {
+    int y, mo, d, h, mi, sec;
+    if (swscanf(modified.c_str(), L"%d-%d-%d %d:%d:%d", &y, &mo, &d, &h, &mi, &sec) != 6 || y < 1980) {
+        return false;
+    }
+    dosTime = (uint16_t)((h << 11) | (mi << 5) | (sec / 2));
+    dosDate = (uint16_t)(((y - 1980) << 9) | (mo << 5) | d);
+    return true;
+}
+
+class SevenZipListParser {
+public:
+    using Callback = std::function<void(const SevenZipItem&)>;
+
+    explicit SevenZipListParser(Callback callback) : callback_(std::move(callback)) {}
+
+    // パイプから読んだバイト列をそのまま渡す（行の途中で切れていてもよい）
+    void Feed(const char* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            char c = data[i];
+            if (c == '\n') {
+                Line(line_);
+                line_.clear();
+            }
+            else if (c != '\r') {
+                line_ += c;
+            }
+        }
+    }
+
+    // 出力の終わり。最後のエントリを確定する
+    void Finish() {
+        if (!line_.empty()) {
+            Line(line_);
+            line_.clear();
+        }
+        Flush();
+    }
+
+    size_t Count() const { return count_; }
+
+private:
+    void Line(const std::string& line) {
+        // "----------" より前は書庫自体の情報なので読み飛ばす
+        if (!inItems_) {
+            if (line == "----------") inItems_ = true;
+            return;
+        }
+        if (line.empty()) {
+            Flush();
+            return;
+        }
+        size_t eq = line.find(" = ");
+        std::string key, value;
+        if (eq == std::string::npos) {
+            // 値が空の行は "Key =" になる
+            if (line.size() < 2 || line.compare(line.size() - 2, 2, " =") != 0) return;
+            key = line.substr(0, line.size() - 2);
+        }
+        else {
+            key = line.substr(0, eq);
+            value = line.substr(eq + 3);
+        }
+
+        hasItem_ = true;
+        if (key == "Path") item_.path = SevenZipFromUtf8(value);
+        else if (key == "Folder") item_.isDir = (value == "+");
+        else if (key == "Size") item_.size = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "Packed Size") item_.packedSize = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "Modified") item_.modified = SevenZipFromUtf8(value);
+        else if (key == "CRC" && !value.empty()) {
+            item_.crc = (uint32_t)std::strtoul(value.c_str(), nullptr, 16);
+            item_.hasCrc = true;
+        }
+        else if (key == "Attributes") {
+            item_.attributes = SevenZipFromUtf8(value);
+            // Folderを出さない形式もあるので属性のDも見る
+            if (!value.empty() && value[0] == 'D') item_.isDir = true;
+        }
+    }
+
+    void Flush() {
+        if (hasItem_ && !item_.path.empty()) {
+            count_++;
+            if (callback_) callback_(item_);
+        }
+        item_ = SevenZipItem();
+        hasItem_ = false;
+    }
+
+    Callback callback_;
+    std::string line_;
+    SevenZipItem item_;
+    bool hasItem_ = false;
+    bool inItems_ = false;
+    size_t count_ = 0;
+};
+
+#ifdef _WIN32
+// 7z.exe l -slt -sccUTF-8 を起動し、出力を読みながらエントリごとにコールバックする
+// 7z.exeの終了コードが0ならtrue
+inline bool SevenZipList(const std::wstring& sevenZipPath, const std::wstring& archiveFile,
+                         const SevenZipListParser::Callback& callback) {
+    std::wstring arguments = L"\"" + sevenZipPath + L"\" l -slt -sccUTF-8 \"" + archiveFile + L"\"";
+
+    HANDLE hReadPipe, hWritePipe;
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+    if (!CreatePipe(&hReadPipe, &hWritePipe, &sa, 0)) {
+        return false;
+    }
+    SetHandleInformation(hReadPipe, HANDLE_FLAG_INHERIT, 0);
+
+    STARTUPINFOW si = { sizeof(si) };
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdOutput = hWritePipe;
+    si.hStdError = hWritePipe;  // エラーメッセージは「キー = 値」形式でないので読み飛ばされる
+    PROCESS_INFORMATION pi = {};
+
+    if (!CreateProcessW(nullptr, const_cast<LPWSTR>(arguments.c_str()), nullptr, nullptr, TRUE,
+                        CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi)) {
+        CloseHandle(hWritePipe);
+        CloseHandle(hReadPipe);
+        return false;
+    }
+    CloseHandle(hWritePipe);
+
+    SevenZipListParser parser(callback);
+    std::vector<char> buffer(64 * 1024);
+    DWORD bytesRead;
+    while (ReadFile(hReadPipe, buffer.data(), (DWORD)buffer.size(), &bytesRead, nullptr) && bytesRead > 0) {
+        parser.Feed(buffer.data(), bytesRead);
+    }
+    parser.Finish();
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD exitCode = 1;
+    GetExitCodeProcess(pi.hProcess, &exitCode);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+    CloseHandle(hReadPipe);
+    return exitCode == 0;
+}
+
+// 7z.exe x -so を起動し、展開されたデータを標準出力から読む
+// 出力は一覧（-slt）と同じ順にファイルの中身が区切りなしで連結されたものなので、
+// 呼び出し側は一覧のSizeずつ読んでファイルに切り分ける
+class SevenZipExtractPipe {
+public:
+    SevenZipExtractPipe() = default;
+    ~SevenZipExtractPipe() { Close(); }
+
+    SevenZipExtractPipe(const SevenZipExtractPipe&) = delete;
+    SevenZipExtractPipe& operator=(const SevenZipExtractPipe&) = delete;
+
+    // interactiveがfalseなら、7z.exeのメッセージは捨ててパスワードは空（-p）にする
+    // （並列に動かすとき、進捗が混ざったり複数の7z.exeが同じコンソールで入力を待ったりしない）
+    bool Start(const std::wstring& sevenZipPath, const std::wstring& archiveFile, bool interactive = true) {
+        std::wstring arguments = L"\"" + sevenZipPath + L"\" x -so -y" + (interactive ? L"" : L" -p") + L" \"" + archiveFile + L"\"";
+
+        HANDLE hWritePipe;
+        SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+        if (!CreatePipe(&read_, &hWritePipe, &sa, 1024 * 1024)) {
+            read_ = nullptr;
+            return false;
+        }
+        SetHandleInformation(read_, HANDLE_FLAG_INHERIT, 0);
+
+        // interactiveなら進捗やパスワード入力はコンソールのまま使えるようにする
+        HANDLE hNul = INVALID_HANDLE_VALUE;
+        if (!interactive) {
+            hNul = CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, nullptr);
+        }
+        STARTUPINFOW si = { sizeof(si) };
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = interactive ? GetStdHandle(STD_INPUT_HANDLE) : hNul;
+        si.hStdOutput = hWritePipe;
+        si.hStdError = interactive ? GetStdHandle(STD_ERROR_HANDLE) : hNul;
+
+        BOOL ok = CreateProcessW(nullptr, const_cast<LPWSTR>(arguments.c_str()), nullptr, nullptr, TRUE,
+                                 interactive ? 0 : CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi_);
+        CloseHandle(hWritePipe);
+        if (hNul != INVALID_HANDLE_VALUE) CloseHandle(hNul);
+        if (!ok) {
+            CloseHandle(read_);
+            read_ = nullptr;
+            pi_ = {};
+            return false;
+        }
+        return true;
+    }
+
+    // ちょうどsizeバイト読む。途中で出力が終わったらfalse
+    bool Read(uint8_t* data, size_t size) {
+        while (size > 0) {
+            DWORD n = 0;
+            if (!ReadFile(read_, data, (DWORD)(std::min)(size, (size_t)0x40000000), &n, nullptr) || n == 0) {
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // 残りの出力を読み捨ててから7z.exeの終了を待つ。終了コードが0ならtrue
+    bool Finish() {
+        if (!pi_.hProcess) return false;
+        char buffer[64 * 1024];
+        DWORD n;
+        bool extra = false;
+        while (ReadFile(read_, buffer, sizeof(buffer), &n, nullptr) && n > 0) extra = true;
+        WaitForSingleObject(pi_.hProcess, INFINITE);
+        DWORD exitCode = 1;
+        GetExitCodeProcess(pi_.hProcess, &exitCode);
+        Close();
+        return exitCode == 0 && !extra;
+    }
+
+    void Close() {
+        if (read_) CloseHandle(read_);
+        read_ = nullptr;
+        if (pi_.hProcess) {
+            // 途中でやめた場合は7z.exeを止める
+            if (WaitForSingleObject(pi_.hProcess, 0) == WAIT_TIMEOUT) TerminateProcess(pi_.hProcess, 1);
+            CloseHandle(pi_.hProcess);
+            CloseHandle(pi_.hThread);
+        }
+        pi_ = {};
+    }
+
+private:
+    HANDLE read_ = nullptr;
+    PROCESS_INFORMATION pi_ = {};
+};
+#endif
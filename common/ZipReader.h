@@ -0,0 +1,312 @@
+﻿#pragma once
+// ZIPのセントラルディレクトリリーダ
+// ファイル末尾からEnd of central directory（Zip64を含む）を探し、セントラルディレクトリだけを読む
+// エントリ一覧を得るのにアーカイブ本体を読む必要はなく、7z.exeも起動しない
+// 無圧縮・deflate・zstdのエントリはExtractで展開できる（CRC32とサイズを確かめる）
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <zstd.h>
+#include "Crc32.h"
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+struct ZipEntry {
+    std::string name;           // 格納されているままのバイト列（UTF-8フラグがなければOEMコードページ）
+    bool utf8 = false;          // nameがUTF-8か
+    uint16_t method = 0;
+    uint16_t flags = 0;
+    uint16_t dosTime = 0;
+    uint16_t dosDate = 0;
+    uint32_t crc = 0;
+    uint32_t externalAttr = 0;
+    uint64_t csize = 0;
+    uint64_t usize = 0;
+    uint64_t localOffset = 0;   // ローカルヘッダの位置
+    uint16_t versionNeeded = 20;
+    std::vector<uint8_t> extra; // Zip64(0x0001)とUnicodeパス(0x7075)以外の拡張フィールド（AESなど）
+
+    bool IsDirectory() const {
+        return (!name.empty() && (name.back() == '/' || name.back() == '\\')) || (externalAttr & 0x10);
+    }
+    bool IsEncrypted() const { return (flags & 0x0001) != 0; }
+    // Extractで展開できる方式か（無圧縮・deflate・zstd、暗号化なし）
+    bool IsExtractable() const { return !IsEncrypted() && (method == 0 || method == 8 || method == 93); }
+
+    // 表示・ファイル名用のワイド文字列（UTF-8フラグがなければ7-Zipと同じくOEMコードページとみなす）
+    std::wstring WideName() const {
+        if (name.empty()) return std::wstring();
+#ifdef _WIN32
+        UINT cp = utf8 ? CP_UTF8 : CP_OEMCP;
+        int n = MultiByteToWideChar(cp, 0, name.data(), (int)name.size(), nullptr, 0);
+        std::wstring w(n, 0);
+        MultiByteToWideChar(cp, 0, name.data(), (int)name.size(), &w[0], n);
+        return w;
+#else
+        return std::wstring(name.begin(), name.end());
+#endif
+    }
+};
+
+class ZipReader {
+public:
+    // セントラルディレクトリを読む。ZIPでない・壊れている場合はfalse
+    // 壊れた値で確保に失敗するなどしても例外は外に出さない（1つの書庫で一括処理全体を止めない）
+    bool Open(const std::filesystem::path& path) {
+        try {
+            return ReadDirectory(path);
+        }
+        catch (const std::exception&) {
+            entries_.clear();
+            return false;
+        }
+    }
+
+    // ファイルを閉じる（Entriesはそのまま使える。置き換えや名前の変更の前に呼ぶ）
+    void Close() { in_.close(); }
+
+    const std::vector<ZipEntry>& Entries() const { return entries_; }
+    uint64_t FileSize() const { return fileSize_; }
+    // セントラルディレクトリの位置（＝エントリのデータの終わり。追記はここから書く）
+    uint64_t CentralDirectoryOffset() const { return cdOffset_; }
+
+    // ローカルヘッダを読んで圧縮データの開始位置を求める
+    bool DataOffset(const ZipEntry& e, uint64_t& offset) {
+        std::vector<uint8_t> lh;
+        if (!ReadAt(e.localOffset, 30, lh) || Le32(&lh[0]) != 0x04034b50) return false;
+        offset = e.localOffset + 30 + Le16(&lh[26]) + Le16(&lh[28]);
+        return e.csize <= fileSize_ && offset <= fileSize_ - e.csize;
+    }
+
+    // 圧縮されたままのデータを先頭から順にsinkへ渡す
+    bool ReadRaw(const ZipEntry& e, const std::function<bool(const uint8_t*, size_t)>& sink) {
+        uint64_t offset;
+        if (!DataOffset(e, offset)) return false;
+        std::vector<uint8_t> chunk;
+        for (uint64_t done = 0; done < e.csize;) {
+            uint64_t n = (std::min)(e.csize - done, (uint64_t)1024 * 1024);
+            if (!ReadAt(offset + done, n, chunk) || !sink(chunk.data(), chunk.size())) return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // エントリを展開して先頭から順にsinkへ渡す（無圧縮・deflate・zstd）
+    // 展開後のサイズとCRC32がセントラルディレクトリの値と一致しなければfalse。errorには理由が入る
+    bool Extract(const ZipEntry& e, const std::function<bool(const uint8_t*, size_t)>& sink,
+                 std::wstring* error = nullptr) {
+        auto fail = [&](const wchar_t* reason) {
+            if (error) *error = reason;
+            return false;
+        };
+        if (e.IsEncrypted()) return fail(L"encrypted");
+        if (!e.IsExtractable()) return fail(L"unsupported method");
+
+        uint32_t crc = 0;
+        uint64_t size = 0;
+        bool sinkFailed = false;
+        auto out = [&](const uint8_t* p, size_t n) {
+            crc = Crc32Update(crc, p, n);
+            size += n;
+            if (!sink(p, n)) {
+                sinkFailed = true;
+                return false;
+            }
+            return true;
+        };
+
+        if (e.method == 0) {
+            if (!ReadRaw(e, out)) return fail(sinkFailed ? L"write error" : L"read error");
+        }
+        else if (e.method == 93) {
+            ZSTD_DCtx* dctx = ZSTD_createDCtx();
+            if (!dctx) return fail(L"out of memory");
+            // 長距離マッチングで作られたものも読めるように、窓の上限を64bit版の最大（2GB）まで上げる
+            ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, 31);
+            std::vector<uint8_t> buf(ZSTD_DStreamOutSize());
+            bool ended = false, bad = false;
+            bool ok = ReadRaw(e, [&](const uint8_t* p, size_t n) {
+                ZSTD_inBuffer in = { p, n, 0 };
+                for (;;) {
+                    ZSTD_outBuffer o = { buf.data(), buf.size(), 0 };
+                    size_t before = in.pos;
+                    size_t ret = ZSTD_decompressStream(dctx, &o, &in);
+                    if (ZSTD_isError(ret)) {
+                        bad = true;
+                        return false;
+                    }
+                    // 0はフレームの終わり（続きがあれば次のフレームとして読む）
+                    // 何も進まなかった呼び出しの戻り値では判断しない
+                    if (ret == 0) ended = true;
+                    else if (in.pos != before || o.pos > 0) ended = false;
+                    if (o.pos > 0 && !out(buf.data(), o.pos)) return false;
+                    if (in.pos == in.size && o.pos < o.size) break;
+                }
+                return true;
+            });
+            ZSTD_freeDCtx(dctx);
+            if (bad) return fail(L"data error");
+            if (!ok) return fail(sinkFailed ? L"write error" : L"read error");
+            if (!ended) return fail(L"unexpected end of data");
+        }
+        else {
+            z_stream zs = {};
+            if (inflateInit2(&zs, -15) != Z_OK) return fail(L"out of memory");
+            std::vector<uint8_t> buf(256 * 1024);
+            bool ended = false, bad = false;
+            bool ok = ReadRaw(e, [&](const uint8_t* p, size_t n) {
+                zs.next_in = const_cast<Bytef*>(p);
+                zs.avail_in = (uInt)n;
+                while (!ended) {
+                    zs.next_out = buf.data();
+                    zs.avail_out = (uInt)buf.size();
+                    int ret = inflate(&zs, Z_NO_FLUSH);
+                    if (ret == Z_STREAM_END) ended = true;
+                    else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                        bad = true;
+                        return false;
+                    }
+                    size_t produced = buf.size() - zs.avail_out;
+                    if (produced > 0 && !out(buf.data(), produced)) return false;
+                    if (zs.avail_out != 0) break;  // 入力を使い切った
+                }
+                return true;
+            });
+            inflateEnd(&zs);
+            if (bad) return fail(L"data error");
+            if (!ok) return fail(sinkFailed ? L"write error" : L"read error");
+            if (!ended) return fail(L"unexpected end of data");
+        }
+        if (size != e.usize) return fail(L"size mismatch");
+        if (crc != e.crc) return fail(L"CRC mismatch");
+        return true;
+    }
+
+protected:
+    // Openの本体（例外はOpenで受け止める）
+    bool ReadDirectory(const std::filesystem::path& path) {
+        entries_.clear();
+        in_.close();
+        in_.clear();
+        in_.open(path, std::ios::binary);
+        if (!in_) return false;
+        in_.seekg(0, std::ios::end);
+        fileSize_ = (uint64_t)in_.tellg();
+        if (fileSize_ < 22) return false;
+
+        // EOCDは末尾22バイト＋コメント（最大65535バイト）の中にある
+        uint64_t tailSize = (std::min)(fileSize_, (uint64_t)(22 + 65535 + 20));
+        std::vector<uint8_t> tail;
+        if (!ReadAt(fileSize_ - tailSize, tailSize, tail)) return false;
+
+        size_t eocd = SIZE_MAX;
+        for (size_t i = tail.size() - 22 + 1; i-- > 0;) {
+            if (Le32(&tail[i]) == 0x06054b50 && i + 22 + Le16(&tail[i + 20]) <= tail.size()) {
+                eocd = i;
+                break;
+            }
+        }
+        if (eocd == SIZE_MAX) return false;
+
+        uint64_t count = Le16(&tail[eocd + 10]);
+        uint64_t cdSize = Le32(&tail[eocd + 12]);
+        uint64_t cdOffset = Le32(&tail[eocd + 16]);
+
+        if (count == 0xFFFF || cdSize == 0xFFFFFFFF || cdOffset == 0xFFFFFFFF) {
+            // Zip64 end of central directory locator はEOCDの直前20バイト
+            if (eocd < 20 || Le32(&tail[eocd - 20]) != 0x07064b50) return false;
+            uint64_t z64Offset = Le64(&tail[eocd - 20 + 8]);
+            std::vector<uint8_t> z64;
+            if (!ReadAt(z64Offset, 56, z64) || Le32(&z64[0]) != 0x06064b50) return false;
+            count = Le64(&z64[32]);
+            cdSize = Le64(&z64[40]);
+            cdOffset = Le64(&z64[48]);
+        }
+        // 壊れたZip64レコードの値でも桁あふれしないように引き算で比べる
+        if (cdSize > fileSize_ || cdOffset > fileSize_ - cdSize) return false;
+        cdOffset_ = cdOffset;
+
+        std::vector<uint8_t> cd;
+        if (!ReadAt(cdOffset, cdSize, cd)) return false;
+        entries_.reserve((size_t)(std::min)(count, (uint64_t)cdSize / 46));
+
+        size_t p = 0;
+        while (p + 46 <= cd.size() && Le32(&cd[p]) == 0x02014b50) {
+            ZipEntry e;
+            e.versionNeeded = Le16(&cd[p + 6]);
+            e.flags = Le16(&cd[p + 8]);
+            e.method = Le16(&cd[p + 10]);
+            e.dosTime = Le16(&cd[p + 12]);
+            e.dosDate = Le16(&cd[p + 14]);
+            e.crc = Le32(&cd[p + 16]);
+            e.csize = Le32(&cd[p + 20]);
+            e.usize = Le32(&cd[p + 24]);
+            uint16_t nameLen = Le16(&cd[p + 28]);
+            uint16_t extraLen = Le16(&cd[p + 30]);
+            uint16_t commentLen = Le16(&cd[p + 32]);
+            e.externalAttr = Le32(&cd[p + 38]);
+            e.localOffset = Le32(&cd[p + 42]);
+            if (p + 46 + nameLen + extraLen + commentLen > cd.size()) return false;
+
+            e.name.assign(reinterpret_cast<const char*>(&cd[p + 46]), nameLen);
+            e.utf8 = (e.flags & 0x0800) != 0;
+            ParseExtra(&cd[p + 46 + nameLen], extraLen, e);
+
+            entries_.push_back(std::move(e));
+            p += 46 + nameLen + extraLen + commentLen;
+        }
+        // 65535件を超えてもZip64を使わない書庫があるので、件数は下位16bitだけ比べる
+        return (entries_.size() & 0xFFFF) == (count & 0xFFFF);
+    }
+
+    static uint16_t Le16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+    static uint32_t Le32(const uint8_t* p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
+    static uint64_t Le64(const uint8_t* p) { return (uint64_t)Le32(p) | ((uint64_t)Le32(p + 4) << 32); }
+
+    bool ReadAt(uint64_t offset, uint64_t size, std::vector<uint8_t>& out) {
+        if (size > fileSize_ || offset > fileSize_ - size) return false;
+        out.resize((size_t)size);
+        in_.clear();
+        in_.seekg((std::streamoff)offset);
+        in_.read(reinterpret_cast<char*>(out.data()), (std::streamsize)size);
+        return (uint64_t)in_.gcount() == size;
+    }
+
+    // Zip64拡張（0x0001）とInfo-ZIPのUnicodeパス（0x7075）を読む
+    static void ParseExtra(const uint8_t* p, size_t size, ZipEntry& e) {
+        size_t i = 0;
+        while (i + 4 <= size) {
+            uint16_t id = Le16(p + i);
+            uint16_t len = Le16(p + i + 2);
+            const uint8_t* d = p + i + 4;
+            if (i + 4 + len > size) break;
+            if (id == 0x0001) {
+                // 32bitの欄が0xFFFFFFFFのものだけ、元のサイズ・圧縮後サイズ・オフセットの順に入っている
+                size_t k = 0;
+                if (e.usize == 0xFFFFFFFF && k + 8 <= len) { e.usize = Le64(d + k); k += 8; }
+                if (e.csize == 0xFFFFFFFF && k + 8 <= len) { e.csize = Le64(d + k); k += 8; }
+                if (e.localOffset == 0xFFFFFFFF && k + 8 <= len) { e.localOffset = Le64(d + k); k += 8; }
+            }
+            else if (id == 0x7075 && len > 5 && d[0] == 1 && !e.utf8) {
+                e.name.assign(reinterpret_cast<const char*>(d + 5), len - 5);
+                e.utf8 = true;
+            }
+            else if (id != 0x0001 && id != 0x7075) {
+                e.extra.insert(e.extra.end(), p + i, p + i + 4 + len);
+            }
+            i += 4 + len;
+        }
+    }
+
+    std::ifstream in_;
+    uint64_t fileSize_ = 0;
+    uint64_t cdOffset_ = 0;
+    std::vector<ZipEntry> entries_;
+};
@@ -0,0 +1,97 @@
+﻿#pragma once
+// 圧縮済みデータ（JPEG/PNG/WebP/MP4など）を無圧縮で格納するかを判定する
+// 拡張子と先頭ブロックのバイトエントロピーで判断し、deflateしても縮まないエントリにCPU時間を使わない
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// 先頭から調べるバイト数
+constexpr size_t kZipStoreSampleSize = 64 * 1024;
+
+// 圧縮済みとみなす拡張子か（nameはUTF-8のエントリ名）
+inline bool ZipIsCompressedExtension(const std::string& name) {
+    static const char* const exts[] = {
+        "jpg", "jpeg", "png", "webp", "gif", "avif", "heic", "jxl",
+        "mp4", "m4v", "mkv", "webm", "mov", "avi", "wmv",
+        "mp3", "m4a", "aac", "ogg", "opus", "flac",
+        "zip", "rar", "7z", "gz", "bz2", "xz", "zst", "cbz", "cbr",
+    };
+    size_t dot = name.find_last_of('.');
+    if (dot == std::string::npos || name.find('/', dot) != std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)::tolower(c); });
+    for (const char* e : exts) {
+        if (ext == e) return true;
+    }
+    return false;
+}
+
+// バイト単位のシャノンエントロピー（0〜8 bit/byte）
+inline double ZipByteEntropy(const uint8_t* data, size_t size) {
+    if (size == 0) return 0;
+    uint32_t hist[256] = {};
+    for (size_t i = 0; i < size; i++) hist[data[i]]++;
+    double h = 0;
+    for (uint32_t c : hist) {
+        if (!c) continue;
+        double p = (double)c / size;
+        h -= p * std::log2(p);
+    }
+    return h;
+}
+
+// 無圧縮にしたエントリの集計
+// 削減できたCPU時間と増えたバイト数は、先頭サンプルを実際にdeflateした結果から見積もる
+struct ZipStoreStats {
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+    uint64_t sampleIn = 0;
+    uint64_t sampleOut = 0;
+    double sampleSeconds = 0;
+
+    double EstimatedSecondsSaved() const {
+        return sampleIn ? sampleSeconds * ((double)bytes / sampleIn) - sampleSeconds : 0;
+    }
+    uint64_t EstimatedBytesLost() const {
+        if (!sampleIn || sampleOut >= sampleIn) return 0;
+        return (uint64_t)((double)bytes * (sampleIn - sampleOut) / sampleIn);
+    }
+    std::wstring Summary() const {
+        wchar_t buf[160];
+        std::swprintf(buf, 160, L"Stored %llu entries (%.1f MB): CPU saved ~%.2f s, size cost ~%.1f KB",
+            (unsigned long long)entries, bytes / 1048576.0, (std::max)(0.0, EstimatedSecondsSaved()),
+            EstimatedBytesLost() / 1024.0);
+        return buf;
+    }
+};
+
+// 拡張子が圧縮済み形式で先頭ブロックのエントロピーも高ければ無圧縮、
+// 拡張子に関係なくほぼランダムなデータ（暗号化・圧縮済み）も無圧縮にする
+// 無圧縮と判断したときはstatsにサンプルのdeflate結果を加える
+inline bool ZipShouldStore(const std::string& name, const uint8_t* head, size_t headSize, uint64_t totalSize,
+                           int level, ZipStoreStats* stats = nullptr) {
+    size_t n = (std::min)(headSize, kZipStoreSampleSize);
+    if (n < 512) return false;  // 小さすぎるものは判定しない（deflateしても安い）
+
+    double entropy = ZipByteEntropy(head, n);
+    bool store = ZipIsCompressedExtension(name) ? entropy >= 7.0 : entropy >= 7.95;
+    if (!store || !stats) return store;
+
+    auto t0 = std::chrono::steady_clock::now();
+    uLongf outSize = compressBound((uLong)n);
+    std::vector<uint8_t> out(outSize);
+    if (compress2(out.data(), &outSize, head, (uLong)n, level) != Z_OK) outSize = (uLongf)n;
+    auto t1 = std::chrono::steady_clock::now();
+
+    stats->entries++;
+    stats->bytes += totalSize;
+    stats->sampleIn += n;
+    stats->sampleOut += outSize;
+    stats->sampleSeconds += std::chrono::duration<double>(t1 - t0).count();
+    return true;
+}
@@ -0,0 +1,909 @@
+﻿#pragma once
+// ストリーミングZIPライタ（無圧縮 / deflate / zstd、Zip64対応）
+// 7z.exeを起動せずにプロセス内でZIPを作る
+// エントリはローカルヘッダを書いてからデータを流し込み、終わったらCRCとサイズをヘッダに書き戻す
+// 大きなエントリはParallelDeflater（pigz方式）でブロックごとに並列圧縮する
+// AddFileは圧縮済みのデータ（JPEG/PNG/MP4など）を無圧縮で格納する（ZipStorePolicy.h）
+// SetZstdを呼ぶと圧縮するエントリをzstd（メソッド93）で書く
+// OpenAppendで既存のZIPに追記できる（残すエントリの圧縮データは書き換えず、セントラルディレクトリだけ書き直す）
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include <zstd.h>
+#include "Crc32.h"
+#include "ParallelDeflate.h"
+#include "ZipReader.h"
+#include "ZipStorePolicy.h"
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+// ZIPのエントリ名（UTF-8、区切りは'/'）
+inline std::string ZipEntryName(const std::filesystem::path& relative) {
+    std::u8string u8 = relative.generic_u8string();
+    return std::string(u8.begin(), u8.end());
+}
+
+// ファイルの更新日時をMS-DOS形式（ローカル時刻）で取得する
+inline void ZipDosTime(const std::filesystem::path& path, uint16_t& dosTime, uint16_t& dosDate) {
+    dosTime = 0;
+    dosDate = (1 << 5) | 1;  // 1980/01/01
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    FILETIME local;
+    WORD d = 0, t = 0;
+    if (GetFileAttributesExW(path.wstring().c_str(), GetFileExInfoStandard, &fad)
+        && FileTimeToLocalFileTime(&fad.ftLastWriteTime, &local)
+        && FileTimeToDosDateTime(&local, &d, &t)) {
+        dosTime = t;
+        dosDate = d;
+    }
+#else
+    std::error_code ec;
+    auto ft = std::filesystem::last_write_time(path, ec);
+    if (ec) return;
+    std::time_t tt = std::chrono::system_clock::to_time_t(std::chrono::file_clock::to_sys(ft));
+    std::tm tm = {};
+    if (!localtime_r(&tt, &tm) || tm.tm_year < 80) return;
+    dosTime = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    dosDate = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+#endif
+}
+
+class ZipWriter {
+public:
+    enum class Method : uint16_t { Store = 0, Deflate = 8, Zstd = 93 };
+
+    // サイズが不明なエントリに渡す値
+    static constexpr uint64_t kUnknownSize = UINT64_MAX;
+
+    // これ以上のエントリ（およびサイズ不明のエントリ）は並列deflateで圧縮する
+    static constexpr uint64_t kParallelThreshold = 4ull * 1024 * 1024;
+
+    // 進捗コールバック: 全エントリで読み込んだ元データの累計バイト数。falseを返すと中断する
+    using Progress = std::function<bool(uint64_t bytesIn)>;
+
+    ZipWriter() = default;
+    ~ZipWriter() {
+        if (out_.is_open()) Abort();
+        if (zcs_) ZSTD_freeCCtx(zcs_);
+    }
+
+    ZipWriter(const ZipWriter&) = delete;
+    ZipWriter& operator=(const ZipWriter&) = delete;
+
+    // threads: 並列deflateのスレッド数（0ならコア数）
+    bool Open(const std::filesystem::path& path, int level = Z_DEFAULT_COMPRESSION, unsigned threads = 0) {
+        path_ = path;
+        level_ = level;
+        threads_ = threads;
+        totalIn_ = 0;
+        storeStats_ = ZipStoreStats();
+        offset_ = 0;
+        entries_.clear();
+        failed_ = !OpenStream(path, std::ios::binary | std::ios::trunc);
+        created_ = !failed_;
+        return !failed_;
+    }
+
+    // 既存のZIPに追記する
+    // keepは残すエントリ（圧縮データには触れない）、appendOffsetは元のセントラルディレクトリの位置で、
+    // そこから新しいエントリと新しいセントラルディレクトリを書く
+    // 失敗・Abortしたときは退避しておいた元の末尾を書き戻し、ファイルを元の状態に戻す
+    bool OpenAppend(const std::filesystem::path& path, const std::vector<ZipEntry>& keep, uint64_t appendOffset,
+                    int level = Z_DEFAULT_COMPRESSION, unsigned threads = 0) {
+        path_ = path;
+        level_ = level;
+        threads_ = threads;
+        totalIn_ = 0;
+        storeStats_ = ZipStoreStats();
+        entries_.clear();
+        created_ = false;
+        failed_ = true;
+
+        std::error_code ec;
+        appendOrigSize_ = std::filesystem::file_size(path, ec);
+        if (ec || appendOffset > appendOrigSize_) return false;
+        {
+            std::ifstream in(path, std::ios::binary);
+            appendTail_.resize((size_t)(appendOrigSize_ - appendOffset));
+            in.seekg((std::streamoff)appendOffset);
+            in.read(reinterpret_cast<char*>(appendTail_.data()), (std::streamsize)appendTail_.size());
+            if ((uint64_t)in.gcount() != appendTail_.size()) return false;
+        }
+
+        if (!OpenStream(path, std::ios::binary | std::ios::in | std::ios::out)) return false;
+        out_.seekp((std::streamoff)appendOffset);
+        offset_ = appendOffset;
+        appendOffset_ = appendOffset;
+        appending_ = true;
+
+        for (const auto& src : keep) {
+            Entry e = FromZipEntry(src);
+            e.offset = src.localOffset;
+            entries_.push_back(e);
+        }
+        failed_ = !out_;
+        return !failed_;
+    }
+
+    void SetProgressCallback(Progress progress) { progress_ = std::move(progress); }
+
+    // 圧縮するエントリをzstdで書く（level: 1〜22、longDistance: 長距離マッチングを有効にする）
+    // 大きなエントリはzstdのワーカースレッドで並列に圧縮する
+    void SetZstd(int level, bool longDistance = false) {
+        compressMethod_ = Method::Zstd;
+        zstdLevel_ = level;
+        zstdLong_ = longDistance;
+    }
+
+    // ディレクトリエントリを追加する（nameは'/'で終わらなくてもよい）
+    bool AddDirectory(std::string name, uint16_t dosTime, uint16_t dosDate) {
+        if (name.empty() || name.back() != '/') name += '/';
+        if (!BeginEntry(name, Method::Store, dosTime, dosDate, 0)) return false;
+        entries_.back().externalAttr = 0x10;  // FILE_ATTRIBUTE_DIRECTORY
+        return EndEntry();
+    }
+
+    // 圧縮済みデータを無圧縮で格納するか（既定は有効）
+    void SetStorePolicy(bool enabled) { storePolicy_ = enabled; }
+    const ZipStoreStats& StoreStats() const { return storeStats_; }
+
+    // 先頭ブロックを見て、圧縮済みデータならStore、そうでなければ圧縮方式（DeflateかZstd）を返す
+    // BeginEntryの前にデータの先頭を読める呼び出し側（ストリーム変換など）が使う
+    Method ChooseMethod(const std::string& name, const uint8_t* head, size_t headSize, uint64_t totalSize) {
+        if (storePolicy_ && ZipShouldStore(name, head, headSize, totalSize, level_, &storeStats_)) {
+            return Method::Store;
+        }
+        return compressMethod_;
+    }
+
+    // ファイルを読み込んでエントリを追加する
+    // Store以外を指定すると、先頭ブロックから圧縮済みと判断したものは無圧縮、それ以外はChooseMethodの方式で格納する
+    bool AddFile(const std::filesystem::path& src, const std::string& name, Method method = Method::Deflate) {
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(src, ec);
+        if (ec) return false;
+        std::ifstream in(src, std::ios::binary);
+        if (!in) return false;
+
+        std::vector<uint8_t> chunk(1024 * 1024);
+        in.read(reinterpret_cast<char*>(chunk.data()), (std::streamsize)chunk.size());
+        std::streamsize n = in.gcount();
+        if (in.bad()) return false;
+        if (method != Method::Store) {
+            method = ChooseMethod(name, chunk.data(), (size_t)n, size);
+        }
+
+        uint16_t dosTime, dosDate;
+        ZipDosTime(src, dosTime, dosDate);
+        if (!BeginEntry(name, method, dosTime, dosDate, size)) return false;
+
+        while (n > 0) {
+            if (!WriteEntry(chunk.data(), (size_t)n)) return false;
+            if (progress_ && !progress_(totalIn_)) {
+                failed_ = true;
+                return false;
+            }
+            if (!in) break;
+            in.read(reinterpret_cast<char*>(chunk.data()), (std::streamsize)chunk.size());
+            n = in.gcount();
+        }
+        if (in.bad()) {
+            failed_ = true;
+            return false;
+        }
+        return EndEntry();
+    }
+
+    // エントリを開始する。sizeHintが0xFFFFFFFFに近い・不明な場合はローカルヘッダにZip64拡張を確保する
+    bool BeginEntry(const std::string& name, Method method, uint16_t dosTime, uint16_t dosDate,
+                    uint64_t sizeHint = kUnknownSize) {
+        if (failed_ || inEntry_) return false;
+        Entry e;
+        e.name = name;
+        e.method = (uint16_t)method;
+        e.dosTime = dosTime;
+        e.dosDate = dosDate;
+        e.offset = offset_;
+        e.zip64Local = sizeHint >= 0xF0000000ull;
+        if (method == Method::Zstd) e.versionNeeded = 63;
+        entries_.push_back(e);
+
+        if (!WriteLocalHeader(entries_.back())) return false;
+
+        crc_ = 0;
+        usize_ = 0;
+        csize_ = 0;
+        if (method == Method::Deflate && sizeHint >= kParallelThreshold) {
+            // CRCもブロックごとに計算してcrc32_combineでつなぐ
+            pdef_ = std::make_unique<ParallelDeflater>([this](const uint8_t* p, size_t n) {
+                csize_ += n;
+                return Put(p, n);
+            }, level_, ParallelDeflater::Wrap::Raw, threads_);
+        }
+        else if (method == Method::Deflate) {
+            zs_ = std::make_unique<z_stream>();
+            std::memset(zs_.get(), 0, sizeof(z_stream));
+            if (deflateInit2(zs_.get(), level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                zs_.reset();
+                failed_ = true;
+                return false;
+            }
+            zbuf_.resize(256 * 1024);
+        }
+        else if (method == Method::Zstd) {
+            if (!zcs_) zcs_ = ZSTD_createCCtx();
+            if (!zcs_) {
+                failed_ = true;
+                return false;
+            }
+            ZSTD_CCtx_reset(zcs_, ZSTD_reset_session_and_parameters);
+            ZSTD_CCtx_setParameter(zcs_, ZSTD_c_compressionLevel, zstdLevel_);
+            ZSTD_CCtx_setParameter(zcs_, ZSTD_c_checksumFlag, 0);  // ZIPのCRC32があるので不要
+            if (zstdLong_) ZSTD_CCtx_setParameter(zcs_, ZSTD_c_enableLongDistanceMatching, 1);
+            if (sizeHint >= kParallelThreshold) {
+                // マルチスレッド対応でビルドされていない場合はエラーになるだけで単一スレッドのまま
+                unsigned workers = threads_ ? threads_ : (std::max)(1u, std::thread::hardware_concurrency());
+                ZSTD_CCtx_setParameter(zcs_, ZSTD_c_nbWorkers, (int)workers);
+            }
+            if (sizeHint != kUnknownSize) ZSTD_CCtx_setPledgedSrcSize(zcs_, sizeHint);
+            zbuf_.resize(ZSTD_CStreamOutSize());
+            zstdActive_ = true;
+        }
+        inEntry_ = true;
+        return true;
+    }
+
+    bool WriteEntry(const uint8_t* data, size_t size) {
+        if (failed_ || !inEntry_) return false;
+        usize_ += size;
+        totalIn_ += size;
+        if (pdef_) {
+            if (!pdef_->Write(data, size)) failed_ = true;
+            return !failed_;
+        }
+        crc_ = Crc32Update(crc_, data, size);
+        if (entries_.back().method == (uint16_t)Method::Store) {
+            csize_ += size;
+            return Put(data, size);
+        }
+        if (zstdActive_) return Zstd(data, size, ZSTD_e_continue);
+        return Deflate(data, size, Z_NO_FLUSH);
+    }
+
+    bool EndEntry() {
+        if (failed_ || !inEntry_) return false;
+        inEntry_ = false;
+        if (pdef_) {
+            bool ok = pdef_->Finish();
+            crc_ = pdef_->Check();
+            pdef_.reset();
+            if (!ok) {
+                failed_ = true;
+                return false;
+            }
+        }
+        if (zs_) {
+            bool ok = Deflate(nullptr, 0, Z_FINISH);
+            deflateEnd(zs_.get());
+            zs_.reset();
+            if (!ok) return false;
+        }
+        if (zstdActive_) {
+            zstdActive_ = false;
+            if (!Zstd(nullptr, 0, ZSTD_e_end)) return false;
+        }
+
+        Entry& e = entries_.back();
+        e.crc = crc_;
+        e.usize = usize_;
+        e.csize = csize_;
+        if (!e.zip64Local && (e.usize >= 0xFFFFFFFFull || e.csize >= 0xFFFFFFFFull)) {
+            // ローカルヘッダにZip64拡張を確保していないので書き戻せない
+            failed_ = true;
+            return false;
+        }
+        return PatchLocalHeader(e);
+    }
+
+    // 別のZIPのエントリを再圧縮せずに、圧縮データをそのままコピーする
+    // 暗号化やデータディスクリプタのフラグ、AESなどの拡張フィールドも引き継ぐ
+    bool CopyRawEntry(ZipReader& reader, const ZipEntry& src) {
+        if (failed_ || inEntry_) return false;
+        Entry e = FromZipEntry(src);
+        e.offset = offset_;
+        entries_.push_back(e);
+
+        const Entry& ce = entries_.back();
+        if (!WriteLocalHeader(ce)) return false;
+        uint64_t copied = 0;
+        if (!reader.ReadRaw(src, [&](const uint8_t* p, size_t n) {
+                copied += n;
+                return Put(p, n);
+            }) || copied != ce.csize) {
+            failed_ = true;
+            return false;
+        }
+        if (ce.flags & 0x0008) {
+            // データディスクリプタ（ヘッダにも正しい値を入れてあるが、フラグを保つために書く）
+            Put32(0x08074b50);
+            Put32(ce.crc);
+            if (ce.zip64Local) {
+                Put64(ce.csize);
+                Put64(ce.usize);
+            }
+            else {
+                Put32((uint32_t)ce.csize);
+                Put32((uint32_t)ce.usize);
+            }
+        }
+        totalIn_ += ce.usize;
+        if (progress_ && !progress_(totalIn_)) failed_ = true;
+        return !failed_;
+    }
+
+    // セントラルディレクトリを書いて閉じる
+    bool Close() {
+        if (!out_.is_open()) return false;
+        if (inEntry_ || failed_) {
+            Abort();
+            return false;
+        }
+
+        uint64_t cdOffset = offset_;
+        for (const auto& e : entries_) {
+            if (!WriteCentralHeader(e)) break;
+        }
+        uint64_t cdSize = offset_ - cdOffset;
+        uint64_t count = entries_.size();
+
+        if (!failed_ && (count >= 0xFFFF || cdOffset >= 0xFFFFFFFFull || cdSize >= 0xFFFFFFFFull)) {
+            // Zip64 end of central directory record + locator
+            uint64_t zip64Eocd = offset_;
+            Put32(0x06064b50);
+            Put64(44);
+            Put16(45);
+            Put16(45);
+            Put32(0);
+            Put32(0);
+            Put64(count);
+            Put64(count);
+            Put64(cdSize);
+            Put64(cdOffset);
+            Put32(0x07064b50);
+            Put32(0);
+            Put64(zip64Eocd);
+            Put32(1);
+        }
+        Put32(0x06054b50);
+        Put16(0);
+        Put16(0);
+        Put16((uint16_t)(count >= 0xFFFF ? 0xFFFF : count));
+        Put16((uint16_t)(count >= 0xFFFF ? 0xFFFF : count));
+        Put32((uint32_t)(cdSize >= 0xFFFFFFFFull ? 0xFFFFFFFF : cdSize));
+        Put32((uint32_t)(cdOffset >= 0xFFFFFFFFull ? 0xFFFFFFFF : cdOffset));
+        Put16(0);
+
+        out_.close();
+        if (failed_ || out_.fail()) {
+            if (appending_) {
+                RestoreAppend();
+                return false;
+            }
+            std::error_code ec;
+            std::filesystem::remove(path_, ec);
+            created_ = false;
+            return false;
+        }
+        if (appending_) {
+            // 元より短くなった場合は古いセントラルディレクトリの残りを切り捨てる
+            appending_ = false;
+            appendTail_.clear();
+            appendTail_.shrink_to_fit();
+            std::error_code ec;
+            if (offset_ < appendOrigSize_) std::filesystem::resize_file(path_, offset_, ec);
+            if (ec) return false;
+        }
+        created_ = false;  // 完成したファイルはAbortで消さない
+        return true;
+    }
+
+    // 書きかけのファイルを削除する（Openに失敗していた場合は何もしない）
+    void Abort() {
+        pdef_.reset();
+        zstdActive_ = false;
+        if (zs_) {
+            deflateEnd(zs_.get());
+            zs_.reset();
+        }
+        inEntry_ = false;
+        failed_ = true;
+        if (out_.is_open()) out_.close();
+        if (appending_) RestoreAppend();
+        if (created_) {
+            std::error_code ec;
+            std::filesystem::remove(path_, ec);
+            created_ = false;
+        }
+    }
+
+    size_t EntryCount() const { return entries_.size(); }
+    uint64_t BytesWritten() const { return offset_; }
+
+private:
+    static constexpr uint16_t kFlagUtf8 = 0x0800;
+
+    struct Entry {
+        std::string name;
+        uint16_t method = 0;
+        uint16_t dosTime = 0;
+        uint16_t dosDate = 0;
+        uint32_t crc = 0;
+        uint64_t csize = 0;
+        uint64_t usize = 0;
+        uint64_t offset = 0;
+        uint32_t externalAttr = 0;
+        uint16_t flags = kFlagUtf8;
+        uint16_t versionNeeded = 20;
+        std::vector<uint8_t> extra;     // そのまま書く拡張フィールド（生コピー時）
+        bool zip64Local = false;
+    };
+
+
+    static Entry FromZipEntry(const ZipEntry& src) {
+        Entry e;
+        e.name = src.name;
+        e.flags = (uint16_t)((src.flags & ~kFlagUtf8) | (src.utf8 ? kFlagUtf8 : 0));
+        e.versionNeeded = src.versionNeeded;
+        e.method = src.method;
+        e.dosTime = src.dosTime;
+        e.dosDate = src.dosDate;
+        e.crc = src.crc;
+        e.csize = src.csize;
+        e.usize = src.usize;
+        e.externalAttr = src.externalAttr;
+        e.extra = src.extra;
+        e.zip64Local = src.usize >= 0xFFFFFFFFull || src.csize >= 0xFFFFFFFFull;
+        return e;
+    }
+
+    // 追記に失敗したとき、元のセントラルディレクトリ以降を書き戻して元のサイズに戻す
+    void RestoreAppend() {
+        appending_ = false;
+        std::fstream f(path_, std::ios::binary | std::ios::in | std::ios::out);
+        if (f) {
+            f.seekp((std::streamoff)appendOffset_);
+            f.write(reinterpret_cast<const char*>(appendTail_.data()), (std::streamsize)appendTail_.size());
+            f.close();
+            std::error_code ec;
+            std::filesystem::resize_file(path_, appendOrigSize_, ec);
+        }
+        appendTail_.clear();
+        appendTail_.shrink_to_fit();
+    }
+
+    // ファイルを開いて1MBのバッファを付ける（ヘッダの2・4バイトずつの書き込みをまとめる）
+    // MSVCのbasic_filebufは開いた後、まだ読み書きしていないときでないとバッファを付けられない
+    bool OpenStream(const std::filesystem::path& path, std::ios::openmode mode) {
+        out_.open(path, mode);
+        if (!out_.is_open()) return false;
+        buffer_.resize(1024 * 1024);
+        if (!out_.rdbuf()->pubsetbuf(buffer_.data(), (std::streamsize)buffer_.size())) {
+            // 付けられなければ既定のバッファのまま書く
+            buffer_.clear();
+            buffer_.shrink_to_fit();
+        }
+        return true;
+    }
+
+    bool Put(const void* data, size_t size) {
+        if (failed_) return false;
+        out_.write(reinterpret_cast<const char*>(data), (std::streamsize)size);
+        if (!out_) {
+            failed_ = true;
+            return false;
+        }
+        offset_ += size;
+        return true;
+    }
+    bool Put16(uint16_t v) {
+        uint8_t b[2] = { (uint8_t)v, (uint8_t)(v >> 8) };
+        return Put(b, 2);
+    }
+    bool Put32(uint32_t v) {
+        uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+        return Put(b, 4);
+    }
+    bool Put64(uint64_t v) {
+        return Put32((uint32_t)v) && Put32((uint32_t)(v >> 32));
+    }
+
+    bool Deflate(const uint8_t* data, size_t size, int flush) {
+        z_stream& zs = *zs_;
+        zs.next_in = const_cast<uint8_t*>(data);
+        zs.avail_in = (uInt)size;
+        int ret;
+        do {
+            zs.next_out = zbuf_.data();
+            zs.avail_out = (uInt)zbuf_.size();
+            ret = deflate(&zs, flush);
+            if (ret == Z_STREAM_ERROR) {
+                failed_ = true;
+                return false;
+            }
+            size_t n = zbuf_.size() - zs.avail_out;
+            csize_ += n;
+            if (!Put(zbuf_.data(), n)) return false;
+        } while (zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+        return true;
+    }
+
+    bool Zstd(const uint8_t* data, size_t size, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer in = { data, size, 0 };
+        for (;;) {
+            ZSTD_outBuffer out = { zbuf_.data(), zbuf_.size(), 0 };
+            size_t remaining = ZSTD_compressStream2(zcs_, &out, &in, mode);
+            if (ZSTD_isError(remaining)) {
+                failed_ = true;
+                return false;
+            }
+            csize_ += out.pos;
+            if (!Put(zbuf_.data(), out.pos)) return false;
+            bool done = (mode == ZSTD_e_end) ? remaining == 0 : in.pos == in.size;
+            if (done) return true;
+        }
+    }
+
+    // 生コピー以外ではcrcとサイズは0で書いておき、エントリの終わりに書き戻す
+    bool WriteLocalHeader(const Entry& e) {
+        Put32(0x04034b50);
+        Put16((std::max)(e.versionNeeded, (uint16_t)(e.zip64Local ? 45 : 20)));
+        Put16(e.flags);
+        Put16(e.method);
+        Put16(e.dosTime);
+        Put16(e.dosDate);
+        Put32(e.crc);
+        Put32(e.zip64Local ? 0xFFFFFFFF : (uint32_t)e.csize);   // 圧縮後サイズ
+        Put32(e.zip64Local ? 0xFFFFFFFF : (uint32_t)e.usize);   // 元のサイズ
+        Put16((uint16_t)e.name.size());
+        Put16((uint16_t)((e.zip64Local ? 20 : 0) + e.extra.size()));
+        Put(e.name.data(), e.name.size());
+        if (e.zip64Local) {
+            Put16(0x0001);
+            Put16(16);
+            Put64(e.usize);
+            Put64(e.csize);
+        }
+        if (!e.extra.empty()) Put(e.extra.data(), e.extra.size());
+        return !failed_;
+    }
+
+    bool PatchLocalHeader(const Entry& e) {
+        auto end = out_.tellp();
+        out_.seekp((std::streamoff)(e.offset + 14));
+        uint8_t b[12];
+        auto le32 = [](uint8_t* p, uint32_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24); };
+        le32(b, e.crc);
+        le32(b + 4, e.zip64Local ? 0xFFFFFFFF : (uint32_t)e.csize);
+        le32(b + 8, e.zip64Local ? 0xFFFFFFFF : (uint32_t)e.usize);
+        out_.write(reinterpret_cast<const char*>(b), 12);
+        if (e.zip64Local) {
+            uint8_t z[16];
+            le32(z, (uint32_t)e.usize);
+            le32(z + 4, (uint32_t)(e.usize >> 32));
+            le32(z + 8, (uint32_t)e.csize);
+            le32(z + 12, (uint32_t)(e.csize >> 32));
+            out_.seekp((std::streamoff)(e.offset + 30 + e.name.size() + 4));
+            out_.write(reinterpret_cast<const char*>(z), 16);
+        }
+        out_.seekp(end);
+        if (!out_) {
+            failed_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool WriteCentralHeader(const Entry& e) {
+        // 32bitに収まらない値だけZip64拡張に入れる（順序は元のサイズ・圧縮後サイズ・オフセット）
+        bool bigU = e.usize >= 0xFFFFFFFFull;
+        bool bigC = e.csize >= 0xFFFFFFFFull;
+        bool bigO = e.offset >= 0xFFFFFFFFull;
+        uint16_t extra = (uint16_t)((bigU ? 8 : 0) + (bigC ? 8 : 0) + (bigO ? 8 : 0));
+        bool zip64 = extra > 0;
+
+        uint16_t version = (std::max)(e.versionNeeded, (uint16_t)(zip64 || e.zip64Local ? 45 : 20));
+        Put32(0x02014b50);
+        Put16((uint16_t)(version & 0xFF));              // version made by (MS-DOS)
+        Put16(version);
+        Put16(e.flags);
+        Put16(e.method);
+        Put16(e.dosTime);
+        Put16(e.dosDate);
+        Put32(e.crc);
+        Put32(bigC ? 0xFFFFFFFF : (uint32_t)e.csize);
+        Put32(bigU ? 0xFFFFFFFF : (uint32_t)e.usize);
+        Put16((uint16_t)e.name.size());
+        Put16((uint16_t)((zip64 ? extra + 4 : 0) + e.extra.size()));
+        Put16(0);                                       // comment
+        Put16(0);                                       // disk
+        Put16(0);                                       // internal attr
+        Put32(e.externalAttr);
+        Put32(bigO ? 0xFFFFFFFF : (uint32_t)e.offset);
+        Put(e.name.data(), e.name.size());
+        if (zip64) {
+            Put16(0x0001);
+            Put16(extra);
+            if (bigU) Put64(e.usize);
+            if (bigC) Put64(e.csize);
+            if (bigO) Put64(e.offset);
+        }
+        if (!e.extra.empty()) Put(e.extra.data(), e.extra.size());
+        return !failed_;
+    }
+
+    std::filesystem::path path_;
+    std::vector<char> buffer_;  // out_より先に破棄されないように前に置く
+    std::ofstream out_;
+    int level_ = Z_DEFAULT_COMPRESSION;
+    unsigned threads_ = 0;
+    Progress progress_;
+    bool storePolicy_ = true;
+    ZipStoreStats storeStats_;
+    uint64_t totalIn_ = 0;
+    uint64_t offset_ = 0;
+    std::vector<Entry> entries_;
+    bool failed_ = false;
+    bool created_ = false;
+    bool appending_ = false;            // OpenAppendで開いている
+    uint64_t appendOffset_ = 0;
+    uint64_t appendOrigSize_ = 0;
+    std::vector<uint8_t> appendTail_;   // 元のセントラルディレクトリ以降（失敗時に書き戻す）
+
+    bool inEntry_ = false;
+    std::unique_ptr<z_stream> zs_;
+    std::unique_ptr<ParallelDeflater> pdef_;
+    Method compressMethod_ = Method::Deflate;
+    int zstdLevel_ = 3;
+    bool zstdLong_ = false;
+    ZSTD_CCtx* zcs_ = nullptr;  // エントリ間で使い回す
+    bool zstdActive_ = false;
+    std::vector<uint8_t> zbuf_;
+    uint32_t crc_ = 0;
+    uint64_t usize_ = 0;
+    uint64_t csize_ = 0;
+};
+
+// コマンドラインで選ぶ圧縮方式（d2z/r2zの -zstd <level> と -long）
+struct ZipCompressionOptions {
+    bool zstd = false;
+    int zstdLevel = 3;
+    bool zstdLong = false;
+
+    void Apply(ZipWriter& zip) const {
+        if (zstd) zip.SetZstd(zstdLevel, zstdLong);
+    }
+};
+
+// ZipUpdateDirectoryContentsの結果
+struct ZipUpdateStats {
+    size_t added = 0;       // 新しいファイル
+    size_t replaced = 0;    // 変更されていたので追記し直したファイル
+    size_t removed = 0;     // フォルダから消えていたのでセントラルディレクトリから外したエントリ
+    size_t unchanged = 0;   // 圧縮データをそのまま残したエントリ
+    uint64_t deadBytes = 0; // どのエントリにも使われていない領域（置き換え・削除されたエントリの跡や隙間）
+    uint64_t reclaimed = 0; // 詰め直して減らした大きさ（詰め直さなければ0）
+
+    bool Changed() const { return added || replaced || removed; }
+};
+
+// 使われていない領域がファイルのこの割合（1/N）を超えたら、ZipUpdateDirectoryContentsが詰め直す
+constexpr uint64_t kZipCompactDivisor = 4;
+
+// ファイル全体のCRC32
+inline bool ZipFileCrc32(const std::filesystem::path& path, uint32_t& crc) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::vector<char> chunk(1024 * 1024);
+    crc = 0;
+    while (in) {
+        in.read(chunk.data(), (std::streamsize)chunk.size());
+        crc = Crc32Update(crc, chunk.data(), (size_t)in.gcount());
+    }
+    return !in.bad();
+}
+
+// フォルダの中身（フォルダ自体は含めない）を名前順にすべて追加する
+// 失敗したときはfailedPathに原因のパスを入れる
+inline bool ZipAddDirectoryContents(ZipWriter& zip, const std::filesystem::path& root,
+                                    std::filesystem::path* failedPath = nullptr) {
+    std::vector<std::filesystem::path> items;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(root)) {
+        if (entry.is_directory() || entry.is_regular_file()) items.push_back(entry.path());
+    }
+    std::sort(items.begin(), items.end());
+
+    for (const auto& item : items) {
+        std::string name = ZipEntryName(item.lexically_relative(root));
+        bool ok;
+        if (std::filesystem::is_directory(item)) {
+            uint16_t dosTime, dosDate;
+            ZipDosTime(item, dosTime, dosDate);
+            ok = zip.AddDirectory(name, dosTime, dosDate);
+        }
+        else {
+            ok = zip.AddFile(item, name);
+        }
+        if (!ok) {
+            if (failedPath) *failedPath = item;
+            return false;
+        }
+    }
+    return true;
+}
+
+// ZIPを詰め直す。すべてのエントリの圧縮データをそのまま一時ファイルにコピーし、元のファイルと置き換える
+// 置き換えられなかったときは一時ファイルを消して元のファイルを残す
+inline bool ZipRewrite(const std::filesystem::path& zipPath) {
+    std::filesystem::path tmpPath = zipPath;
+    tmpPath += L".compact.tmp";
+    {
+        ZipReader reader;
+        if (!reader.Open(zipPath)) return false;
+        ZipWriter zip;
+        if (!zip.Open(tmpPath)) return false;
+        for (const auto& e : reader.Entries()) {
+            if (!zip.CopyRawEntry(reader, e)) {
+                zip.Abort();
+                return false;
+            }
+        }
+        if (!zip.Close()) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, zipPath, ec);
+    if (ec) {
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+    return true;
+}
+
+// エントリが使っている大きさ（ローカルヘッダ・圧縮データ・データディスクリプタ）
+// データディスクリプタの長さはローカルヘッダからは分からないので、次のエントリ（end）を超えない範囲で最大の24バイトとみなす
+inline bool ZipEntrySpan(ZipReader& reader, const ZipEntry& e, uint64_t end, uint64_t& span) {
+    uint64_t dataOffset;
+    if (!reader.DataOffset(e, dataOffset)) return false;
+    uint64_t dataEnd = dataOffset + e.csize + ((e.flags & 0x0008) ? 24 : 0);
+    span = (std::min)(dataEnd, end) - e.localOffset;
+    return true;
+}
+
+// 既存のZIP（readerで開いたもの）をフォルダの中身に合わせて更新する
+// サイズと更新日時が同じエントリはそのまま残し、日時だけ違うものはCRC32が同じなら残す
+// 新しいファイル・変更されたファイルだけを末尾に追記し、セントラルディレクトリを書き直す
+// 置き換え・削除したエントリの跡はそのまま残るので、使われていない領域がファイルの1/kZipCompactDivisorを
+// 超えたらZipRewriteで詰め直す（statsに使われていない大きさと減らした大きさが入る）
+// zipはSetZstdや進捗などを設定しただけの開いていないものを渡す。変更がなければファイルには触れない
+// 書き終えるとreaderは閉じる
+// threads: 並列deflateのスレッド数（0ならコア数）
+inline bool ZipUpdateDirectoryContents(ZipWriter& zip, ZipReader& reader, const std::filesystem::path& zipPath,
+                                       const std::filesystem::path& root, ZipUpdateStats& stats,
+                                       std::filesystem::path* failedPath = nullptr, unsigned threads = 0) {
+    stats = ZipUpdateStats();
+    std::vector<std::filesystem::path> items;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(root)) {
+        if (entry.is_directory() || entry.is_regular_file()) items.push_back(entry.path());
+    }
+    std::sort(items.begin(), items.end());
+
+    std::map<std::string, const ZipEntry*> existing;
+    for (const auto& e : reader.Entries()) existing[e.name] = &e;
+
+    std::vector<ZipEntry> keep;
+    std::vector<std::pair<std::filesystem::path, std::string>> write;
+    std::set<std::string> present;
+    for (const auto& item : items) {
+        std::string name = ZipEntryName(item.lexically_relative(root));
+        bool isDir = std::filesystem::is_directory(item);
+        if (isDir) name += '/';
+        present.insert(name);
+
+        auto it = existing.find(name);
+        if (it == existing.end()) {
+            stats.added++;
+            write.push_back({ item, name });
+            continue;
+        }
+        const ZipEntry& e = *it->second;
+        bool same = isDir;
+        if (!isDir) {
+            std::error_code ec;
+            uint64_t size = std::filesystem::file_size(item, ec);
+            uint16_t dosTime, dosDate;
+            ZipDosTime(item, dosTime, dosDate);
+            if (!ec && size == e.usize) {
+                uint32_t crc;
+                same = (dosTime == e.dosTime && dosDate == e.dosDate)
+                    || (ZipFileCrc32(item, crc) && crc == e.crc);
+            }
+        }
+        if (same) {
+            stats.unchanged++;
+            keep.push_back(e);
+        }
+        else {
+            stats.replaced++;
+            write.push_back({ item, name });
+        }
+    }
+    for (const auto& e : reader.Entries()) {
+        if (!present.count(e.name)) stats.removed++;
+    }
+
+    // 残すエントリが使っていない領域（元の隙間と、置き換え・削除するエントリの分）
+    // 各エントリの終わりは、ファイル上で次に置かれているエントリの位置で打ち切る
+    uint64_t appendOffset = reader.CentralDirectoryOffset();
+    std::vector<uint64_t> starts;
+    for (const auto& e : reader.Entries()) starts.push_back(e.localOffset);
+    std::sort(starts.begin(), starts.end());
+    uint64_t live = 0;
+    for (const auto& e : keep) {
+        auto next = std::upper_bound(starts.begin(), starts.end(), e.localOffset);
+        uint64_t span = 0;
+        if (ZipEntrySpan(reader, e, next == starts.end() ? appendOffset : (std::min)(*next, appendOffset), span)) live += span;
+    }
+    stats.deadBytes = appendOffset > live ? appendOffset - live : 0;
+    if (!stats.Changed()) return true;
+
+    // 残すエントリは元の順のまま、追記するものはその後ろに並べる
+    std::sort(keep.begin(), keep.end(), [](const ZipEntry& a, const ZipEntry& b) { return a.localOffset < b.localOffset; });
+    if (!zip.OpenAppend(zipPath, keep, appendOffset, Z_DEFAULT_COMPRESSION, threads)) {
+        if (failedPath) *failedPath = zipPath;
+        return false;
+    }
+    for (const auto& w : write) {
+        bool ok;
+        if (std::filesystem::is_directory(w.first)) {
+            uint16_t dosTime, dosDate;
+            ZipDosTime(w.first, dosTime, dosDate);
+            ok = zip.AddDirectory(w.second, dosTime, dosDate);
+        }
+        else {
+            ok = zip.AddFile(w.first, w.second);
+        }
+        if (!ok) {
+            if (failedPath) *failedPath = w.first;
+            zip.Abort();
+            return false;
+        }
+    }
+    if (!zip.Close()) {
+        if (failedPath) *failedPath = zipPath;
+        return false;
+    }
+    reader.Close();
+
+    // 更新は済んでいるので、詰め直せなかったときはそのまま（statsに使われていない大きさが残る）
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(zipPath, ec);
+    if (!ec && stats.deadBytes > 0 && stats.deadBytes > size / kZipCompactDivisor && ZipRewrite(zipPath)) {
+        uint64_t compacted = std::filesystem::file_size(zipPath, ec);
+        stats.reclaimed = (!ec && compacted < size) ? size - compacted : 0;
+        stats.deadBytes = 0;
+    }
+    return true;
+}
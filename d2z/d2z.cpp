@@ -9,58 +9,17 @@
 #include <fcntl.h>
 #include <io.h>
 #include <fstream>
+#include <chrono>
+#include <cwchar>
+#include "../common/JobScheduler.h"
+#include "../common/ProgressMeter.h"
+#include "../common/ZipWriter.h"
 
 namespace fs = std::filesystem;
 
-std::wstring LoadSevenZipPath()
-{
-    std::wstring defaultPath = L"C:\\Program Files\\7-Zip\\7z.exe";
-    
-    // 実行ファイルのフルパスを取得
-    wchar_t exePath[MAX_PATH];
-    GetModuleFileNameW(nullptr, exePath, MAX_PATH);
-    
-    // 拡張子を.prefに変更
-    fs::path prefPath(exePath);
-    prefPath.replace_extension(L".pref");
-    
-    // .prefファイルが存在するかチェック
-    if (!fs::exists(prefPath))
-    {
-        return defaultPath;
-    }
-    
-    // ファイルを読み込む
-    std::wifstream prefFile(prefPath);
-    if (!prefFile.is_open())
-    {
-        return defaultPath;
-    }
-    
-    std::wstring sevenZipPath;
-    std::getline(prefFile, sevenZipPath);
-    prefFile.close();
-    
-    // 読み込んだパスが空でないかチェック
-    if (sevenZipPath.empty())
-    {
-        return defaultPath;
-    }
-    
-    // 前後の空白を削除
-    sevenZipPath.erase(0, sevenZipPath.find_first_not_of(L" \t\r\n"));
-    sevenZipPath.erase(sevenZipPath.find_last_not_of(L" \t\r\n") + 1);
-    
-    // 読み込んだパスが有効な7z.exeのパスかチェック
-    if (fs::exists(sevenZipPath) && fs::is_regular_file(sevenZipPath))
-    {
-        return sevenZipPath;
-    }
-    
-    return defaultPath;
-}
-
-bool DirToZip(const std::wstring& dirPath, const std::wstring& sevenZipPath)
+// メッセージは並列に動く他のジョブと混ざらないようmeterを通して出す
+bool DirToZip(const std::wstring& dirPath, const ZipCompressionOptions& options, bool update,
+              ProgressMeter& meter, ProgressMeter::Task& task)
 {
     try
     {
@@ -69,7 +28,7 @@ bool DirToZip(const std::wstring& dirPath, const std::wstring& sevenZipPath)
         // ディレクトリが存在するかチェック
         if (!fs::exists(dir) || !fs::is_directory(dir))
         {
-            std::wcerr << L"Directory not found: " << dirPath << std::endl;
+            meter.Print(L"Directory not found: " + dirPath, true);
             return false;
         }
 
@@ -99,72 +58,237 @@ bool DirToZip(const std::wstring& dirPath, const std::wstring& sevenZipPath)
             }
         }
 
-        // Zipファイル名とターゲットパスを作成
+        // Zipファイル名を作成
         std::wstring zipFileName = dir.wstring() + L".zip";
-        std::wstring targetPath = targetFolder.wstring() + L"\\*";
-        
-        // 7z.exeのコマンドライン引数を作成
-        std::wstring arguments = L"\"" + sevenZipPath + L"\" a \"" + zipFileName + L"\" \"" + targetPath + L"\"";
-
-        // プロセスを起動
-        STARTUPINFOW si = { sizeof(si) };
-        PROCESS_INFORMATION pi = {};
-
-        if (!CreateProcessW(
-            nullptr,
-            const_cast<LPWSTR>(arguments.c_str()),
-            nullptr,
-            nullptr,
-            FALSE,
-            0,
-            nullptr,
-            nullptr,
-            &si,
-            &pi))
-        {
-            std::wcerr << L"Failed to start 7z.exe" << std::endl;
-            return false;
-        }
-
-        // プロセスの終了を待つ
-        WaitForSingleObject(pi.hProcess, INFINITE);
-        
-        DWORD exitCode;
-        GetExitCodeProcess(pi.hProcess, &exitCode);
 
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
+        ZipWriter zip;
+        options.Apply(zip);
+        // コールバックは数を書き換えるだけ（表示はProgressMeterのスレッドがまとめて行う）
+        zip.SetProgressCallback([&task](uint64_t completed)
+        {
+            task.Update(completed);
+            return true;
+        });
 
-        if (exitCode == 0)
+        // -u: 既存のZIPがあれば、変更されたファイルだけを追記してセントラルディレクトリを書き直す
+        ZipReader reader;
+        if (update && fs::exists(zipFileName) && reader.Open(zipFileName))
         {
-            std::wcout << L"Created: " << zipFileName << std::endl;
+            ZipUpdateStats stats;
+            fs::path failedPath;
+            if (!ZipUpdateDirectoryContents(zip, reader, zipFileName, targetFolder, stats, &failedPath,
+                JobScheduler::ThreadBudget()))
+            {
+                meter.Print(L"Failed to update: " + failedPath.wstring(), true);
+                return false;
+            }
+            if (!stats.Changed())
+            {
+                meter.Print(L"Up to date: " + zipFileName);
+                return true;
+            }
+            // 使われていない領域は詰め直したら減らした大きさを、残したらその大きさを出す
+            meter.Printf(false, L"Updated: %ls (%zu added, %zu replaced, %zu removed, %zu unchanged, %.1f MB %ls)", zipFileName.c_str(),
+                stats.added, stats.replaced, stats.removed, stats.unchanged,
+                (stats.reclaimed ? stats.reclaimed : stats.deadBytes) / (1024.0 * 1024.0),
+                stats.reclaimed ? L"reclaimed" : L"unused");
+            if (zip.StoreStats().entries > 0)
+            {
+                meter.Print(L"  " + zip.StoreStats().Summary());
+            }
             return true;
         }
-        else
+
+        if (!zip.Open(zipFileName, Z_DEFAULT_COMPRESSION, JobScheduler::ThreadBudget()))
+        {
+            meter.Print(L"Failed to create: " + zipFileName, true);
+            return false;
+        }
+
+        // ターゲットフォルダの中身を追加する（大きなファイルは並列deflate）
+        fs::path failedPath;
+        if (!ZipAddDirectoryContents(zip, targetFolder, &failedPath))
+        {
+            meter.Print(L"Failed to add: " + failedPath.wstring(), true);
+            zip.Abort();
+            return false;
+        }
+
+        if (!zip.Close())
         {
-            std::wcerr << L"7z.exe failed with exit code: " << exitCode << std::endl;
+            meter.Print(L"Failed to write: " + zipFileName, true);
             return false;
         }
+
+        meter.Print(L"Created: " + zipFileName);
+        if (zip.StoreStats().entries > 0)
+        {
+            meter.Print(L"  " + zip.StoreStats().Summary());
+        }
+        return true;
     }
     catch (const std::exception& ex)
     {
-        std::cerr << "Error: " << ex.what() << std::endl;
+        meter.Printf(true, L"Error: %S", ex.what());
         return false;
     }
 }
 
-int wmain(int argc, wchar_t* argv[])
+void Usage()
+{
+    std::wcout << L"Usage: d2z [-u] [-zstd <level>] [-long] <dir> ..." << std::endl;
+    std::wcout << L"       d2z -bench [-zstd <level>] [-long] <dir|file>" << std::endl;
+    std::wcout << L"  -u : update an existing ZIP, appending only new or changed files" << std::endl;
+    std::wcout << L"  -zstd <level> : compress entries with zstd (method 93), level 1-22" << std::endl;
+    std::wcout << L"  -long : enable zstd long distance matching" << std::endl;
+    std::wcout << L"  -bench : measure deflate/zstd compress and decompress speed (no ZIP is written)" << std::endl;
+}
+
+// 生のdeflate（ZIPのメソッド8と同じ形式）で1回で圧縮する
+static bool DeflateRaw(const std::vector<uint8_t>& in, std::vector<uint8_t>& out, int level)
+{
+    z_stream zs = {};
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    out.resize(deflateBound(&zs, (uLong)in.size()));
+    zs.next_in = const_cast<Bytef*>(in.data());
+    zs.avail_in = (uInt)in.size();
+    zs.next_out = out.data();
+    zs.avail_out = (uInt)out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(out.size() - zs.avail_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static bool InflateRaw(const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+{
+    z_stream zs = {};
+    if (inflateInit2(&zs, -15) != Z_OK) return false;
+    zs.next_in = const_cast<Bytef*>(in.data());
+    zs.avail_in = (uInt)in.size();
+    zs.next_out = out.data();
+    zs.avail_out = (uInt)out.size();
+    int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END && zs.avail_out == 0;
+}
+
+// deflateとzstdの圧縮・展開速度と圧縮率を比べる
+// ZIPのエントリと同じくファイルごとに圧縮し、合計で評価する（読み込むのは先頭から最大256MBまで）
+void BenchCodecs(const fs::path& target, const ZipCompressionOptions& options)
 {
-    // 7z.exeのパスを読み込む
-    std::wstring sevenZipPath = LoadSevenZipPath();
-    
-    // 7z.exeの存在チェック
-    if (!fs::exists(sevenZipPath))
+    const uint64_t limit = 256ull * 1024 * 1024;
+    std::vector<fs::path> files;
+    if (fs::is_regular_file(target))
     {
-        std::wcout << L"7-Zip not found." << std::endl;
-        return 1;
+        files.push_back(target);
+    }
+    else if (fs::is_directory(target))
+    {
+        for (const auto& entry : fs::recursive_directory_iterator(target))
+        {
+            if (entry.is_regular_file()) files.push_back(entry.path());
+        }
+        std::sort(files.begin(), files.end());
+    }
+
+    std::vector<std::vector<uint8_t>> data;
+    uint64_t total = 0;
+    for (const auto& f : files)
+    {
+        if (total >= limit) break;
+        std::ifstream in(f, std::ios::binary);
+        std::vector<uint8_t> buf((size_t)(std::min)((uint64_t)fs::file_size(f), limit - total));
+        if (buf.empty() || !in.read(reinterpret_cast<char*>(buf.data()), (std::streamsize)buf.size())) continue;
+        total += buf.size();
+        data.push_back(std::move(buf));
+    }
+    if (total == 0)
+    {
+        std::wcout << L"No files to measure." << std::endl;
+        return;
+    }
+
+    unsigned threads = (std::max)(1u, std::thread::hardware_concurrency());
+    int level = options.zstdLevel;
+
+    struct Codec
+    {
+        std::wstring name;
+        unsigned threads;
+        std::function<bool(const std::vector<uint8_t>&, std::vector<uint8_t>&)> compress;
+        bool zstd;
+    };
+    auto zstdCompress = [](int lv, bool ldm, unsigned workers)
+    {
+        return [lv, ldm, workers](const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+        {
+            ZSTD_CCtx* cctx = ZSTD_createCCtx();
+            ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, lv);
+            if (ldm) ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+            if (workers > 1) ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, (int)workers);
+            out.resize(ZSTD_compressBound(in.size()));
+            size_t n = ZSTD_compress2(cctx, out.data(), out.size(), in.data(), in.size());
+            ZSTD_freeCCtx(cctx);
+            if (ZSTD_isError(n)) return false;
+            out.resize(n);
+            return true;
+        };
+    };
+
+    std::vector<Codec> codecs;
+    codecs.push_back({ L"deflate", 1, [](const std::vector<uint8_t>& in, std::vector<uint8_t>& out) { return DeflateRaw(in, out, Z_DEFAULT_COMPRESSION); }, false });
+    codecs.push_back({ L"deflate", threads, [threads](const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+    {
+        out.clear();
+        ParallelDeflater pd([&out](const uint8_t* p, size_t n) { out.insert(out.end(), p, p + n); return true; },
+                            Z_DEFAULT_COMPRESSION, ParallelDeflater::Wrap::Raw, threads);
+        return pd.Write(in.data(), in.size()) && pd.Finish();
+    }, false });
+    std::wstring zname = L"zstd-" + std::to_wstring(level);
+    codecs.push_back({ zname, 1, zstdCompress(level, false, 1), true });
+    codecs.push_back({ zname, threads, zstdCompress(level, false, threads), true });
+    if (options.zstdLong)
+    {
+        codecs.push_back({ zname + L"-long", threads, zstdCompress(level, true, threads), true });
+    }
+
+    std::wcout << L"files: " << data.size() << L"  bytes: " << total << std::endl;
+    wchar_t line[160];
+    std::swprintf(line, 160, L"%-14ls %7ls %8ls %12ls %12ls", L"method", L"threads", L"ratio", L"comp MB/s", L"decomp MB/s");
+    std::wcout << line << std::endl;
+
+    std::vector<uint8_t> packed, unpacked;
+    for (const auto& c : codecs)
+    {
+        uint64_t outBytes = 0;
+        double compSec = 0, decompSec = 0;
+        bool failed = false;
+        for (const auto& d : data)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            if (!c.compress(d, packed)) failed = true;
+            auto t1 = std::chrono::steady_clock::now();
+            unpacked.assign(d.size(), 0);
+            bool ok = c.zstd
+                ? ZSTD_decompress(unpacked.data(), unpacked.size(), packed.data(), packed.size()) == d.size()
+                : InflateRaw(packed, unpacked);
+            auto t2 = std::chrono::steady_clock::now();
+            if (!ok || unpacked != d) failed = true;
+            outBytes += packed.size();
+            compSec += std::chrono::duration<double>(t1 - t0).count();
+            decompSec += std::chrono::duration<double>(t2 - t1).count();
+        }
+        double mb = total / 1048576.0;
+        std::swprintf(line, 160, L"%-14ls %7u %7.1f%% %12.1f %12.1f%ls", c.name.c_str(), c.threads,
+            outBytes * 100.0 / total, compSec > 0 ? mb / compSec : 0, decompSec > 0 ? mb / decompSec : 0,
+            failed ? L" (FAILED)" : L"");
+        std::wcout << line << std::endl;
     }
+}
 
+int wmain(int argc, wchar_t* argv[])
+{
     // 引数チェック
     if (argc <= 1)
     {
@@ -172,11 +296,69 @@ int wmain(int argc, wchar_t* argv[])
         return 1;
     }
 
-    // 各引数に対してDirToZipを実行
-    for (int i = 1; i < argc; i++)
+    ZipCompressionOptions options;
+    bool bench = false;
+    bool update = false;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == L'-'; argi++)
+    {
+        std::wstring op = argv[argi];
+        if (op == L"-zstd" && argi + 1 < argc)
+        {
+            options.zstd = true;
+            options.zstdLevel = (int)std::wcstol(argv[++argi], nullptr, 10);
+            if (options.zstdLevel < 1 || options.zstdLevel > 22)
+            {
+                Usage();
+                return 1;
+            }
+        }
+        else if (op == L"-long")
+        {
+            options.zstdLong = true;
+        }
+        else if (op == L"-u")
+        {
+            update = true;
+        }
+        else if (op == L"-bench")
+        {
+            bench = true;
+        }
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+    if (argi >= argc)
+    {
+        Usage();
+        return 1;
+    }
+
+    if (bench)
+    {
+        BenchCodecs(argv[argi], options);
+        return 0;
+    }
+
+    // 各引数に対してDirToZipを実行（圧縮はCPU主体なのでコア数まで同時に動かす）
+    // 進捗は全ジョブの合計を1行で表示する（0.1秒ごと）
+    ProgressMeter meter((size_t)(argc - argi), L"Compressing");
+    JobScheduler scheduler;
+    for (int i = argi; i < argc; i++)
     {
-        DirToZip(argv[i], sevenZipPath);
+        fs::path dirPath = argv[i];
+        scheduler.Add(JobKind::Cpu, dirPath, [dirPath, &options, update, &meter]
+        {
+            ProgressMeter::Task& task = meter.Begin();
+            DirToZip(dirPath.wstring(), options, update, meter, task);
+            meter.End(task);
+        });
     }
+    scheduler.Run();
+    meter.Stop();
 
     return 0;
 }
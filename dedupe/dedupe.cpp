@@ -0,0 +1,306 @@
+﻿// dedupe.cpp : 名前が違うだけの同じ書庫を探す
+// 1. サイズでまとめる（サイズが1つしかない書庫はここで除外）
+// 2. 同じサイズの書庫はZIPならセントラルディレクトリ（全エントリの名前・サイズ・CRC32・位置）をxxh3でハッシュする
+//    ZIP以外は先頭と末尾だけをハッシュする
+// 3. ZIP以外の書庫と、-verify 指定時だけファイル全体をxxh3（128bit）でハッシュして確かめる
+// 読み込みは共通のスケジューラで物理ディスクごとに数を絞って並列に行う
+//
+
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cwctype>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <io.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#include "../common/JobScheduler.h"
+#include "../common/ZipReader.h"
+
+namespace fs = std::filesystem;
+
+// ZIP以外の書庫で2段目にハッシュする先頭・末尾の大きさ
+constexpr uint64_t kSampleSize = 1024 * 1024;
+
+struct FileInfo {
+    fs::path path;
+    uint64_t size = 0;
+    bool hasCd = false;         // セントラルディレクトリでハッシュした
+    uint64_t quickHash = 0;     // セントラルディレクトリ（または先頭・末尾）のハッシュ
+    XXH128_hash_t fullHash = {};
+    bool failed = false;
+};
+
+std::wstring ToLower(std::wstring s)
+{
+    std::transform(s.begin(), s.end(), s.begin(), [](wchar_t c) { return (wchar_t)std::towlower(c); });
+    return s;
+}
+
+bool IsArchivePath(const fs::path& path)
+{
+    std::wstring ext = ToLower(path.extension().wstring());
+    return ext == L".zip" || ext == L".cbz" || ext == L".rar" || ext == L".cbr" || ext == L".7z";
+}
+
+bool IsZipPath(const fs::path& path)
+{
+    std::wstring ext = ToLower(path.extension().wstring());
+    return ext == L".zip" || ext == L".cbz";
+}
+
+// ファイルの[offset, offset + length)をハッシュの状態に流し込む
+bool HashRange(std::ifstream& in, uint64_t offset, uint64_t length, XXH3_state_t* state, std::vector<char>& buffer)
+{
+    in.clear();
+    in.seekg((std::streamoff)offset, std::ios::beg);
+    while (length > 0)
+    {
+        size_t n = (size_t)(std::min)(length, (uint64_t)buffer.size());
+        if (!in.read(buffer.data(), (std::streamsize)n)) return false;
+        XXH3_64bits_update(state, buffer.data(), n);
+        length -= n;
+    }
+    return true;
+}
+
+// 2段目：ZIPはセントラルディレクトリから末尾まで、それ以外は先頭と末尾をハッシュする
+void QuickHash(FileInfo& f)
+{
+    std::vector<char> buffer(1024 * 1024);
+    XXH3_state_t* state = XXH3_createState();
+    XXH3_64bits_reset(state);
+
+    uint64_t cdOffset = 0;
+    if (IsZipPath(f.path))
+    {
+        ZipReader reader;
+        if (reader.Open(f.path) && reader.FileSize() == f.size)
+        {
+            cdOffset = reader.CentralDirectoryOffset();
+            f.hasCd = true;
+        }
+    }
+
+    std::ifstream in(f.path, std::ios::binary);
+    bool ok = !!in;
+    if (ok && f.hasCd)
+    {
+        ok = HashRange(in, cdOffset, f.size - cdOffset, state, buffer);
+    }
+    else if (ok)
+    {
+        uint64_t head = (std::min)(f.size, kSampleSize);
+        uint64_t tailStart = (std::max)(head, f.size > kSampleSize ? f.size - kSampleSize : 0);
+        ok = HashRange(in, 0, head, state, buffer) && HashRange(in, tailStart, f.size - tailStart, state, buffer);
+    }
+    f.failed = !ok;
+    f.quickHash = XXH3_64bits_digest(state);
+    XXH3_freeState(state);
+}
+
+// 3段目：ファイル全体をハッシュする
+void FullHash(FileInfo& f)
+{
+    std::vector<char> buffer(4 * 1024 * 1024);
+    XXH3_state_t* state = XXH3_createState();
+    XXH3_128bits_reset(state);
+    std::ifstream in(f.path, std::ios::binary);
+    uint64_t done = 0;
+    while (in)
+    {
+        in.read(buffer.data(), (std::streamsize)buffer.size());
+        std::streamsize n = in.gcount();
+        if (n <= 0) break;
+        XXH3_128bits_update(state, buffer.data(), (size_t)n);
+        done += (uint64_t)n;
+    }
+    f.failed = done != f.size;
+    f.fullHash = XXH3_128bits_digest(state);
+    XXH3_freeState(state);
+}
+
+// 引数のファイルと、フォルダの中（サブフォルダも含む）の書庫を集める
+std::vector<FileInfo> CollectArchives(const std::vector<std::wstring>& targets)
+{
+    std::vector<FileInfo> files;
+    for (const auto& t : targets)
+    {
+        fs::path path(t);
+        std::error_code ec;
+        if (fs::is_directory(path, ec))
+        {
+            for (auto it = fs::recursive_directory_iterator(path, fs::directory_options::skip_permission_denied, ec);
+                 !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+            {
+                std::error_code ec2;
+                if (!it->is_regular_file(ec2) || !IsArchivePath(it->path())) continue;
+                uint64_t size = it->file_size(ec2);
+                if (!ec2) files.push_back({ it->path(), size });
+            }
+        }
+        else if (fs::is_regular_file(path, ec))
+        {
+            files.push_back({ path, fs::file_size(path, ec) });
+        }
+        else
+        {
+            std::wcerr << L"Not found: " << t << std::endl;
+        }
+    }
+    return files;
+}
+
+// keyが同じものをまとめ、2つ以上あるグループだけを返す
+template <class Key>
+std::vector<std::vector<FileInfo*>> GroupBy(const std::vector<FileInfo*>& files, Key key)
+{
+    std::map<decltype(key(*files[0])), std::vector<FileInfo*>> groups;
+    for (FileInfo* f : files)
+    {
+        if (!f->failed) groups[key(*f)].push_back(f);
+    }
+    std::vector<std::vector<FileInfo*>> ret;
+    for (auto& g : groups)
+    {
+        if (g.second.size() > 1) ret.push_back(std::move(g.second));
+    }
+    return ret;
+}
+
+// グループごとのハッシュ処理を並列に実行する
+void RunHashJobs(const std::vector<std::vector<FileInfo*>>& groups, unsigned ioPerDisk, void (*hash)(FileInfo&))
+{
+    JobScheduler scheduler(0, ioPerDisk);
+    for (const auto& g : groups)
+    {
+        for (FileInfo* f : g)
+        {
+            scheduler.Add(JobKind::Io, f->path, [f, hash] { hash(*f); });
+        }
+    }
+    scheduler.Run();
+}
+
+void Usage()
+{
+    std::wcout << L"Usage: dedupe [-verify] [-j <n>] <archive|dir>..." << std::endl;
+    std::wcout << L"  -verify : require byte-identical files (by default ZIPs with identical central directories," << std::endl;
+    std::wcout << L"            i.e. the same entry names, sizes and CRC32s, are reported without reading the data)" << std::endl;
+    std::wcout << L"  -j <n>  : parallel reads per physical disk (default: HDD 1 / SSD 4)" << std::endl;
+    std::wcout << L"Folders are searched recursively for zip/cbz/rar/cbr/7z. Nothing is modified." << std::endl;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    _setmode(_fileno(stdout), _O_U16TEXT);
+    _setmode(_fileno(stderr), _O_U16TEXT);
+
+    bool verify = false;
+    unsigned ioPerDisk = 0;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == L'-'; argi++)
+    {
+        std::wstring op = argv[argi];
+        if (op == L"-verify")
+        {
+            verify = true;
+        }
+        else if (op == L"-j" && argi + 1 < argc)
+        {
+            long n = std::wcstol(argv[++argi], nullptr, 10);
+            if (n <= 0)
+            {
+                Usage();
+                return 1;
+            }
+            ioPerDisk = (unsigned)n;
+        }
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+    if (argi >= argc)
+    {
+        Usage();
+        return 1;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<FileInfo> files = CollectArchives(std::vector<std::wstring>(argv + argi, argv + argc));
+    std::vector<FileInfo*> all;
+    for (auto& f : files) all.push_back(&f);
+    if (all.empty())
+    {
+        std::wcout << L"No archives found." << std::endl;
+        return 0;
+    }
+
+    // 1. サイズ
+    auto bySize = GroupBy(all, [](const FileInfo& f) { return f.size; });
+    size_t sizeCandidates = 0;
+    for (const auto& g : bySize) sizeCandidates += g.size();
+
+    // 2. セントラルディレクトリ（ZIP以外は先頭・末尾）
+    RunHashJobs(bySize, ioPerDisk, QuickHash);
+    std::vector<FileInfo*> quick;
+    for (const auto& g : bySize) quick.insert(quick.end(), g.begin(), g.end());
+    auto byQuick = GroupBy(quick, [](const FileInfo& f) { return std::make_tuple(f.size, f.hasCd, f.quickHash); });
+
+    // 3. ファイル全体（セントラルディレクトリで決まらないものと -verify のときだけ）
+    std::vector<std::vector<FileInfo*>> settled, needFull;
+    for (auto& g : byQuick)
+    {
+        if (g[0]->hasCd && !verify) settled.push_back(std::move(g));
+        else needFull.push_back(std::move(g));
+    }
+    RunHashJobs(needFull, ioPerDisk, FullHash);
+    std::vector<FileInfo*> full;
+    uint64_t fullBytes = 0;
+    for (const auto& g : needFull)
+    {
+        full.insert(full.end(), g.begin(), g.end());
+        for (const FileInfo* f : g) fullBytes += f->size;
+    }
+    auto byFull = GroupBy(full, [](const FileInfo& f) {
+        return std::make_tuple(f.size, f.fullHash.high64, f.fullHash.low64);
+    });
+    size_t settledByCd = settled.size();
+    settled.insert(settled.end(), byFull.begin(), byFull.end());
+
+    // 結果（グループの中はパス順。先頭を残す候補として表示する）
+    uint64_t wasted = 0;
+    size_t duplicates = 0;
+    for (size_t i = 0; i < settled.size(); i++)
+    {
+        auto& g = settled[i];
+        std::sort(g.begin(), g.end(), [](const FileInfo* a, const FileInfo* b) { return a->path < b->path; });
+        std::wcout << L"Duplicate (" << g.size() << L" files, " << g[0]->size << L" bytes"
+            << (i < settledByCd ? L", central directory" : L", full hash") << L"):" << std::endl;
+        for (const FileInfo* f : g) std::wcout << L"  " << f->path.wstring() << std::endl;
+        wasted += g[0]->size * (g.size() - 1);
+        duplicates += g.size() - 1;
+    }
+
+    size_t failed = 0;
+    for (const auto& f : files) failed += f.failed ? 1 : 0;
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::wcout << files.size() << L" archives, " << sizeCandidates << L" share a size, "
+        << settledByCd << L" group(s) settled by central directory, "
+        << full.size() << L" fully hashed (" << fullBytes / (1024 * 1024) << L" MB)" << std::endl;
+    std::wcout << settled.size() << L" duplicate group(s), " << duplicates << L" redundant file(s), "
+        << wasted / (1024 * 1024) << L" MB reclaimable";
+    if (failed) std::wcout << L", " << failed << L" unreadable";
+    std::wcout << L" (" << sec << L" s)" << std::endl;
+    return 0;
+}
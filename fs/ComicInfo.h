@@ -0,0 +1,111 @@
+﻿#pragma once
+// 書庫（zip/cbz）の中のComicInfo.xmlを展開せずに読む
+// セントラルディレクトリからエントリを探し、そのエントリだけをメモリに展開してpugixmlで解析する
+// 書庫1つあたり末尾の読み込みと小さなエントリ1つの読み込みで済む
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "../common/ZipReader.h"
+#include "../xmlv/pugixml.hpp"
+
+struct ComicInfo {
+    std::string title;      // UTF-8
+    std::string series;
+    std::string number;
+    std::string volume;
+    std::string writer;
+    std::string penciller;
+    std::string publisher;
+
+    // 作者（Writerがなければ Penciller）
+    std::string Author() const { return writer.empty() ? penciller : writer; }
+};
+
+// ComicInfo.xmlがこれより大きい場合は読まない（壊れた書庫で大きなバッファを確保しない）
+inline constexpr uint64_t kComicInfoMaxSize = 1024 * 1024;
+
+// 書庫の中のComicInfo.xmlを探す（大文字小文字は区別しない。ルートにあるものを優先し、なければ最初に見つかったもの）
+inline const ZipEntry* FindComicInfoEntry(const ZipReader& reader) {
+    const ZipEntry* found = nullptr;
+    for (const auto& e : reader.Entries()) {
+        if (e.IsDirectory()) continue;
+        size_t slash = e.name.find_last_of("/\\");
+        std::string fn = (slash == std::string::npos) ? e.name : e.name.substr(slash + 1);
+        if (fn.size() != 13) continue;
+        bool match = true;
+        for (size_t i = 0; i < fn.size() && match; i++) {
+            match = std::tolower((unsigned char)fn[i]) == "comicinfo.xml"[i];
+        }
+        if (!match) continue;
+        if (slash == std::string::npos) return &e;
+        if (!found) found = &e;
+    }
+    return found;
+}
+
+// 子要素の文字列（前後の空白は取り除く）
+inline std::string ComicInfoText(const pugi::xml_node& root, const char* name) {
+    std::string s = root.child(name).text().get();
+    size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) return std::string();
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+// ComicInfo.xmlを読んで解析する。書庫がZIPでない、ComicInfo.xmlがない、XMLが壊れている場合はfalse
+inline bool ReadComicInfo(const std::filesystem::path& archive, ComicInfo& info) {
+    ZipReader reader;
+    if (!reader.Open(archive)) return false;
+    const ZipEntry* entry = FindComicInfoEntry(reader);
+    if (!entry || !entry->IsExtractable() || entry->usize > kComicInfoMaxSize) return false;
+
+    std::vector<uint8_t> xml;
+    xml.reserve((size_t)entry->usize);
+    if (!reader.Extract(*entry, [&xml](const uint8_t* p, size_t n) {
+            xml.insert(xml.end(), p, p + n);
+            return true;
+        })) {
+        return false;
+    }
+
+    // 文字コードはBOMとXML宣言からpugixmlが判定し、UTF-8に変換される
+    pugi::xml_document doc;
+    if (!doc.load_buffer(xml.data(), xml.size())) return false;
+    pugi::xml_node root = doc.child("ComicInfo");
+    if (!root) return false;
+
+    info.title = ComicInfoText(root, "Title");
+    info.series = ComicInfoText(root, "Series");
+    info.number = ComicInfoText(root, "Number");
+    info.volume = ComicInfoText(root, "Volume");
+    info.writer = ComicInfoText(root, "Writer");
+    info.penciller = ComicInfoText(root, "Penciller");
+    info.publisher = ComicInfoText(root, "Publisher");
+    return true;
+}
+
+// フォルダ名に使えない文字を全角に置き換える（UTF-8）
+inline std::string ComicInfoFolderName(const std::string& s) {
+    std::string ret;
+    for (char c : s) {
+        switch (c) {
+        case '\\': ret += "\xEF\xBC\xBC"; break;  // ＼
+        case '/':  ret += "\xEF\xBC\x8F"; break;  // ／
+        case ':':  ret += "\xEF\xBC\x9A"; break;  // ：
+        case '*':  ret += "\xEF\xBC\x8A"; break;  // ＊
+        case '?':  ret += "\xEF\xBC\x9F"; break;  // ？
+        case '"':  ret += "\xE2\x80\x9D"; break;  // ”
+        case '<':  ret += "\xEF\xBC\x9C"; break;  // ＜
+        case '>':  ret += "\xEF\xBC\x9E"; break;  // ＞
+        case '|':  ret += "\xEF\xBD\x9C"; break;  // ｜
+        default:
+            if ((unsigned char)c >= 0x20) ret += c;
+            break;
+        }
+    }
+    // 末尾のピリオドと空白はWindowsのフォルダ名に使えない
+    while (!ret.empty() && (ret.back() == '.' || ret.back() == ' ')) ret.pop_back();
+    return ret;
+}
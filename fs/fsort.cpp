@@ -13,7 +13,10 @@ namespace fs = std::filesystem;
 
 
 void Usage() {
-    std::wcout << L"Usage: fs <path>" << std::endl;
+    std::wcout << L"Usage: fs [-series | -author] <path>" << std::endl;
+    std::wcout << L"       fs -r <path>" << std::endl;
+    std::wcout << L"  -series : sort zip/cbz by the Series in ComicInfo.xml" << std::endl;
+    std::wcout << L"  -author : sort zip/cbz by the Writer (or Penciller) in ComicInfo.xml" << std::endl;
 }
 
 int wmain(int argc, wchar_t* argv[]) {
@@ -21,6 +24,7 @@ int wmain(int argc, wchar_t* argv[]) {
     _setmode(_fileno(stdout), _O_U16TEXT);
 
     std::wstring targetPath;
+    FsortKey key = FsortKey::Bracket;
     if (argc < 2) {
         targetPath = fs::current_path().wstring();
     } else if (argc == 2) {
@@ -38,6 +42,12 @@ int wmain(int argc, wchar_t* argv[]) {
             // 結果が UTF-8 の場合は wstring に変換して出力
             std::wcout << Utf8ToWString(res) << std::endl;
             return 0;
+        } else if (op == L"-series" || op == L"/series") {
+            key = FsortKey::Series;
+            targetPath = argv[2];
+        } else if (op == L"-author" || op == L"/author") {
+            key = FsortKey::Author;
+            targetPath = argv[2];
         } else {
             Usage();
             return 1;
@@ -67,7 +77,7 @@ int wmain(int argc, wchar_t* argv[]) {
 
             found = true;
             // FSort が std::string を受け取る場合は UTF-8 を渡す
-            std::string res = FSort(pathUtf8);
+            std::string res = FSort(pathUtf8, key);
             // 結果が UTF-8 の場合は wstring に変換して出力
             std::wcout << Utf8ToWString(res) << std::endl;
         }
@@ -6,9 +6,17 @@
 #include <string>
 #include <algorithm>
 #include <Windows.h>
+#include "ComicInfo.h"
 
 namespace fs = std::filesystem;
 
+// ړtH_̌ߕ
+enum class FsortKey {
+    Bracket,    // t@C[xxxx]
+    Series,     // ComicInfo.xmlSeries
+    Author,     // ComicInfo.xmlWriteriȂPencillerj
+};
+
 // wstring  UTF-8 string ϊ֐iWindowspj
 inline std::string WStringToUtf8_fsort(const std::wstring& wstr) {
     if (wstr.empty()) return "";
@@ -38,7 +46,7 @@ std::string GetBracketContent(const std::string& src) {
 }
 
 // FSort: t@C[xxxx]fBNgɈړ
-std::string FSort(const std::string& p) {
+std::string FSort(const std::string& p, FsortKey key = FsortKey::Bracket) {
     // UTF-8ChɕϊĂpath\z
     fs::path path(Utf8ToWString_fsort(p));
     if (!fs::exists(path) || !fs::is_regular_file(path)) {
@@ -46,14 +54,31 @@ std::string FSort(const std::string& p) {
     }
     //  .string()̑.wstring()gpUTF-8ɕϊ
     std::string fn = WStringToUtf8_fsort(path.filename().wstring());
-    std::string cnt = GetBracketContent(fn);
     std::string ext = WStringToUtf8_fsort(path.extension().wstring());
     std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-    if (ext != ".zip" && ext != ".rar") {
-        return "Skipped (not zip/rar). " + fn;
+    std::string cnt;
+    if (key == FsortKey::Bracket) {
+        cnt = GetBracketContent(fn);
+        if (ext != ".zip" && ext != ".rar") {
+            return "Skipped (not zip/rar). " + fn;
+        }
+        if (cnt.empty()) {
+            return "No brackets found. " + fn;
+        }
     }
-    if (cnt.empty()) {
-        return "No brackets found. " + fn;
+    else {
+        // ComicInfo.xml̓ZgfBNgTēǂށiRAR͑ΏۊOj
+        if (ext != ".zip" && ext != ".cbz") {
+            return "Skipped (not zip/cbz). " + fn;
+        }
+        ComicInfo info;
+        if (!ReadComicInfo(path, info)) {
+            return "No ComicInfo.xml. " + fn;
+        }
+        cnt = ComicInfoFolderName(key == FsortKey::Series ? info.series : info.Author());
+        if (cnt.empty()) {
+            return (key == FsortKey::Series ? "No series in ComicInfo.xml. " : "No author in ComicInfo.xml. ") + fn;
+        }
     }
     fs::path newDir = path.parent_path() / Utf8ToWString_fsort(cnt);
     if (!fs::exists(newDir)) {
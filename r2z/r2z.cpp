@@ -5,6 +5,15 @@
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <cwchar>
+#include <map>
+#include <mutex>
+#include "../common/ArchiveIndex.h"
+#include "../common/JobScheduler.h"
+#include "../common/ProgressMeter.h"
+#include "../common/SevenZipList.h"
+#include "../common/ZipWriter.h"
 
 namespace fs = std::filesystem;
 
@@ -14,34 +23,10 @@ struct ArcInfo
     bool isDir;
     bool isRootDir;
     bool enabled;
+    uint64_t size;
+    std::wstring modified;
 
-    ArcInfo() : isDir(false), isRootDir(false), enabled(false) {}
-
-    bool Parse(const std::wstring& line)
-    {
-        enabled = false;
-        if (line.length() < 53) return false;
-
-        try
-        {
-            wchar_t attrD = line[20];
-            wchar_t attrA = line[24];
-
-            if ((attrD != L'D') && (attrD != L'.')) return false;
-            if ((attrA != L'A') && (attrA != L'.')) return false;
-
-            name = line.substr(53);
-            isDir = (attrD == L'D');
-            isRootDir = (name.find(L'\\') == std::wstring::npos && name.find(L'/') == std::wstring::npos);
-            enabled = true;
-            return true;
-        }
-        catch (...)
-        {
-            enabled = false;
-            return false;
-        }
-    }
+    ArcInfo() : isDir(false), isRootDir(false), enabled(false), size(0) {}
 };
 
 std::wstring LoadSevenZipPath()
@@ -94,100 +79,123 @@ std::vector<ArcInfo> Listup(const std::wstring& archiveFile, const std::wstring&
         return fileList;
     }
 
-    std::wstring arguments = L"\"" + sevenZipPath + L"\" l \"" + archiveFile + L"\"";
-
-    HANDLE hReadPipe, hWritePipe;
-    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
-    
-    if (!CreatePipe(&hReadPipe, &hWritePipe, &sa, 0))
+    // 変わっていない書庫はインデックスの一覧を使い、なければ 7z l -slt -sccUTF-8 の出力を届いた分から順に解析する
+    std::vector<ArchiveIndexEntry> items;
+    ArchiveIndex::Shared().List(archiveFile, items, [&](std::vector<ArchiveIndexEntry>& out)
     {
-        return fileList;
-    }
-
-    STARTUPINFOW si = { sizeof(si) };
-    si.dwFlags = STARTF_USESTDHANDLES;
-    si.hStdOutput = hWritePipe;
-    si.hStdError = hWritePipe;
-    PROCESS_INFORMATION pi = {};
-
-    if (CreateProcessW(
-        nullptr,
-        const_cast<LPWSTR>(arguments.c_str()),
-        nullptr,
-        nullptr,
-        TRUE,
-        CREATE_NO_WINDOW,
-        nullptr,
-        nullptr,
-        &si,
-        &pi))
+        return SevenZipList(sevenZipPath, archiveFile, [&out](const SevenZipItem& item)
+        {
+            out.push_back({ item.path, item.isDir, item.size, item.packedSize, item.modified });
+        });
+    });
+    for (const auto& item : items)
     {
-        CloseHandle(hWritePipe);
-
-        char buffer[4096];
-        DWORD bytesRead;
-        std::string output;
+        ArcInfo ai;
+        ai.name = item.path;
+        ai.isDir = item.isDir;
+        ai.isRootDir = (ai.name.find(L'\\') == std::wstring::npos && ai.name.find(L'/') == std::wstring::npos);
+        ai.enabled = true;
+        ai.size = item.size;
+        ai.modified = item.modified;
+        fileList.push_back(ai);
+    }
 
-        while (ReadFile(hReadPipe, buffer, sizeof(buffer) - 1, &bytesRead, nullptr) && bytesRead > 0)
-        {
-            buffer[bytesRead] = '\0';
-            output += buffer;
-        }
+    return fileList;
+}
 
-        WaitForSingleObject(pi.hProcess, INFINITE);
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
-        CloseHandle(hReadPipe);
+bool IsScrFile(const std::wstring& name)
+{
+    std::wstring ext = fs::path(name).extension().wstring();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == L".scr";
+}
 
-        int wideSize = MultiByteToWideChar(CP_OEMCP, 0, output.c_str(), -1, nullptr, 0);
-        if (wideSize > 0)
+bool HasScrFileInArchive(const std::vector<ArcInfo>& fileList)
+{
+    for (const auto& file : fileList)
+    {
+        if (!file.isDir && IsScrFile(file.name))
         {
-            std::vector<wchar_t> wideBuffer(wideSize);
-            MultiByteToWideChar(CP_OEMCP, 0, output.c_str(), -1, wideBuffer.data(), wideSize);
-
-            std::wstring wideOutput(wideBuffer.data());
-            std::wistringstream stream(wideOutput);
-            std::wstring line;
-
-            while (std::getline(stream, line))
-            {
-                ArcInfo ai;
-                if (ai.Parse(line))
-                {
-                    fileList.push_back(ai);
-                }
-            }
+            return true;
         }
     }
-    else
-    {
-        CloseHandle(hWritePipe);
-        CloseHandle(hReadPipe);
-    }
+    return false;
+}
 
-    return fileList;
+// 先頭のパス要素（区切りは\\か/）
+std::wstring TopComponent(const std::wstring& name, bool& hasSeparator)
+{
+    size_t pos = name.find_first_of(L"\\/");
+    hasSeparator = (pos != std::wstring::npos);
+    return hasSeparator ? name.substr(0, pos) : name;
 }
 
-bool HasScrFileInArchive(const std::vector<ArcInfo>& fileList)
+// ZIPから*.scrを取り除く
+// 残すエントリは圧縮データをそのままコピーするので再圧縮しない（I/Oだけで済む）
+bool FilterZip(const fs::path& zipFile, ProgressMeter& meter)
 {
-    for (const auto& file : fileList)
+    fs::path tmpFile = zipFile;
+    tmpFile += L".r2z.tmp";
+    size_t removed = 0;
     {
-        if (!file.isDir)
+        ZipReader reader;
+        if (!reader.Open(zipFile))
         {
-            fs::path filePath(file.name);
-            std::wstring ext = filePath.extension().wstring();
-            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-            
-            if (ext == L".scr")
+            meter.Print(L"Not a valid ZIP file: " + zipFile.wstring(), true);
+            return false;
+        }
+        for (const auto& entry : reader.Entries())
+        {
+            if (!entry.IsDirectory() && IsScrFile(entry.WideName())) removed++;
+        }
+        if (removed == 0)
+        {
+            meter.Print(L"No *.scr files: " + zipFile.wstring());
+            return true;
+        }
+
+        ZipWriter zip;
+        if (!zip.Open(tmpFile, Z_DEFAULT_COMPRESSION, JobScheduler::ThreadBudget()))
+        {
+            meter.Print(L"Failed to create ZIP file: " + tmpFile.wstring(), true);
+            return false;
+        }
+        for (const auto& entry : reader.Entries())
+        {
+            if (!entry.IsDirectory() && IsScrFile(entry.WideName())) continue;
+            if (!zip.CopyRawEntry(reader, entry))
             {
-                return true;
+                meter.Print(L"Failed to copy: " + entry.WideName(), true);
+                zip.Abort();
+                return false;
             }
         }
+        if (!zip.Close())
+        {
+            meter.Print(L"Failed to write: " + tmpFile.wstring(), true);
+            return false;
+        }
     }
-    return false;
+
+    // 書き終えてから元のファイルと置き換える
+    // 元のZIPが開かれているなどで置き換えられなければ、一時ファイルを消して元のZIPはそのまま残す
+    std::error_code ec;
+    fs::rename(tmpFile, zipFile, ec);
+    if (ec)
+    {
+        meter.Printf(true, L"Failed to replace: %ls (%S)", zipFile.wstring().c_str(), ec.message().c_str());
+        fs::remove(tmpFile, ec);
+        return false;
+    }
+    meter.Printf(false, L"Removed %zu *.scr file(s): %ls", removed, zipFile.wstring().c_str());
+    return true;
 }
 
-bool RarToZip(const std::wstring& filePath, const std::wstring& sevenZipPath)
+// RARをZIPにする（ZIPなら*.scrを除くだけ）。メッセージは並列に動く他のジョブと混ざらないようmeterを通して出す
+// interactiveがfalseなら7z.exeの出力は捨ててパスワードは空にし、7z.exeが失敗したら*retryをtrueにする
+// （呼び出し側で、他の書庫が終わってから1つずつやり直す）
+bool RarToZip(const std::wstring& filePath, const std::wstring& sevenZipPath, const ZipCompressionOptions& options,
+              ProgressMeter& meter, bool interactive, bool* retry)
 {
     try
     {
@@ -195,16 +203,22 @@ bool RarToZip(const std::wstring& filePath, const std::wstring& sevenZipPath)
         
         if (!fs::exists(rarFile) || !fs::is_regular_file(rarFile))
         {
-            std::wcerr << L"Archive file not found: " << filePath << std::endl;
+            meter.Print(L"Archive file not found: " + filePath, true);
             return false;
         }
 
         std::wstring ext = rarFile.extension().wstring();
         std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
         
+        // ZIPは*.scrを取り除くだけ（再圧縮しない）
+        if (ext == L".zip")
+        {
+            return FilterZip(rarFile, meter);
+        }
+
         if (ext != L".rar")
         {
-            std::wcerr << L"Not a RAR file: " << ext << std::endl;
+            meter.Print(L"Not a RAR file: " + filePath, true);
             return false;
         }
 
@@ -212,141 +226,183 @@ bool RarToZip(const std::wstring& filePath, const std::wstring& sevenZipPath)
         std::vector<ArcInfo> list = Listup(filePath, sevenZipPath);
         bool hasScrFile = HasScrFileInArchive(list);
 
-        // 一時展開フォルダを作成
-        wchar_t tempPath[MAX_PATH];
-        GetTempPathW(MAX_PATH, tempPath);
-        fs::path tempExtractFolder = fs::path(tempPath) / rarFile.stem();
-        
-        fs::create_directories(tempExtractFolder);
-
-        // rarファイルを一時フォルダに展開
-        std::wstring arguments = L"\"" + sevenZipPath + L"\" x \"" + filePath + L"\" -o\"" + tempExtractFolder.wstring() + L"\" -y";
-        
-        // scrファイルがある場合は除外
         if (hasScrFile)
         {
-            arguments += L" -x!***.scr";
-            std::wcout << L"Warning: *.scr files will be excluded" << std::endl;
+            meter.Print(L"Warning: *.scr files will be excluded: " + filePath);
         }
 
-        STARTUPINFOW si = { sizeof(si) };
-        PROCESS_INFORMATION pi = {};
-
-        if (!CreateProcessW(
-            nullptr,
-            const_cast<LPWSTR>(arguments.c_str()),
-            nullptr,
-            nullptr,
-            FALSE,
-            0,
-            nullptr,
-            nullptr,
-            &si,
-            &pi))
+        // ルートにフォルダが1つだけでファイルがない場合は、そのフォルダの中身をZIPのルートにする
+        std::vector<std::wstring> topNames;
+        bool rootHasFile = false;
+        for (const auto& item : list)
         {
-            std::wcerr << L"Failed to extract RAR file" << std::endl;
-            fs::remove_all(tempExtractFolder);
-            return false;
+            if (!item.isDir && IsScrFile(item.name)) continue;
+            bool hasSeparator;
+            std::wstring top = TopComponent(item.name, hasSeparator);
+            if (!hasSeparator && !item.isDir) rootHasFile = true;
+            if (std::find(topNames.begin(), topNames.end(), top) == topNames.end()) topNames.push_back(top);
         }
+        size_t stripLength = 0;
+        if (topNames.size() == 1 && !rootHasFile)
+        {
+            stripLength = topNames[0].size() + 1;
+        }
+        auto entryPath = [stripLength](const std::wstring& name) {
+            return name.size() > stripLength ? name.substr(stripLength) : std::wstring();
+        };
 
-        WaitForSingleObject(pi.hProcess, INFINITE);
-        
-        DWORD exitCode;
-        GetExitCodeProcess(pi.hProcess, &exitCode);
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
+        // zipファイル名を作成
+        std::wstring outputZipFile = rarFile.wstring();
+        size_t pos = outputZipFile.rfind(L".rar");
+        if (pos != std::wstring::npos)
+        {
+            outputZipFile.replace(pos, 4, L".zip");
+        }
+        else
+        {
+            outputZipFile += L".zip";
+        }
 
-        if (exitCode != 0)
+        ZipWriter zip;
+        options.Apply(zip);
+        if (!zip.Open(outputZipFile, Z_DEFAULT_COMPRESSION, JobScheduler::ThreadBudget()))
         {
-            std::wcerr << L"Extraction failed with exit code: " << exitCode << std::endl;
-            fs::remove_all(tempExtractFolder);
+            meter.Print(L"Failed to create ZIP file: " + outputZipFile, true);
             return false;
         }
 
-        // 展開先のサブディレクトリとファイルをチェック
-        int dirCount = 0;
-        int fileCount = 0;
-        fs::path targetFolder = tempExtractFolder;
+        uint16_t arcTime, arcDate;
+        ZipDosTime(rarFile, arcTime, arcDate);
 
-        for (const auto& entry : fs::directory_iterator(tempExtractFolder))
+        // フォルダのエントリを先に書く（一覧にないが途中のパスに現れるフォルダも含める）
+        // 一覧にあるフォルダの日時は名前から引けるようにしておく（同じ名前が複数あれば先のもの）
+        std::vector<std::wstring> dirs;
+        std::map<std::wstring, std::wstring> dirModified;
+        for (const auto& item : list)
         {
-            if (entry.is_directory())
-                dirCount++;
-            else if (entry.is_regular_file())
-                fileCount++;
+            std::wstring name = entryPath(item.name);
+            if (item.isDir && !name.empty())
+            {
+                dirs.push_back(name);
+                dirModified.emplace(name, item.modified);
+            }
+            for (size_t p = name.find_first_of(L"\\/"); p != std::wstring::npos; p = name.find_first_of(L"\\/", p + 1))
+            {
+                if (!item.isDir || p + 1 < name.size()) dirs.push_back(name.substr(0, p));
+            }
+        }
+        std::sort(dirs.begin(), dirs.end());
+        dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+        for (const auto& dir : dirs)
+        {
+            uint16_t dosTime = arcTime, dosDate = arcDate;
+            auto it = dirModified.find(dir);
+            if (it != dirModified.end())
+            {
+                SevenZipDosTime(it->second, dosTime, dosDate);
+            }
+            if (!zip.AddDirectory(ZipEntryName(fs::path(dir)), dosTime, dosDate))
+            {
+                zip.Abort();
+                meter.Print(L"Failed to convert: " + filePath, true);
+                return false;
+            }
+        }
+
+        // 7z x -so の出力を一覧のサイズで切り分けて、そのままZIPに書き込む（一時フォルダを使わない）
+        SevenZipExtractPipe pipe;
+        if (!pipe.Start(sevenZipPath, filePath, interactive))
+        {
+            meter.Print(L"Failed to extract RAR file: " + filePath, true);
+            zip.Abort();
+            return false;
         }
 
-        // サブディレクトリが1つだけでファイルが0の場合、そのサブディレクトリを圧縮対象にする
-        if (dirCount == 1 && fileCount == 0)
+        std::vector<uint8_t> buffer(1024 * 1024);
+        bool ok = true;
+        bool pipeFailed = false;    // 7z.exeの出力が足りなかった（パスワード付きなど）
+        for (const auto& item : list)
         {
-            for (const auto& entry : fs::directory_iterator(tempExtractFolder))
+            if (item.isDir) continue;
+
+            // scrファイルは読み捨てる
+            bool skip = IsScrFile(item.name);
+            std::string name = ZipEntryName(fs::path(entryPath(item.name)));
+            uint64_t remain = item.size;
+            size_t n = (size_t)(std::min)(remain, (uint64_t)buffer.size());
+            if (!pipe.Read(buffer.data(), n))
             {
-                if (entry.is_directory())
+                ok = false;
+                pipeFailed = true;
+                break;
+            }
+            remain -= n;
+
+            if (!skip)
+            {
+                uint16_t dosTime = arcTime, dosDate = arcDate;
+                SevenZipDosTime(item.modified, dosTime, dosDate);
+                ZipWriter::Method method = zip.ChooseMethod(name, buffer.data(), n, item.size);
+                ok = zip.BeginEntry(name, method, dosTime, dosDate, item.size) && zip.WriteEntry(buffer.data(), n);
+            }
+            while (ok && remain > 0)
+            {
+                n = (size_t)(std::min)(remain, (uint64_t)buffer.size());
+                if (!pipe.Read(buffer.data(), n))
                 {
-                    targetFolder = entry.path();
+                    pipeFailed = true;
+                    ok = false;
                     break;
                 }
+                ok = skip || zip.WriteEntry(buffer.data(), n);
+                remain -= n;
             }
+            if (ok && !skip)
+            {
+                ok = zip.EndEntry();
+            }
+            if (!ok) break;
         }
 
-        // zipファイル名を作成
-        std::wstring outputZipFile = rarFile.wstring();
-        size_t pos = outputZipFile.rfind(L".rar");
-        if (pos != std::wstring::npos)
+        // 7z.exeの終了コードと、一覧のサイズどおりに出力が終わったかを確認する
+        if (!pipe.Finish())
         {
-            outputZipFile.replace(pos, 4, L".zip");
+            ok = false;
+            pipeFailed = true;
         }
-        else
+        if (ok)
         {
-            outputZipFile += L".zip";
+            ok = zip.Close();
         }
-
-        // zipに圧縮
-        std::wstring targetPath = targetFolder.wstring() + L"\\*";
-        arguments = L"\"" + sevenZipPath + L"\" a -tzip \"" + outputZipFile + L"\" \"" + targetPath + L"\"";
-
-        si = { sizeof(si) };
-        pi = {};
-
-        if (!CreateProcessW(
-            nullptr,
-            const_cast<LPWSTR>(arguments.c_str()),
-            nullptr,
-            nullptr,
-            FALSE,
-            0,
-            nullptr,
-            nullptr,
-            &si,
-            &pi))
+        else
         {
-            std::wcerr << L"Failed to create ZIP file" << std::endl;
-            fs::remove_all(tempExtractFolder);
-            return false;
+            zip.Abort();
         }
 
-        WaitForSingleObject(pi.hProcess, INFINITE);
-        GetExitCodeProcess(pi.hProcess, &exitCode);
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
-
-        // 一時フォルダを削除
-        fs::remove_all(tempExtractFolder);
-
-        if (exitCode == 0)
+        if (ok)
         {
-            std::wcout << L"Created: " << outputZipFile << std::endl;
+            meter.Print(L"Created: " + outputZipFile);
+            if (zip.StoreStats().entries > 0)
+            {
+                meter.Print(L"  " + zip.StoreStats().Summary());
+            }
             return true;
         }
+        else if (pipeFailed && !interactive && retry)
+        {
+            // パスワード付きの書庫などは、あとで7z.exeの出力を表示してやり直す
+            *retry = true;
+            return false;
+        }
         else
         {
-            std::wcerr << L"Compression failed with exit code: " << exitCode << std::endl;
+            meter.Print(L"Failed to convert: " + filePath, true);
             return false;
         }
     }
     catch (const std::exception& ex)
     {
-        std::cerr << "Error: " << ex.what() << std::endl;
+        meter.Printf(true, L"Error: %S", ex.what());
         return false;
     }
 }
@@ -367,10 +423,70 @@ int wmain(int argc, wchar_t* argv[])
         return 1;
     }
 
-    for (int i = 1; i < argc; i++)
+    // -zstd <level>: 変換後のZIPをzstd（メソッド93）で圧縮する / -long: 長距離マッチング
+    ZipCompressionOptions options;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == L'-'; argi++)
+    {
+        std::wstring op = argv[argi];
+        if (op == L"-zstd" && argi + 1 < argc)
+        {
+            options.zstd = true;
+            options.zstdLevel = (int)std::wcstol(argv[++argi], nullptr, 10);
+            if (options.zstdLevel < 1 || options.zstdLevel > 22)
+            {
+                std::wcout << L"Invalid zstd level." << std::endl;
+                return 1;
+            }
+        }
+        else if (op == L"-long")
+        {
+            options.zstdLong = true;
+        }
+        else
+        {
+            std::wcout << L"Unknown option: " << op << std::endl;
+            return 1;
+        }
+    }
+
+    // RARの変換は展開と圧縮でCPU主体、ZIPから.scrを除くのは生コピーだけなのでI/O主体
+    // 進捗は終わった書庫の数を1行で表示する（0.1秒ごと）
+    std::vector<std::wstring> retries;
+    std::mutex retryMtx;
+    {
+        ProgressMeter meter((size_t)(argc - argi), L"Converting");
+        JobScheduler scheduler;
+        for (int i = argi; i < argc; i++)
+        {
+            fs::path filePath = argv[i];
+            std::wstring ext = filePath.extension().wstring();
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+            JobKind kind = (ext == L".zip") ? JobKind::Io : JobKind::Cpu;
+            scheduler.Add(kind, filePath, [filePath, &sevenZipPath, &options, &meter, &retries, &retryMtx]
+            {
+                ProgressMeter::Task& task = meter.Begin();
+                bool retry = false;
+                RarToZip(filePath.wstring(), sevenZipPath, options, meter, false, &retry);
+                if (retry)
+                {
+                    std::lock_guard<std::mutex> lock(retryMtx);
+                    retries.push_back(filePath.wstring());
+                }
+                meter.End(task);
+            });
+        }
+        scheduler.Run();
+    }
+
+    // 7z.exeが失敗した書庫は、コンソールを1つずつ使ってやり直す（パスワードの入力もここで行う）
+    ProgressMeter console(retries.size(), L"Converting");  // Beginしないので進捗は表示せず、メッセージを出すだけ
+    for (const auto& filePath : retries)
     {
-        RarToZip(argv[i], sevenZipPath);
+        console.Print(L"Retrying with 7-Zip output: " + filePath);
+        RarToZip(filePath, sevenZipPath, options, console, true, nullptr);
     }
+    ArchiveIndex::Shared().Save();
 
     return 0;
 }
\ No newline at end of file
@@ -6,10 +6,14 @@
 #include <windows.h>
 #include <fcntl.h>
 #include <io.h>
+#include <atomic>
 
 #include <bit7z/bit7zlibrary.hpp>
 #include <bit7z/bitfileextractor.hpp>
-#include <bit7z/bitfilecompressor.hpp>
+
+#include "../common/JobScheduler.h"
+#include "../common/ProgressMeter.h"
+#include "../common/ZipWriter.h"
 
 namespace fs = std::filesystem;
 
@@ -22,64 +26,87 @@ std::string ToUtf8(const std::wstring& wstr) {
     return strTo;
 }
 
-bool ConvertRarToZip(bit7z::Bit7zLibrary& lib, const fs::path& rarPath) {
+// 作業用の名前（プロセスIDと通し番号を付ける）
+// 同じフォルダの書庫を同時に変換しても、別のr2zipが同じフォルダで動いていても重ならない
+fs::path UniqueStagingPath(const fs::path& dir, const wchar_t* suffix) {
+    static std::atomic<unsigned> counter{ 0 };
+    for (;;) {
+        fs::path p = dir / (L"r2zip_" + std::to_wstring(GetCurrentProcessId()) + L"_" + std::to_wstring(counter++) + suffix);
+        if (!fs::exists(p)) return p;
+    }
+}
+
+bool ConvertRarToZip(bit7z::Bit7zLibrary& lib, const fs::path& rarPath, ProgressMeter& meter, ProgressMeter::Task& task) {
     fs::path absRarPath = fs::absolute(rarPath);
-    fs::path workRar = absRarPath.parent_path() / L"processing_target.tmp";
-    fs::path tempDir = absRarPath.parent_path() / L"T_EXTRACT_WORK";
+    fs::path workRar = UniqueStagingPath(absRarPath.parent_path(), L".tmp");
+    fs::path tempDir = UniqueStagingPath(absRarPath.parent_path(), L"_work");
 
     try {
-        std::wcout << L"\nTarget: " << absRarPath.filename().wstring() << std::endl;
+        meter.Print(L"Target: " + absRarPath.filename().wstring());
 
         // 1. 特殊文字回避のために一時リネーム
-        if (fs::exists(workRar)) fs::remove(workRar);
         fs::rename(absRarPath, workRar);
-
-        if (fs::exists(tempDir)) fs::remove_all(tempDir);
         fs::create_directories(tempDir);
 
         // 2. 展開（RAR）
         bit7z::BitFileExtractor extractor{ lib, bit7z::BitFormat::Rar };
 
+        // 進捗は展開と圧縮を合わせて展開後サイズの2倍として数える
+        // コールバックは数を書き換えるだけ（表示はProgressMeterのスレッドが全書庫の合計をまとめて行う）
+        std::atomic<uint64_t> unpacked{ 0 };
+        extractor.setTotalCallback([&](uint64_t total) {
+            unpacked = total;
+            task.SetTotal(total * 2);
+            });
         // 【重要】Callbackの引数を (uint64_t) 1つにし、戻り値を bool にします
-        extractor.setProgressCallback([](uint64_t completed) -> bool {
-            std::wcout << L"\rExtracting... " << (completed / 1024) << L" KB" << std::flush;
+        extractor.setProgressCallback([&task](uint64_t completed) -> bool {
+            task.Update(completed);
             return true; // 処理を続行
             });
 
         extractor.extractMatching(ToUtf8(workRar.wstring()), "*.scr", ToUtf8(tempDir.wstring()), bit7z::FilterPolicy::Exclude);
-        std::wcout << L" [Done]" << std::endl;
 
-        // 3. 圧縮（ZIP）
+        // 3. 圧縮（ZIP）: 圧縮済みの画像・動画は無圧縮で格納する
         fs::path zipPath = absRarPath;
         zipPath.replace_extension(L".zip");
-        bit7z::BitFileCompressor compressor{ lib, bit7z::BitFormat::Zip };
-
-        compressor.setProgressCallback([](uint64_t completed) -> bool {
-            std::wcout << L"\rCompressing... " << (completed / 1024) << L" KB" << std::flush;
+        ZipWriter zip;
+        zip.SetProgressCallback([&](uint64_t completed) -> bool {
+            task.Update(unpacked + completed);
             return true;
             });
 
-        fs::path oldPath = fs::current_path();
-        fs::current_path(tempDir);
-        try {
-            compressor.compress({ "." }, ToUtf8(zipPath.wstring()));
+        fs::path failedPath;
+        if (!zip.Open(zipPath, Z_DEFAULT_COMPRESSION, JobScheduler::ThreadBudget()) || !ZipAddDirectoryContents(zip, tempDir, &failedPath) || !zip.Close()) {
+            zip.Abort();
+            fs::remove_all(tempDir);
+            if (fs::exists(workRar)) fs::rename(workRar, absRarPath);
+            meter.Printf(true, L"Failed to create ZIP: %s", failedPath.empty() ? zipPath.wstring().c_str() : failedPath.wstring().c_str());
+            return false;
         }
-        catch (...) {
-            fs::current_path(oldPath);
-            throw;
-        }
-        fs::current_path(oldPath);
 
         // 4. 後始末（元のファイルはリネームで戻す）
         fs::remove_all(tempDir);
         if (fs::exists(workRar)) fs::rename(workRar, absRarPath);
 
-        std::wcout << L"Success: " << zipPath.filename().wstring() << std::endl;
+        meter.Print(L"Success: " + zipPath.filename().wstring());
+        if (zip.StoreStats().entries > 0) {
+            meter.Print(L"  " + zip.StoreStats().Summary());
+        }
         return true;
     }
     catch (const bit7z::BitException& ex) {
+        // 作業用の名前は毎回変わるので、失敗しても残さない
+        std::error_code ec;
+        fs::remove_all(tempDir, ec);
         if (fs::exists(workRar) && !fs::exists(absRarPath)) fs::rename(workRar, absRarPath);
-        fwprintf(stderr, L"\nbit7z Error: %S\n", ex.what());
+        meter.Printf(true, L"bit7z Error: %S", ex.what());
+        return false;
+    }
+    catch (const std::exception& ex) {
+        std::error_code ec;
+        fs::remove_all(tempDir, ec);
+        if (fs::exists(workRar, ec) && !fs::exists(absRarPath, ec)) fs::rename(workRar, absRarPath, ec);
+        meter.Printf(true, L"Error: %S", ex.what());
         return false;
     }
 }
@@ -92,10 +119,25 @@ int main() {
         int wargc;
         wchar_t** wargv = CommandLineToArgvW(GetCommandLineW(), &wargc);
         if (!wargv) return 1;
+        std::vector<fs::path> targets;
         for (int i = 1; i < wargc; ++i) {
             fs::path p = wargv[i];
-            if (fs::exists(p)) ConvertRarToZip(lib, p);
+            if (fs::exists(p)) targets.push_back(p);
+        }
+
+        // 進捗は全書庫の合計を1行で表示する（0.1秒ごと）
+        ProgressMeter meter(targets.size(), L"Converting");
+        // 作業用の名前は書庫ごとに別なので、展開・圧縮とも物理ディスクごとの既定の数まで同時に動かす
+        JobScheduler scheduler;
+        for (const auto& p : targets) {
+            scheduler.Add(JobKind::Io, p, [&lib, &meter, p] {
+                ProgressMeter::Task& task = meter.Begin();
+                ConvertRarToZip(lib, p, meter, task);
+                meter.End(task);
+                });
         }
+        scheduler.Run();
+        meter.Stop();
         LocalFree(wargv);
     }
     catch (const bit7z::BitException& ex) {
@@ -0,0 +1,280 @@
+﻿#pragma once
+// 大量の小さなファイルをまとめて読み書きするためのI/O層
+// Windowsではオーバーラップ I/O + I/O完了ポートで複数ファイルのopen/read/writeを先行発行する
+// それ以外（または -io std 指定時）は従来どおりifstream/ofstreamで1件ずつ処理する
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+enum class IoBackend { Std, Overlapped };
+
+inline IoBackend DefaultIoBackend() {
+#ifdef _WIN32
+    return IoBackend::Overlapped;
+#else
+    return IoBackend::Std;
+#endif
+}
+
+struct ReadItem {
+    std::filesystem::path path;
+    std::vector<uint8_t> data;
+    bool ok = false;
+};
+
+inline bool ReadWholeFile_Std(const std::filesystem::path& path, std::vector<uint8_t>& data) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    data.resize((size_t)size);
+    return (bool)file.read(reinterpret_cast<char*>(data.data()), size);
+}
+
+inline bool WriteWholeFile_Std(const std::filesystem::path& path, const std::vector<uint8_t>& data) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    file.close();
+    return !file.fail();
+}
+
+// ファイル一覧を先読みしながら順番に返す
+class BatchReader {
+public:
+    BatchReader(const std::vector<std::filesystem::path>& files, IoBackend backend, size_t depth = 32)
+        : files_(files), backend_(backend), depth_(depth) {
+#ifdef _WIN32
+        if (backend_ == IoBackend::Overlapped) {
+            iocp_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+            if (!iocp_) backend_ = IoBackend::Std;
+        }
+#else
+        backend_ = IoBackend::Std;
+#endif
+    }
+
+    ~BatchReader() {
+#ifdef _WIN32
+        // 発行済みで未完了の読み込みを待ってから閉じる
+        while (!inflight_.empty()) {
+            if (!inflight_.front()->done) WaitOne();
+            else inflight_.pop_front();
+        }
+        if (iocp_) CloseHandle(iocp_);
+#endif
+    }
+
+    BatchReader(const BatchReader&) = delete;
+    BatchReader& operator=(const BatchReader&) = delete;
+
+    // ファイル一覧の順に1件ずつ返す。全部返し終えたらfalse
+    bool Next(ReadItem& item) {
+        if (backend_ == IoBackend::Std) {
+            if (next_ >= files_.size()) return false;
+            item.path = files_[next_++];
+            item.ok = ReadWholeFile_Std(item.path, item.data);
+            return true;
+        }
+#ifdef _WIN32
+        while (inflight_.size() < depth_ && next_ < files_.size()) {
+            Submit(files_[next_++]);
+        }
+        if (inflight_.empty()) return false;
+        auto req = inflight_.front();
+        while (!req->done) WaitOne();
+        inflight_.pop_front();
+        item.path = req->path;
+        item.ok = req->ok;
+        item.data.swap(req->data);
+        // 空いた枠で次のファイルを発行しておく
+        if (next_ < files_.size()) Submit(files_[next_++]);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    struct Request {
+        OVERLAPPED ov = {};
+        HANDLE h = INVALID_HANDLE_VALUE;
+        std::filesystem::path path;
+        std::vector<uint8_t> data;
+        bool done = false;
+        bool ok = false;
+    };
+
+    void Submit(const std::filesystem::path& path) {
+        auto req = std::make_shared<Request>();
+        req->path = path;
+        inflight_.push_back(req);
+
+        req->h = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER size = {};
+        if (req->h == INVALID_HANDLE_VALUE || !GetFileSizeEx(req->h, &size) || size.QuadPart > 0x7FFFFFFF) {
+            Complete(*req, false);
+            return;
+        }
+        req->data.resize((size_t)size.QuadPart);
+        if (size.QuadPart == 0) {
+            Complete(*req, true);
+            return;
+        }
+        if (!CreateIoCompletionPort(req->h, iocp_, 0, 0)) {
+            Complete(*req, false);
+            return;
+        }
+        if (!ReadFile(req->h, req->data.data(), (DWORD)req->data.size(), nullptr, &req->ov)
+            && GetLastError() != ERROR_IO_PENDING) {
+            Complete(*req, false);
+        }
+    }
+
+    void Complete(Request& req, bool ok) {
+        if (req.h != INVALID_HANDLE_VALUE) CloseHandle(req.h);
+        req.h = INVALID_HANDLE_VALUE;
+        req.ok = ok;
+        req.done = true;
+    }
+
+    // 完了通知を1件受け取る
+    void WaitOne() {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* ov = nullptr;
+        BOOL ret = GetQueuedCompletionStatus(iocp_, &bytes, &key, &ov, INFINITE);
+        if (!ov) return;
+        for (auto& r : inflight_) {
+            if (&r->ov == ov) {
+                Complete(*r, ret && bytes == r->data.size());
+                break;
+            }
+        }
+    }
+
+    HANDLE iocp_ = nullptr;
+    std::deque<std::shared_ptr<Request>> inflight_;
+#endif
+
+    std::vector<std::filesystem::path> files_;
+    IoBackend backend_;
+    size_t depth_;
+    size_t next_ = 0;
+};
+
+// 書き込みをまとめて発行し、完了したものから順にコールバックを呼ぶ
+// コールバックはWrite()/Flush()を呼んだスレッドで実行される
+class BatchWriter {
+public:
+    using Done = std::function<void(bool ok)>;
+
+    BatchWriter(IoBackend backend, size_t depth = 32) : backend_(backend), depth_(depth) {
+#ifdef _WIN32
+        if (backend_ == IoBackend::Overlapped) {
+            iocp_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+            if (!iocp_) backend_ = IoBackend::Std;
+        }
+#else
+        backend_ = IoBackend::Std;
+#endif
+    }
+
+    ~BatchWriter() {
+        Flush();
+#ifdef _WIN32
+        if (iocp_) CloseHandle(iocp_);
+#endif
+    }
+
+    BatchWriter(const BatchWriter&) = delete;
+    BatchWriter& operator=(const BatchWriter&) = delete;
+
+    void Write(const std::filesystem::path& path, std::vector<uint8_t>&& data, Done done) {
+        if (backend_ == IoBackend::Std) {
+            bool ok = WriteWholeFile_Std(path, data);
+            if (done) done(ok);
+            return;
+        }
+#ifdef _WIN32
+        while (inflight_.size() >= depth_) WaitOne();
+
+        auto req = std::make_shared<Request>();
+        req->data = std::move(data);
+        req->done = std::move(done);
+        req->h = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, nullptr);
+        if (req->h == INVALID_HANDLE_VALUE) {
+            Finish(*req, false);
+            return;
+        }
+        if (req->data.empty()) {
+            Finish(*req, true);
+            return;
+        }
+        if (!CreateIoCompletionPort(req->h, iocp_, 0, 0)) {
+            Finish(*req, false);
+            return;
+        }
+        if (!WriteFile(req->h, req->data.data(), (DWORD)req->data.size(), nullptr, &req->ov)
+            && GetLastError() != ERROR_IO_PENDING) {
+            Finish(*req, false);
+            return;
+        }
+        inflight_.push_back(req);
+#endif
+    }
+
+    // 発行済みの書き込みがすべて終わるまで待つ
+    void Flush() {
+#ifdef _WIN32
+        while (!inflight_.empty()) WaitOne();
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    struct Request {
+        OVERLAPPED ov = {};
+        HANDLE h = INVALID_HANDLE_VALUE;
+        std::vector<uint8_t> data;
+        Done done;
+    };
+
+    void Finish(Request& req, bool ok) {
+        if (req.h != INVALID_HANDLE_VALUE) CloseHandle(req.h);
+        req.h = INVALID_HANDLE_VALUE;
+        if (req.done) req.done(ok);
+    }
+
+    void WaitOne() {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* ov = nullptr;
+        BOOL ret = GetQueuedCompletionStatus(iocp_, &bytes, &key, &ov, INFINITE);
+        if (!ov) return;
+        for (auto it = inflight_.begin(); it != inflight_.end(); ++it) {
+            if (&(*it)->ov == ov) {
+                auto req = *it;
+                inflight_.erase(it);
+                Finish(*req, ret && bytes == req->data.size());
+                break;
+            }
+        }
+    }
+
+    HANDLE iocp_ = nullptr;
+    std::deque<std::shared_ptr<Request>> inflight_;
+#endif
+
+    IoBackend backend_;
+    size_t depth_;
+};
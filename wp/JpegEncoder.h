@@ -0,0 +1,78 @@
+﻿#pragma once
+// JPEGエンコーダのプロファイル（stb / libjpeg-turbo）
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <turbojpeg.h>
+#include "stb_image_write.h"
+
+struct JpegProfile {
+    const char* name;
+    bool useStb;        // 従来のstbエンコーダを使う
+    int quality;
+    int subsamp;        // TJSAMP_xxx
+    bool progressive;
+    bool optimize;      // Huffmanテーブル最適化
+    bool fastDct;
+};
+
+// stb: 従来と同じ出力（既定）
+// fast: 4:2:0 ベースライン、最適化なし、高速DCT
+// small: 4:2:0 プログレッシブ＋Huffman最適化
+// archive: 高画質 4:4:4 プログレッシブ＋Huffman最適化
+inline const std::vector<JpegProfile>& JpegProfiles() {
+    static const std::vector<JpegProfile> profiles = {
+        { "stb",     true,  75, TJSAMP_420, false, false, false },
+        { "fast",    false, 75, TJSAMP_420, false, false, true  },
+        { "small",   false, 75, TJSAMP_420, true,  true,  false },
+        { "archive", false, 92, TJSAMP_444, true,  true,  false },
+    };
+    return profiles;
+}
+
+inline const JpegProfile* FindJpegProfile(const std::string& name) {
+    for (const auto& p : JpegProfiles()) {
+        if (name == p.name) return &p;
+    }
+    return nullptr;
+}
+
+// stbでRGBをJPEGにエンコードしてメモリに書き出す
+inline bool EncodeJpeg_Stb(const uint8_t* rgb, int width, int height, int quality, std::vector<uint8_t>& jpeg) {
+    auto write_func = [](void* context, void* data, int size) {
+        std::vector<uint8_t>* out = static_cast<std::vector<uint8_t>*>(context);
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        out->insert(out->end(), p, p + size);
+    };
+    jpeg.clear();
+    return stbi_write_jpg_to_func(write_func, &jpeg, width, height, 3, rgb, quality) != 0;
+}
+
+// libjpeg-turboでRGBをJPEGにエンコードする
+inline bool EncodeJpeg_Turbo(const uint8_t* rgb, int width, int height, const JpegProfile& profile, std::vector<uint8_t>& jpeg) {
+    tjhandle tj = tj3Init(TJINIT_COMPRESS);
+    if (!tj) return false;
+
+    tj3Set(tj, TJPARAM_QUALITY, profile.quality);
+    tj3Set(tj, TJPARAM_SUBSAMP, profile.subsamp);
+    tj3Set(tj, TJPARAM_PROGRESSIVE, profile.progressive ? 1 : 0);
+    tj3Set(tj, TJPARAM_OPTIMIZE, profile.optimize ? 1 : 0);
+    tj3Set(tj, TJPARAM_FASTDCT, profile.fastDct ? 1 : 0);
+
+    unsigned char* buf = nullptr;
+    size_t size = 0;
+    bool ok = tj3Compress8(tj, rgb, width, 0, height, TJPF_RGB, &buf, &size) == 0;
+    if (ok) {
+        jpeg.assign(buf, buf + size);
+    }
+    tj3Free(buf);
+    tj3Destroy(tj);
+    return ok;
+}
+
+inline bool EncodeJpeg(const uint8_t* rgb, int width, int height, const JpegProfile& profile, std::vector<uint8_t>& jpeg) {
+    if (profile.useStb) {
+        return EncodeJpeg_Stb(rgb, width, height, profile.quality, jpeg);
+    }
+    return EncodeJpeg_Turbo(rgb, width, height, profile, jpeg);
+}
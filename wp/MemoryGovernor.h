@@ -0,0 +1,77 @@
+﻿#pragma once
+// デコード画素バッファのメモリ予算を管理する
+// 各ワーカーはデコード前に width×height×channels を予約し、予算を超える場合は空くまで待つ
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+class MemoryGovernor {
+public:
+    explicit MemoryGovernor(uint64_t budget) : budget_(budget) {}
+
+    // 予約できるまで待つ
+    // 予算より大きい要求でも、他に予約がなければ通す（1枚も処理できなくなるのを防ぐ）
+    void Acquire(uint64_t bytes) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (current_ != 0 && current_ + bytes > budget_) {
+            waits_++;
+            cv_.wait(lock, [&] { return current_ == 0 || current_ + bytes <= budget_; });
+        }
+        current_ += bytes;
+        peak_ = (std::max)(peak_, current_);
+    }
+
+    void Release(uint64_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            current_ -= (std::min)(bytes, current_);
+        }
+        cv_.notify_all();
+    }
+
+    uint64_t Budget() const { return budget_; }
+    uint64_t Current() const { std::lock_guard<std::mutex> lock(mtx_); return current_; }
+    uint64_t Peak() const { std::lock_guard<std::mutex> lock(mtx_); return peak_; }
+    uint64_t Waits() const { std::lock_guard<std::mutex> lock(mtx_); return waits_; }
+
+    // スコープを抜けると解放される予約
+    class Reservation {
+    public:
+        Reservation(MemoryGovernor* gov, uint64_t bytes) : gov_(gov), bytes_(bytes) {
+            if (gov_) gov_->Acquire(bytes_);
+        }
+        ~Reservation() { Release(); }
+        void Release() {
+            if (gov_) gov_->Release(bytes_);
+            gov_ = nullptr;
+        }
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+    private:
+        MemoryGovernor* gov_;
+        uint64_t bytes_;
+    };
+
+private:
+    uint64_t budget_;
+    uint64_t current_ = 0;
+    uint64_t peak_ = 0;
+    uint64_t waits_ = 0;
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+};
+
+// 既定の予算: 空き物理メモリ（ジョブオブジェクトの制限を含む）の半分
+inline uint64_t DefaultMemoryBudget() {
+#ifdef _WIN32
+    MEMORYSTATUSEX ms = { sizeof(ms) };
+    if (GlobalMemoryStatusEx(&ms)) {
+        return ms.ullAvailPhys / 2;
+    }
+#endif
+    return 1024ull * 1024 * 1024;
+}
@@ -0,0 +1,144 @@
+﻿#pragma once
+// 可逆WebP用のPNGライタ
+// IDATの圧縮はParallelDeflater（並列deflate）で行う
+#include <cstdint>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "../common/ParallelDeflate.h"
+
+inline void PngPutU32(std::vector<uint8_t>& out, uint32_t v) {
+    out.push_back((uint8_t)(v >> 24));
+    out.push_back((uint8_t)(v >> 16));
+    out.push_back((uint8_t)(v >> 8));
+    out.push_back((uint8_t)v);
+}
+
+inline void PngPutChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+    PngPutU32(out, (uint32_t)size);
+    size_t crcStart = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (size) out.insert(out.end(), data, data + size);
+    uint32_t crc = crc32(0, &out[crcStart], (uInt)(out.size() - crcStart));
+    PngPutU32(out, crc);
+}
+
+inline uint8_t PngPaeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return (uint8_t)a;
+    if (pb <= pc) return (uint8_t)b;
+    return (uint8_t)c;
+}
+
+// 1行分をフィルタする。5種類を試して差分の絶対値和が最小のものを採用する（libpngと同じ考え方）
+inline void PngFilterRow(const uint8_t* cur, const uint8_t* prev, size_t rowBytes, int bpp, uint8_t* out, std::vector<uint8_t>& work) {
+    work.resize(rowBytes * 5);
+    uint64_t best = UINT64_MAX;
+    int bestType = 0;
+    for (int type = 0; type < 5; type++) {
+        uint8_t* f = &work[rowBytes * type];
+        uint64_t sum = 0;
+        for (size_t i = 0; i < rowBytes; i++) {
+            int a = i >= (size_t)bpp ? cur[i - bpp] : 0;
+            int b = prev ? prev[i] : 0;
+            int c = (prev && i >= (size_t)bpp) ? prev[i - bpp] : 0;
+            uint8_t v = cur[i];
+            switch (type) {
+            case 1: v = (uint8_t)(v - a); break;
+            case 2: v = (uint8_t)(v - b); break;
+            case 3: v = (uint8_t)(v - ((a + b) >> 1)); break;
+            case 4: v = (uint8_t)(v - PngPaeth(a, b, c)); break;
+            }
+            f[i] = v;
+            sum += (v < 128) ? v : 256 - v;
+        }
+        if (sum < best) {
+            best = sum;
+            bestType = type;
+        }
+    }
+    out[0] = (uint8_t)bestType;
+    std::memcpy(out + 1, &work[rowBytes * bestType], rowBytes);
+}
+
+// channels: 3=RGB, 4=RGBA
+// threads: フィルタと圧縮に使うスレッド数（0ならコア数。複数の画像を同時に変換するときは分け合う）
+inline bool EncodePng(const uint8_t* pixels, int width, int height, int channels,
+                      std::vector<uint8_t>& png, const std::vector<uint8_t>& icc = {},
+                      const std::vector<uint8_t>& exif = {}, int level = 6, unsigned threads = 0) {
+    png.clear();
+    const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+    png.insert(png.end(), sig, sig + 8);
+
+    std::vector<uint8_t> ihdr;
+    PngPutU32(ihdr, (uint32_t)width);
+    PngPutU32(ihdr, (uint32_t)height);
+    ihdr.push_back(8);                          // bit depth
+    ihdr.push_back(channels == 4 ? 6 : 2);      // color type
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    PngPutChunk(png, "IHDR", ihdr.data(), ihdr.size());
+
+    if (!icc.empty()) {
+        // iCCP: プロファイル名 + NUL + 圧縮方式(0) + zlib圧縮したプロファイル
+        std::vector<uint8_t> data = { 'I', 'C', 'C', 0, 0 };
+        uLongf zsize = compressBound((uLong)icc.size());
+        size_t head = data.size();
+        data.resize(head + zsize);
+        if (compress2(&data[head], &zsize, icc.data(), (uLong)icc.size(), level) == Z_OK) {
+            data.resize(head + zsize);
+            PngPutChunk(png, "iCCP", data.data(), data.size());
+        }
+    }
+    if (!exif.empty()) {
+        PngPutChunk(png, "eXIf", exif.data(), exif.size());
+    }
+
+    // フィルタは行ごとに独立しているので帯に分けて並列に処理する
+    size_t rowBytes = (size_t)width * channels;
+    size_t stride = rowBytes + 1;
+    std::vector<uint8_t> filtered(stride * height);
+    if (threads == 0) threads = (std::max)(1u, std::thread::hardware_concurrency());
+    int band = (std::max)(1, (int)((height + threads - 1) / threads));
+    std::vector<std::future<void>> jobs;
+    for (int y0 = 0; y0 < height; y0 += band) {
+        int y1 = (std::min)(height, y0 + band);
+        jobs.push_back(std::async(std::launch::async, [=, &filtered] {
+            std::vector<uint8_t> work;
+            for (int y = y0; y < y1; y++) {
+                const uint8_t* cur = pixels + rowBytes * y;
+                const uint8_t* prev = y > 0 ? cur - rowBytes : nullptr;
+                PngFilterRow(cur, prev, rowBytes, channels, &filtered[stride * y], work);
+            }
+        }));
+    }
+    for (auto& j : jobs) j.get();
+
+    // 並列deflateの出力を1MBごとのIDATチャンクに区切って書き出す
+    const size_t idatSize = 1024 * 1024;
+    std::vector<uint8_t> idat;
+    ParallelDeflater deflater([&](const uint8_t* p, size_t n) {
+        idat.insert(idat.end(), p, p + n);
+        if (idat.size() >= idatSize) {
+            PngPutChunk(png, "IDAT", idat.data(), idat.size());
+            idat.clear();
+        }
+        return true;
+    }, level, ParallelDeflater::Wrap::Zlib, threads);
+    if (!deflater.Write(filtered.data(), filtered.size()) || !deflater.Finish()) {
+        return false;
+    }
+    if (!idat.empty()) {
+        PngPutChunk(png, "IDAT", idat.data(), idat.size());
+    }
+
+    PngPutChunk(png, "IEND", nullptr, 0);
+    return true;
+}
@@ -0,0 +1,191 @@
+﻿#pragma once
+// WebPのEXIF/ICCチャンクをJPEGへ引き継ぐためのヘルパー
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <webp/mux.h>
+#include <turbojpeg.h>
+
+struct WebpMetadata {
+    std::vector<uint8_t> exif;  // TIFFヘッダから始まるEXIF本体（"Exif\0\0"は含まない）
+    std::vector<uint8_t> icc;
+    int orientation = 1;
+};
+
+// EXIF(TIFF)内のOrientationタグ(0x0112)の値の位置を探す
+// 見つからなければ0を返す
+inline size_t FindExifOrientation(const std::vector<uint8_t>& tiff) {
+    if (tiff.size() < 8) return 0;
+    bool le;
+    if (tiff[0] == 'I' && tiff[1] == 'I') le = true;
+    else if (tiff[0] == 'M' && tiff[1] == 'M') le = false;
+    else return 0;
+
+    auto rd16 = [&](size_t p) -> uint32_t {
+        return le ? (tiff[p] | (tiff[p + 1] << 8)) : ((tiff[p] << 8) | tiff[p + 1]);
+    };
+    auto rd32 = [&](size_t p) -> uint32_t {
+        return le ? (rd16(p) | (rd16(p + 2) << 16)) : ((rd16(p) << 16) | rd16(p + 2));
+    };
+
+    size_t ifd = rd32(4);
+    if (ifd + 2 > tiff.size()) return 0;
+    uint32_t count = rd16(ifd);
+    for (uint32_t i = 0; i < count; i++) {
+        size_t e = ifd + 2 + i * 12;
+        if (e + 12 > tiff.size()) return 0;
+        // SHORT型・個数1なら値はエントリ内に直接入っている
+        if (rd16(e) == 0x0112 && rd16(e + 2) == 3) return e + 8;
+    }
+    return 0;
+}
+
+inline int ReadExifOrientation(const std::vector<uint8_t>& tiff) {
+    size_t p = FindExifOrientation(tiff);
+    if (p == 0) return 1;
+    int v = (tiff[0] == 'I') ? tiff[p] : tiff[p + 1];
+    return (v >= 1 && v <= 8) ? v : 1;
+}
+
+// 画素を回転済みにした後はOrientationを1に戻す（二重回転防止）
+inline void ResetExifOrientation(std::vector<uint8_t>& tiff) {
+    size_t p = FindExifOrientation(tiff);
+    if (p == 0) return;
+    tiff[p] = (tiff[0] == 'I') ? 1 : 0;
+    tiff[p + 1] = (tiff[0] == 'I') ? 0 : 1;
+}
+
+// 読み込み済みのWebPバッファからEXIF/ICCPチャンクを取り出す
+inline bool ExtractWebpMetadata(const uint8_t* data, size_t size, WebpMetadata& meta) {
+    WebPData wd = { data, size };
+    WebPMux* mux = WebPMuxCreate(&wd, 0);
+    if (!mux) return false;
+
+    WebPData chunk;
+    if (WebPMuxGetChunk(mux, "EXIF", &chunk) == WEBP_MUX_OK && chunk.size > 0) {
+        const uint8_t* p = chunk.bytes;
+        size_t n = chunk.size;
+        // 書き出しツールによっては"Exif\0\0"が前置されている
+        if (n >= 6 && std::memcmp(p, "Exif\0\0", 6) == 0) {
+            p += 6;
+            n -= 6;
+        }
+        meta.exif.assign(p, p + n);
+        meta.orientation = ReadExifOrientation(meta.exif);
+    }
+    if (WebPMuxGetChunk(mux, "ICCP", &chunk) == WEBP_MUX_OK && chunk.size > 0) {
+        meta.icc.assign(chunk.bytes, chunk.bytes + chunk.size);
+    }
+    WebPMuxDelete(mux);
+    return true;
+}
+
+inline int OrientationToTjOp(int orientation) {
+    switch (orientation) {
+    case 2: return TJXOP_HFLIP;
+    case 3: return TJXOP_ROT180;
+    case 4: return TJXOP_VFLIP;
+    case 5: return TJXOP_TRANSPOSE;
+    case 6: return TJXOP_ROT90;
+    case 7: return TJXOP_TRANSVERSE;
+    case 8: return TJXOP_ROT270;
+    default: return TJXOP_NONE;
+    }
+}
+
+// tjTransformでJPEGを無劣化回転する
+// MCU境界に揃わない画像はTJXOPT_PERFECTで失敗するので、呼び出し側で画素回転にフォールバックする
+inline bool TransformJpegLossless(std::vector<uint8_t>& jpeg, int orientation) {
+    int op = OrientationToTjOp(orientation);
+    if (op == TJXOP_NONE) return true;
+
+    tjhandle tj = tj3Init(TJINIT_TRANSFORM);
+    if (!tj) return false;
+
+    tjtransform xf = {};
+    xf.op = op;
+    xf.options = TJXOPT_PERFECT | TJXOPT_COPYNONE;
+
+    unsigned char* dst = nullptr;
+    size_t dstSize = 0;
+    bool ok = tj3Transform(tj, jpeg.data(), jpeg.size(), 1, &dst, &dstSize, &xf) == 0;
+    if (ok) {
+        jpeg.assign(dst, dst + dstSize);
+    }
+    tj3Free(dst);
+    tj3Destroy(tj);
+    return ok;
+}
+
+// 画素をEXIF Orientationに従って並べ替える（無劣化回転できない場合やPNG出力で使う）
+inline void OrientPixels(const uint8_t* src, int w, int h, int channels, int orientation,
+                         std::vector<uint8_t>& dst, int& outW, int& outH) {
+    bool swap = orientation >= 5;
+    outW = swap ? h : w;
+    outH = swap ? w : h;
+    dst.resize((size_t)outW * outH * channels);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int dx = x, dy = y;
+            switch (orientation) {
+            case 2: dx = w - 1 - x; break;
+            case 3: dx = w - 1 - x; dy = h - 1 - y; break;
+            case 4: dy = h - 1 - y; break;
+            case 5: dx = y; dy = x; break;
+            case 6: dx = h - 1 - y; dy = x; break;
+            case 7: dx = h - 1 - y; dy = w - 1 - x; break;
+            case 8: dx = y; dy = w - 1 - x; break;
+            }
+            std::memcpy(&dst[((size_t)dy * outW + dx) * channels], &src[((size_t)y * w + x) * channels], channels);
+        }
+    }
+}
+
+// SOI(とJFIF APP0)の直後にAPP1(EXIF)とAPP2(ICC_PROFILE)を差し込む
+inline void InsertJpegMetadata(std::vector<uint8_t>& jpeg, const WebpMetadata& meta) {
+    if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return;
+
+    size_t pos = 2;
+    if (jpeg[2] == 0xFF && jpeg[3] == 0xE0 && jpeg.size() >= 6) {
+        pos += 2 + ((jpeg[4] << 8) | jpeg[5]);
+    }
+
+    std::vector<uint8_t> seg;
+    auto putMarker = [&seg](uint8_t marker, size_t payload) {
+        size_t len = payload + 2;
+        seg.push_back(0xFF);
+        seg.push_back(marker);
+        seg.push_back((uint8_t)(len >> 8));
+        seg.push_back((uint8_t)(len & 0xFF));
+    };
+
+    // APP1は1セグメント(64KB)に収まるものだけ引き継ぐ
+    if (!meta.exif.empty() && meta.exif.size() + 6 <= 65533) {
+        putMarker(0xE1, meta.exif.size() + 6);
+        const char hdr[] = "Exif\0";
+        seg.insert(seg.end(), hdr, hdr + 6);
+        seg.insert(seg.end(), meta.exif.begin(), meta.exif.end());
+    }
+
+    // ICCは65519バイトごとに分割して連番を付ける
+    if (!meta.icc.empty()) {
+        const size_t maxChunk = 65519;
+        size_t chunks = (meta.icc.size() + maxChunk - 1) / maxChunk;
+        if (chunks <= 255) {
+            for (size_t i = 0; i < chunks; i++) {
+                size_t off = i * maxChunk;
+                size_t n = (std::min)(maxChunk, meta.icc.size() - off);
+                putMarker(0xE2, n + 14);
+                const char hdr[] = "ICC_PROFILE";
+                seg.insert(seg.end(), hdr, hdr + 12);
+                seg.push_back((uint8_t)(i + 1));
+                seg.push_back((uint8_t)chunks);
+                seg.insert(seg.end(), meta.icc.begin() + off, meta.icc.begin() + off + n);
+            }
+        }
+    }
+
+    jpeg.insert(jpeg.begin() + pos, seg.begin(), seg.end());
+}
@@ -6,8 +6,24 @@
 #include <cstdio>
 #include <algorithm>
 #include <cctype>
+#include <cwchar>
 #include <webp/decode.h>
+#include "WebpMeta.h"
+#include "JpegEncoder.h"
+#include "PngWriter.h"
+#include "BatchIO.h"
+#include "MemoryGovernor.h"
+#include "../common/ZipWriter.h"
+#include "../common/SevenZipList.h"
 #include <fstream>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <memory>
+#include <cwctype>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 #include <Windows.h>
@@ -26,83 +42,162 @@ std::wstring NormalizePathUnicode(const std::wstring& path) {
     return normalized;
 }
 
-bool ConvertWebpToJpeg_Stb(const fs::path & webpPath, const fs::path& jpegPath, int quality = 75) {
-    // WebPファイルをバイナリで読み込む
-    std::ifstream file(webpPath, std::ios::binary | std::ios::ate);
-    if (!file) {
-        std::cerr << "WebPファイルが開けません: " << webpPath.filename().string() << std::endl;
-        return false;
-    }
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    std::vector<uint8_t> buffer(size);
-    if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
-        std::cerr << "WebPファイルの読み込み失敗: " << webpPath.filename().string() << std::endl;
+// UTF-8変換ヘルパー
+std::string ToUtf8(const std::wstring& wstr) {
+    if (wstr.empty()) return std::string();
+    int size_needed = WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), NULL, 0, NULL, NULL);
+    std::string strTo(size_needed, 0);
+    WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), &strTo[0], size_needed, NULL, NULL);
+    return strTo;
+}
+
+struct ConvertOptions {
+    const JpegProfile* profile = &JpegProfiles()[0];
+    bool applyOrientation = false;  // EXIF Orientationを画素に適用する
+    bool losslessToPng = true;      // 可逆WebPはPNGで出力する
+    IoBackend io = DefaultIoBackend();
+    int jobs = 0;                   // 同時に変換するファイル数（0ならコア数）
+    unsigned threads = 0;           // 1つの変換（PNGのフィルタ・圧縮）で使うスレッド数（0ならコア数）
+    MemoryGovernor* memory = nullptr;  // デコード画素バッファの予算
+};
+
+// jobs個の変換を同時に動かすときに1つの変換が使えるスレッド数（コア数を分け合う）
+unsigned ThreadsPerJob(int jobs) {
+    unsigned cores = (std::max)(1u, std::thread::hardware_concurrency());
+    return (std::max)(1u, cores / (unsigned)(std::max)(1, jobs));
+}
+
+// 1行ずつロックして出力する（-j のワーカーから同時に出しても行が混ざらない）
+std::mutex g_outputMtx;
+
+void PrintLine(std::ostream& out, const std::string& line) {
+    std::lock_guard<std::mutex> lock(g_outputMtx);
+    out << line << std::endl;
+}
+
+void PrintLine(std::wostream& out, const std::wstring& line) {
+    std::lock_guard<std::mutex> lock(g_outputMtx);
+    out << line << std::endl;
+}
+
+// WebPのバイト列をJPEG（可逆ならPNG）に変換する
+bool ConvertWebpBuffer(const std::vector<uint8_t>& buffer, const std::string& name, const ConvertOptions& opt,
+                       std::vector<uint8_t>& encoded, bool& isPng) {
+    // 同じバッファからEXIF/ICCを取り出す（再読み込みはしない）
+    WebpMetadata meta;
+    ExtractWebpMetadata(buffer.data(), buffer.size(), meta);
+
+    // 可逆(VP8L)はPNGで書き出して劣化させない
+    WebPBitstreamFeatures features;
+    if (WebPGetFeatures(buffer.data(), buffer.size(), &features) != VP8_STATUS_OK) {
+        PrintLine(std::cerr, "WebPデコード失敗: " + name);
         return false;
     }
-    file.close();
+    bool lossless = opt.losslessToPng && features.format == 2;
+    int channels = (lossless && features.has_alpha) ? 4 : 3;
+    isPng = lossless;
+
+    // デコード前に画素バッファ分のメモリを予約する（予算が空くまで待つ）
+    // PNGのフィルタ済みバッファ、Orientation適用時の回転バッファも同じ大きさなので合わせて予約する
+    uint64_t planeBytes = (uint64_t)features.width * features.height * channels;
+    int planes = 1 + (lossless ? 1 : 0) + ((opt.applyOrientation && meta.orientation != 1) ? 1 : 0);
+    MemoryGovernor::Reservation reservation(opt.memory, planeBytes * planes);
 
-    // WebPデコード（RGBで取得）
+    // WebPデコード（RGB/RGBAで取得）
     int width = 0, height = 0;
-    uint8_t* rgb = WebPDecodeRGB(buffer.data(), buffer.size(), &width, &height);
+    uint8_t* rgb = (channels == 4)
+        ? WebPDecodeRGBA(buffer.data(), buffer.size(), &width, &height)
+        : WebPDecodeRGB(buffer.data(), buffer.size(), &width, &height);
     if (!rgb) {
-        std::cerr << "WebPデコード失敗: " << webpPath.filename().string() << std::endl;
+        PrintLine(std::cerr, "WebPデコード失敗: " + name);
         return false;
     }
 
-    // std::ofstream を使用して jpegPath に直接書き込む
-    std::ofstream outFile(jpegPath, std::ios::binary);
-    if (!outFile) {
-        std::cerr << "JPEG書き込み失敗: ファイルを開けません" << std::endl;
+    bool ok;
+    if (lossless) {
+        const uint8_t* px = rgb;
+        std::vector<uint8_t> rotated;
+        if (opt.applyOrientation && meta.orientation != 1) {
+            OrientPixels(rgb, width, height, channels, meta.orientation, rotated, width, height);
+            px = rotated.data();
+            ResetExifOrientation(meta.exif);
+        }
+        ok = EncodePng(px, width, height, channels, encoded, meta.icc, meta.exif, 6, opt.threads);
         WebPFree(rgb);
-        return false;
     }
+    else {
+        ok = EncodeJpeg(rgb, width, height, *opt.profile, encoded);
 
-    // stbi_write_jpg_to_func を使用してメモリに書き込み、その後ファイルに保存
-    auto write_func = [](void* context, void* data, int size) {
-        std::ofstream* stream = static_cast<std::ofstream*>(context);
-        stream->write(static_cast<const char*>(data), size);
-    };
-
-    int ok = stbi_write_jpg_to_func(write_func, &outFile, width, height, 3, rgb, quality);
-    WebPFree(rgb);
-    outFile.close();
+        // Orientationはまず無劣化のtjTransformで適用し、MCU境界に合わない場合だけ画素を回してから再エンコード
+        if (ok && opt.applyOrientation && meta.orientation != 1) {
+            if (!TransformJpegLossless(encoded, meta.orientation)) {
+                std::vector<uint8_t> rotated;
+                int rw = 0, rh = 0;
+                OrientPixels(rgb, width, height, 3, meta.orientation, rotated, rw, rh);
+                ok = EncodeJpeg(rotated.data(), rw, rh, *opt.profile, encoded);
+            }
+            ResetExifOrientation(meta.exif);
+        }
+        WebPFree(rgb);
 
+        if (ok) {
+            InsertJpegMetadata(encoded, meta);
+        }
+    }
     if (!ok) {
-        std::cerr << "JPEG書き込み失敗" << std::endl;
+        PrintLine(std::cerr, std::string(lossless ? "PNG" : "JPEG") + "書き込み失敗: " + name);
+    }
+    return ok;
+}
+
+// 書き込みが終わったら元のWebPを削除する
+bool FinishConvert(const fs::path& webpPath, const fs::path& outPath, bool written) {
+    if (!written) {
+        PrintLine(std::cerr, "書き込み失敗: " + outPath.filename().string());
         return false;
     }
-    else {
-        try {
-            if (std::filesystem::remove(webpPath)) {
-                // 削除成功
-            }
-            else {
-                return false;
-            }
-            std::cout << "変換完了: " << webpPath.filename().string() << " -> " << jpegPath.filename().string() << std::endl;
+    try {
+        if (std::filesystem::remove(webpPath)) {
+            // 削除成功
         }
-        catch (const std::filesystem::filesystem_error& e) {
-            std::cerr << "削除エラー: " << webpPath.filename().string() <<" - " << e.what() << std::endl;
+        else {
             return false;
         }
+        PrintLine(std::cout, "変換完了: " + webpPath.filename().string() + " -> " + outPath.filename().string());
+    }
+    catch (const std::filesystem::filesystem_error& e) {
+        PrintLine(std::cerr, "削除エラー: " + webpPath.filename().string() + " - " + e.what());
+        return false;
     }
     return true;
 }
 
 void Usage() {
-    std::cout << "Usage: wp <input.webp> " << std::endl;
+    std::cout << "Usage: wp [-o] [-p <profile>] [-jpeg] [-j <n>] [-mem <MB>] <input.webp> " << std::endl;
+    std::cout << "       wp [-o] [-p <profile>] [-jpeg] [-j <n>] [-mem <MB>] <archive.zip|cbz|rar>" << std::endl;
+    std::cout << "       wp -bench <input.webp|dir>" << std::endl;
+    std::cout << "       wp -bench-io <dir>" << std::endl;
+    std::cout << "  -o : EXIFのOrientationを画像に適用する" << std::endl;
+    std::cout << "  -p : エンコーダプロファイル (stb, fast, small, archive) 既定はstb" << std::endl;
+    std::cout << "  -jpeg : 可逆WebPもPNGではなくJPEGで出力する" << std::endl;
+    std::cout << "  -io <batch|std> : ファイルI/O方式（batch: オーバーラップI/Oでまとめて発行 / std: ifstream）" << std::endl;
+    std::cout << "  -j <n> : n個のファイルを並列に変換する（既定はコア数）" << std::endl;
+    std::cout << "  -mem <MB> : デコード画素バッファの予算。超える場合は空くまで待つ（既定は空き物理メモリの半分）" << std::endl;
+    std::cout << "  -bench : 各プロファイルのエンコード速度と出力サイズを計測する（ファイルは書き換えない）" << std::endl;
+    std::cout << "  -bench-io : ifstreamと一括I/Oの読み書き速度を比較する（ファイルは書き換えない）" << std::endl;
+    std::cout << "  書庫（zip/cbz/rar）を指定すると中のWebPを変換して新しいZIPを書く（zip/cbzは置き換え、rarは.zipを作る）" << std::endl;
     std::cout << "Example: wp image.webp" << std::endl;
 }
 
 fs::path ConvertImgiToImgJpeg(const fs::path& webpName) {
-    std::string fn = webpName.filename().string();
+    // ANSIコードページにない文字を含む名前でも変換できるようワイド文字で扱う
+    std::wstring fn = webpName.filename().wstring();
     
     // null文字を削除
-    fn.erase(std::remove(fn.begin(), fn.end(), '\0'), fn.end());
+    fn.erase(std::remove(fn.begin(), fn.end(), L'\0'), fn.end());
     
-    std::regex re(R"(imgi_(\d+)_(\d+)\.webp)", std::regex::icase);
-    std::smatch m;
+    std::wregex re(LR"(imgi_(\d+)_(\d+)\.webp)", std::regex::icase);
+    std::wsmatch m;
     
     if (std::regex_match(fn, m, re) && m[1] == m[2]) {
         int n = std::stoi(m[1]);
@@ -118,9 +213,477 @@ fs::path ConvertImgiToImgJpeg(const fs::path& webpName) {
     return result.replace_extension(".jpeg");
 }
 
-bool ConvertWebpToJpeg_Stb(const fs::path& path) {
-    fs::path jpegPath = ConvertImgiToImgJpeg(path);
-    return ConvertWebpToJpeg_Stb(path, jpegPath);
+// 読み込み・書き込みをまとめて発行しながら変換する
+// -j 指定時は複数のワーカーが読み込み済みのファイルを取り合って変換する（読み込み・書き込みはロックで直列化）
+void ConvertWebpFiles(const std::vector<fs::path>& files, const ConvertOptions& options) {
+    int jobs = (std::max)(1, (std::min)(options.jobs, (int)files.size()));
+    ConvertOptions opt = options;
+    opt.threads = ThreadsPerJob(jobs);
+    BatchReader reader(files, opt.io);
+    BatchWriter writer(opt.io);
+    std::mutex readMtx;
+    std::mutex writeMtx;
+
+    auto worker = [&] {
+        ReadItem item;
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(readMtx);
+                if (!reader.Next(item)) break;
+            }
+            if (!item.ok) {
+                PrintLine(std::cerr, "WebPファイルの読み込み失敗: " + item.path.filename().string());
+                continue;
+            }
+            std::vector<uint8_t> encoded;
+            bool isPng = false;
+            if (!ConvertWebpBuffer(item.data, item.path.filename().string(), opt, encoded, isPng)) {
+                continue;
+            }
+            fs::path webpPath = item.path;
+            fs::path outPath = ConvertImgiToImgJpeg(webpPath);
+            if (isPng) outPath.replace_extension(".png");
+            std::lock_guard<std::mutex> lock(writeMtx);
+            writer.Write(outPath, std::move(encoded), [webpPath, outPath](bool ok) {
+                FinishConvert(webpPath, outPath, ok);
+            });
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) t.join();
+    writer.Flush();
+}
+
+// 書庫の中でWebPかどうか（名前の拡張子で判定）
+bool IsWebpEntryName(const std::wstring& name) {
+    if (name.size() < 5) return false;
+    std::wstring ext = name.substr(name.size() - 5);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+    return ext == L".webp";
+}
+
+// 書庫から除くエントリか（a2d/a2dir/r2z/r2zipと同じく*.scrは新しいZIPに入れない）
+bool IsScrEntryName(const std::wstring& name) {
+    std::wstring ext = fs::path(name).extension().wstring();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+    return ext == L".scr";
+}
+
+// 書庫内のWebPの変換結果。書き込みは書庫の順番どおりに行うので、変換が終わるまで待ち合わせる
+struct ArchiveSlot {
+    const ZipEntry* raw = nullptr;  // ZIPからそのままコピーするエントリ
+    std::string name;               // WebPのエントリ名（UTF-8）
+    uint16_t dosTime = 0;
+    uint16_t dosDate = 0;
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+    bool isPng = false;
+    bool ok = false;
+    bool done = false;
+};
+
+// WebPのエントリ名（UTF-8）を変換後の名前にする（ファイルの変換と同じくConvertImgiToImgJpegの規則）
+std::string ConvertedEntryName(const std::string& name, bool isPng) {
+    fs::path path = ConvertImgiToImgJpeg(fs::path(std::u8string(name.begin(), name.end())));
+    if (isPng) path.replace_extension(".png");
+    return ZipEntryName(path);
+}
+
+// 同じ書庫の中で名前が重なるかを調べるためのキー（Windowsと同じく大文字小文字を区別しない）
+std::string EntryNameKey(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(), [](char c) { return (char)::tolower((unsigned char)c); });
+    return name;
+}
+
+// 書庫を1回読みながらWebPだけをJPEG（可逆ならPNG）に変換し、新しいZIPを1回で書く
+// 読み込みと書き込みは呼び出したスレッドで順番に行い、変換だけを-jの数のワーカーで並列にする
+// WebP以外のエントリは、ZIPなら圧縮データをそのままコピーし、RARなら7z x -soの出力をそのまま書き込む
+class ArchiveConverter {
+public:
+    ArchiveConverter(ZipWriter& zip, const ConvertOptions& opt) : zip_(zip), opt_(opt) {
+        // 読み込み済みで変換待ちのWebPはワーカー数の2倍まで（メモリを使いすぎない）
+        int jobs = (std::max)(1, opt.jobs);
+        limit_ = (size_t)jobs * 2;
+        opt_.threads = ThreadsPerJob(jobs);
+        for (int i = 0; i < jobs; i++) {
+            threads_.emplace_back([this] { Worker(); });
+        }
+    }
+
+    ~ArchiveConverter() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    // 書庫に残るエントリの名前を登録する（変換後の名前がこれと重なるWebPは変換しないで元のまま残す）
+    void ReserveName(const std::string& name) {
+        names_.insert(EntryNameKey(name));
+    }
+
+    // 読み込んだWebPを変換に回す
+    bool AddWebp(std::string name, std::vector<uint8_t> data, uint16_t dosTime, uint16_t dosDate) {
+        auto slot = std::make_unique<ArchiveSlot>();
+        slot->name = std::move(name);
+        slot->input = std::move(data);
+        slot->dosTime = dosTime;
+        slot->dosDate = dosDate;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            work_.push_back(slot.get());
+        }
+        cv_.notify_all();
+        pending_.push_back(std::move(slot));
+        converting_++;
+        // 変換待ちが多すぎる場合は先頭から書き出して空ける
+        while (ok_ && converting_ > limit_) WriteFront();
+        WriteReady();
+        return ok_;
+    }
+
+    // ZIPのエントリをそのままコピーする（前にあるWebPを書き終えてから）
+    bool AddRaw(ZipReader& reader, const ZipEntry& entry) {
+        reader_ = &reader;
+        auto slot = std::make_unique<ArchiveSlot>();
+        slot->raw = &entry;
+        slot->done = true;
+        pending_.push_back(std::move(slot));
+        WriteReady();
+        return ok_;
+    }
+
+    // 変換待ちをすべて書き出す（RARのエントリを直接書き込む前と最後に呼ぶ）
+    bool Drain() {
+        while (ok_ && !pending_.empty()) WriteFront();
+        return ok_;
+    }
+
+    size_t Converted() const { return converted_; }
+    size_t Failed() const { return failed_; }
+
+private:
+    void Worker() {
+        for (;;) {
+            ArchiveSlot* slot;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [this] { return stop_ || !work_.empty(); });
+                if (work_.empty()) return;
+                slot = work_.front();
+                work_.pop_front();
+            }
+            bool ok = ConvertWebpBuffer(slot->input, slot->name, opt_, slot->output, slot->isPng);
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                slot->ok = ok;
+                slot->done = true;
+            }
+            doneCv_.notify_all();
+        }
+    }
+
+    // 変換の終わっている先頭のエントリを書けるだけ書く
+    void WriteReady() {
+        for (;;) {
+            if (!ok_ || pending_.empty()) return;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (!pending_.front()->done) return;
+            }
+            WriteFront();
+        }
+    }
+
+    // 先頭のエントリの変換を待って書く
+    void WriteFront() {
+        ArchiveSlot& slot = *pending_.front();
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            doneCv_.wait(lock, [&] { return slot.done; });
+        }
+        if (slot.raw) {
+            ok_ = zip_.CopyRawEntry(*reader_, *slot.raw);
+        }
+        else {
+            converting_--;
+            std::string name = slot.name;
+            const std::vector<uint8_t>* data = &slot.input;
+            std::string convertedName = slot.ok ? ConvertedEntryName(slot.name, slot.isPng) : std::string();
+            if (slot.ok && !names_.insert(EntryNameKey(convertedName)).second) {
+                // 同じ名前のエントリが書庫にある（imgi_1_1.webpとimg001.jpeg、a.webpとa.pngなど）
+                PrintLine(std::cerr, "名前が重なるため元のまま: " + slot.name + " -> " + convertedName);
+                failed_++;
+            }
+            else if (slot.ok) {
+                name = convertedName;
+                data = &slot.output;
+                converted_++;
+                PrintLine(std::cout, "変換完了: " + slot.name + " -> " + name);
+            }
+            else {
+                // 変換できなかったWebPは元のまま残す
+                failed_++;
+            }
+            ZipWriter::Method method = zip_.ChooseMethod(name, data->data(), data->size(), data->size());
+            ok_ = zip_.BeginEntry(name, method, slot.dosTime, slot.dosDate, data->size())
+                && zip_.WriteEntry(data->data(), data->size())
+                && zip_.EndEntry();
+        }
+        pending_.pop_front();
+    }
+
+    ZipWriter& zip_;
+    ConvertOptions opt_;
+    ZipReader* reader_ = nullptr;
+    std::deque<std::unique_ptr<ArchiveSlot>> pending_;  // 書庫の順番（書き込み待ち）
+    std::deque<ArchiveSlot*> work_;                     // 変換待ち
+    std::set<std::string> names_;                       // 書庫に残る・書いたエントリの名前（EntryNameKey）
+    std::vector<std::thread> threads_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::condition_variable doneCv_;
+    size_t limit_ = 2;
+    size_t converting_ = 0;
+    size_t converted_ = 0;
+    size_t failed_ = 0;
+    bool stop_ = false;
+    bool ok_ = true;
+};
+
+// 書き終えた一時ファイルを変換先の名前にする
+// 変換先が開かれているなどで置き換えられなければ、一時ファイルを消してfalse
+bool ReplaceWithTemp(const fs::path& tmpPath, const fs::path& destPath) {
+    std::error_code ec;
+    fs::rename(tmpPath, destPath, ec);
+    if (!ec) return true;
+    PrintLine(std::cerr, "置き換え失敗: " + destPath.filename().string() + " - " + ec.message());
+    fs::remove(tmpPath, ec);
+    return false;
+}
+
+// ZIP（.zip/.cbz）の中のWebPを変換し、元のファイルと置き換える
+bool ConvertZipArchive(const fs::path& zipPath, const ConvertOptions& opt) {
+    fs::path tmpPath = zipPath;
+    tmpPath += L".wp.tmp";
+    size_t converted = 0, failed = 0;
+    {
+        ZipReader reader;
+        if (!reader.Open(zipPath)) {
+            PrintLine(std::cerr, "ZIPの読み込み失敗: " + zipPath.filename().string());
+            return false;
+        }
+        size_t webps = 0;
+        for (const auto& entry : reader.Entries()) {
+            if (!entry.IsDirectory() && entry.IsExtractable() && IsWebpEntryName(entry.WideName())) webps++;
+        }
+        if (webps == 0) {
+            PrintLine(std::cout, "WebPがありません: " + zipPath.filename().string());
+            return true;
+        }
+
+        ZipWriter zip;
+        if (!zip.Open(tmpPath)) {
+            std::cerr << "ZIPの作成失敗: " << tmpPath.filename().string() << std::endl;
+            return false;
+        }
+        bool ok = true;
+        {
+            ArchiveConverter converter(zip, opt);
+            for (const auto& entry : reader.Entries()) {
+                if (!IsScrEntryName(entry.WideName())) converter.ReserveName(ZipEntryName(fs::path(entry.WideName())));
+            }
+            for (const auto& entry : reader.Entries()) {
+                if (!entry.IsDirectory() && IsScrEntryName(entry.WideName())) continue;
+                if (entry.IsDirectory() || !entry.IsExtractable() || !IsWebpEntryName(entry.WideName())) {
+                    ok = converter.AddRaw(reader, entry);
+                }
+                else {
+                    std::vector<uint8_t> data;
+                    data.reserve((size_t)entry.usize);
+                    std::wstring error;
+                    if (!reader.Extract(entry, [&data](const uint8_t* p, size_t n) {
+                            data.insert(data.end(), p, p + n);
+                            return true;
+                        }, &error)) {
+                        PrintLine(std::wcerr, L"展開失敗: " + entry.WideName() + L" - " + error);
+                        ok = false;
+                    }
+                    else {
+                        ok = converter.AddWebp(ZipEntryName(fs::path(entry.WideName())), std::move(data), entry.dosTime, entry.dosDate);
+                    }
+                }
+                if (!ok) break;
+            }
+            ok = ok && converter.Drain();
+            converted = converter.Converted();
+            failed = converter.Failed();
+        }
+        if (ok) ok = zip.Close();
+        else zip.Abort();
+        if (!ok) {
+            std::cerr << "ZIPの書き込み失敗: " << zipPath.filename().string() << std::endl;
+            return false;
+        }
+    }
+
+    // 書き終えてから元のファイルと置き換える
+    if (!ReplaceWithTemp(tmpPath, zipPath)) return false;
+    std::cout << "書庫の変換完了: " << zipPath.filename().string() << " (" << converted << " 件";
+    if (failed) std::cout << "、失敗 " << failed << " 件は元のまま";
+    std::cout << ")" << std::endl;
+    return true;
+}
+
+// 7z.exeのパス（wp.prefの1行目。なければ既定のインストール先）
+std::wstring LoadSevenZipPath() {
+    std::wstring defaultPath = L"C:\\Program Files\\7-Zip\\7z.exe";
+    wchar_t exePath[MAX_PATH];
+    GetModuleFileNameW(nullptr, exePath, MAX_PATH);
+    fs::path prefPath(exePath);
+    prefPath.replace_extension(L".pref");
+
+    std::wifstream prefFile(prefPath);
+    std::wstring sevenZipPath;
+    if (!prefFile.is_open() || !std::getline(prefFile, sevenZipPath)) {
+        return defaultPath;
+    }
+    sevenZipPath.erase(0, sevenZipPath.find_first_not_of(L" \t\r\n"));
+    sevenZipPath.erase(sevenZipPath.find_last_not_of(L" \t\r\n") + 1);
+    if (!sevenZipPath.empty() && fs::is_regular_file(sevenZipPath)) {
+        return sevenZipPath;
+    }
+    return defaultPath;
+}
+
+// RARの中のWebPを変換して、同じ名前の.zipを作る（RARは残す）
+// 7z x -soの出力を一覧のサイズで切り分けるので、一時フォルダに展開しない
+bool ConvertRarArchive(const fs::path& rarPath, const ConvertOptions& opt) {
+    std::wstring sevenZipPath = LoadSevenZipPath();
+    std::vector<SevenZipItem> list;
+    if (!SevenZipList(sevenZipPath, rarPath.wstring(), [&list](const SevenZipItem& item) { list.push_back(item); })) {
+        std::cerr << "RARの一覧の取得失敗: " << rarPath.filename().string() << std::endl;
+        return false;
+    }
+
+    fs::path zipPath = rarPath;
+    zipPath.replace_extension(L".zip");
+    fs::path tmpPath = zipPath;
+    tmpPath += L".wp.tmp";
+
+    uint16_t arcTime, arcDate;
+    ZipDosTime(rarPath, arcTime, arcDate);
+
+    ZipWriter zip;
+    if (!zip.Open(tmpPath)) {
+        std::cerr << "ZIPの作成失敗: " << tmpPath.filename().string() << std::endl;
+        return false;
+    }
+    for (const auto& item : list) {
+        if (!item.isDir) continue;
+        uint16_t dosTime = arcTime, dosDate = arcDate;
+        SevenZipDosTime(item.modified, dosTime, dosDate);
+        if (!zip.AddDirectory(ZipEntryName(fs::path(item.path)), dosTime, dosDate)) {
+            std::cerr << "ZIPの書き込み失敗: " << zipPath.filename().string() << std::endl;
+            zip.Abort();
+            return false;
+        }
+    }
+
+    SevenZipExtractPipe pipe;
+    if (!pipe.Start(sevenZipPath, rarPath.wstring())) {
+        std::cerr << "RARの展開失敗: " << rarPath.filename().string() << std::endl;
+        zip.Abort();
+        return false;
+    }
+
+    bool ok = true;
+    size_t converted = 0, failed = 0;
+    {
+        ArchiveConverter converter(zip, opt);
+        for (const auto& item : list) {
+            if (!IsScrEntryName(item.path)) converter.ReserveName(ZipEntryName(fs::path(item.path)));
+        }
+        std::vector<uint8_t> buffer(1024 * 1024);
+        for (const auto& item : list) {
+            if (item.isDir) continue;
+            std::string name = ZipEntryName(fs::path(item.path));
+            uint16_t dosTime = arcTime, dosDate = arcDate;
+            SevenZipDosTime(item.modified, dosTime, dosDate);
+
+            if (IsScrEntryName(item.path)) {
+                // 7z x -soは一覧のすべてのファイルを続けて出力するので、読み捨てて次に進む
+                uint64_t remain = item.size;
+                while (ok && remain > 0) {
+                    size_t n = (size_t)(std::min)(remain, (uint64_t)buffer.size());
+                    ok = pipe.Read(buffer.data(), n);
+                    remain -= n;
+                }
+            }
+            else if (IsWebpEntryName(item.path)) {
+                std::vector<uint8_t> data((size_t)item.size);
+                ok = pipe.Read(data.data(), data.size())
+                    && converter.AddWebp(name, std::move(data), dosTime, dosDate);
+            }
+            else {
+                // 前にあるWebPを書き終えてから、パイプの出力をそのまま書き込む
+                ok = converter.Drain();
+                uint64_t remain = item.size;
+                size_t n = (size_t)(std::min)(remain, (uint64_t)buffer.size());
+                ok = ok && pipe.Read(buffer.data(), n);
+                if (ok) {
+                    ZipWriter::Method method = zip.ChooseMethod(name, buffer.data(), n, item.size);
+                    ok = zip.BeginEntry(name, method, dosTime, dosDate, item.size) && zip.WriteEntry(buffer.data(), n);
+                }
+                remain -= n;
+                while (ok && remain > 0) {
+                    n = (size_t)(std::min)(remain, (uint64_t)buffer.size());
+                    ok = pipe.Read(buffer.data(), n) && zip.WriteEntry(buffer.data(), n);
+                    remain -= n;
+                }
+                ok = ok && zip.EndEntry();
+            }
+            if (!ok) break;
+        }
+        ok = ok && converter.Drain();
+        converted = converter.Converted();
+        failed = converter.Failed();
+    }
+
+    // 7z.exeの終了コードと、一覧のサイズどおりに出力が終わったかを確認する
+    if (!pipe.Finish()) ok = false;
+    if (ok) ok = zip.Close();
+    else zip.Abort();
+    if (!ok) {
+        std::cerr << "ZIPの書き込み失敗: " << zipPath.filename().string() << std::endl;
+        return false;
+    }
+    if (!ReplaceWithTemp(tmpPath, zipPath)) return false;
+    std::cout << "書庫の変換完了: " << rarPath.filename().string() << " -> " << zipPath.filename().string()
+        << " (" << converted << " 件";
+    if (failed) std::cout << "、失敗 " << failed << " 件は元のまま";
+    std::cout << ")" << std::endl;
+    return true;
+}
+
+// 書庫（.zip/.cbz/.rar）か
+bool IsArchivePath(const fs::path& path) {
+    std::wstring ext = path.extension().wstring();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+    return ext == L".zip" || ext == L".cbz" || ext == L".rar";
+}
+
+void PrintMemoryStats(const MemoryGovernor& gov) {
+    const double mb = 1024.0 * 1024.0;
+    std::printf("メモリ予約: ピーク %.1f MB / 現在 %.1f MB / 予算 %.1f MB / 待機 %llu 回\n",
+        gov.Peak() / mb, gov.Current() / mb, gov.Budget() / mb, (unsigned long long)gov.Waits());
 }
 
 // ファイルパスを末尾の数字でソートする関数
@@ -181,25 +744,203 @@ std::vector<fs::path> GetFilesWithExtensions(const fs::path& dir, const std::vec
     return files;
 }
 
+// 各プロファイルでエンコードして速度とサイズを比較する
+void BenchProfiles(const std::vector<fs::path>& files) {
+    struct Result { double ms = 0; uint64_t bytes = 0; bool failed = false; };
+    const auto& profiles = JpegProfiles();
+    std::vector<Result> results(profiles.size());
+    uint64_t pixels = 0;
+    uint64_t inputBytes = 0;
+    size_t measured = 0;    // 読み込みとデコードができて計測したファイル数
+    const int repeat = 3;
+
+    for (const auto& f : files) {
+        std::ifstream file(f, std::ios::binary | std::ios::ate);
+        if (!file) continue;
+        std::streamsize size = file.tellg();
+        file.seekg(0, std::ios::beg);
+        std::vector<uint8_t> buffer(size);
+        if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) continue;
+
+        int width = 0, height = 0;
+        uint8_t* rgb = WebPDecodeRGB(buffer.data(), buffer.size(), &width, &height);
+        if (!rgb) {
+            std::cerr << "WebPデコード失敗: " << f.filename().string() << std::endl;
+            continue;
+        }
+        pixels += (uint64_t)width * height;
+        inputBytes += buffer.size();
+        measured++;
+
+        std::vector<uint8_t> jpeg;
+        for (size_t i = 0; i < profiles.size(); i++) {
+            bool ok = true;
+            auto t0 = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeat; r++) {
+                if (!EncodeJpeg(rgb, width, height, profiles[i], jpeg)) ok = false;
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            results[i].ms += std::chrono::duration<double, std::milli>(t1 - t0).count() / repeat;
+            // 失敗したときのjpegは前の画像の出力なので数えない
+            if (ok) results[i].bytes += jpeg.size();
+            else results[i].failed = true;
+        }
+        WebPFree(rgb);
+    }
+
+    if (pixels == 0) {
+        std::cout << "計測対象がありません" << std::endl;
+        return;
+    }
+
+    std::cout << "files: " << measured << "  pixels: " << pixels << "  webp bytes: " << inputBytes << std::endl;
+    std::printf("%-8s %10s %10s %12s %8s\n", "profile", "ms", "MPix/s", "bytes", "vs stb");
+    for (size_t i = 0; i < profiles.size(); i++) {
+        const Result& r = results[i];
+        double mpps = r.ms > 0 ? (pixels / 1e6) / (r.ms / 1000.0) : 0;
+        double ratio = results[0].bytes > 0 ? (double)r.bytes / results[0].bytes * 100.0 : 0;
+        std::printf("%-8s %10.1f %10.1f %12llu %7.1f%%%s\n", profiles[i].name, r.ms, mpps,
+            (unsigned long long)r.bytes, ratio, r.failed ? " (失敗あり)" : "");
+    }
+}
+
+// ifstream/ofstreamと一括I/Oで読み込み・書き込みの速度を比較する
+// 書き込み先は一時フォルダで、計測後に削除する
+void BenchIo(const std::vector<fs::path>& files) {
+    fs::path tmp = fs::temp_directory_path() / L"wp_bench_io";
+    fs::create_directories(tmp);
+
+    auto run = [&](IoBackend backend, uint64_t& bytes) {
+        auto t0 = std::chrono::steady_clock::now();
+        BatchReader reader(files, backend);
+        BatchWriter writer(backend);
+        ReadItem item;
+        size_t n = 0;
+        bytes = 0;
+        while (reader.Next(item)) {
+            if (!item.ok) continue;
+            bytes += item.data.size();
+            writer.Write(tmp / (std::to_wstring(n++) + L".bin"), std::move(item.data), nullptr);
+        }
+        writer.Flush();
+        auto t1 = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(t1 - t0).count();
+    };
+
+    const struct { IoBackend backend; const char* name; } backends[] = {
+        { IoBackend::Std, "ifstream" },
+        { IoBackend::Overlapped, "batch" },
+    };
+    // 1回目はキャッシュの暖機として捨て、2回目を表示する
+    std::printf("%-10s %10s %10s %10s\n", "backend", "ms", "files/s", "MB/s");
+    for (const auto& b : backends) {
+        uint64_t bytes = 0;
+        run(b.backend, bytes);
+        double ms = run(b.backend, bytes);
+        std::printf("%-10s %10.1f %10.0f %10.1f\n", b.name, ms,
+            files.size() / (ms / 1000.0), (bytes / 1048576.0) / (ms / 1000.0));
+    }
+    fs::remove_all(tmp);
+}
+
 int wmain(int argc, wchar_t* argv[]) {
-    if (argc < 2) {
+    ConvertOptions opt;
+    bool bench = false;
+    bool benchIo = false;
+    uint64_t memBudget = 0;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == L'-'; argi++) {
+        std::wstring op = argv[argi];
+        if (op == L"-o") {
+            opt.applyOrientation = true;
+        }
+        else if (op == L"-p" && argi + 1 < argc) {
+            opt.profile = FindJpegProfile(ToUtf8(argv[++argi]));
+            if (!opt.profile) {
+                Usage();
+                return 1;
+            }
+        }
+        else if (op == L"-jpeg") {
+            opt.losslessToPng = false;
+        }
+        else if (op == L"-io" && argi + 1 < argc) {
+            std::wstring name = argv[++argi];
+            if (name == L"std") opt.io = IoBackend::Std;
+            else if (name == L"batch") opt.io = IoBackend::Overlapped;
+            else {
+                Usage();
+                return 1;
+            }
+        }
+        else if (op == L"-j" && argi + 1 < argc) {
+            opt.jobs = (int)std::wcstol(argv[++argi], nullptr, 10);
+            if (opt.jobs <= 0) {
+                Usage();
+                return 1;
+            }
+        }
+        else if (op == L"-mem" && argi + 1 < argc) {
+            int mb = (int)std::wcstol(argv[++argi], nullptr, 10);
+            if (mb <= 0) {
+                Usage();
+                return 1;
+            }
+            memBudget = (uint64_t)mb * 1024 * 1024;
+        }
+        else if (op == L"-bench") {
+            bench = true;
+        }
+        else if (op == L"-bench-io") {
+            benchIo = true;
+        }
+        else {
+            Usage();
+            return 1;
+        }
+    }
+    if (argi >= argc) {
         Usage();
         return 1;
     }
-    fs::path webpPath = fs::path(argv[1]);
+    if (opt.jobs == 0) opt.jobs = (int)(std::max)(1u, std::thread::hardware_concurrency());
+    fs::path webpPath = fs::path(argv[argi]);
+
+    // 書庫は中のWebPを変換して書き直す
+    if (!bench && !benchIo && fs::is_regular_file(webpPath) && IsArchivePath(webpPath)) {
+        MemoryGovernor governor(memBudget ? memBudget : DefaultMemoryBudget());
+        opt.memory = &governor;
+        std::wstring ext = webpPath.extension().wstring();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+        bool ok = (ext == L".rar") ? ConvertRarArchive(webpPath, opt) : ConvertZipArchive(webpPath, opt);
+        PrintMemoryStats(governor);
+        return ok ? 0 : 1;
+    }
+
+    std::vector<fs::path> lst;
     if (fs::is_regular_file(webpPath)) {
-        ConvertWebpToJpeg_Stb(webpPath);
+        lst.push_back(webpPath);
     }
     else if (fs::is_directory(webpPath)) {
         std::vector<std::string> exts = { ".webp"};
-        std::vector<fs::path> lst = GetFilesWithExtensions(webpPath, exts);
-        for (const auto& f : lst) {
-            ConvertWebpToJpeg_Stb(f);
-        }
+        lst = GetFilesWithExtensions(webpPath, exts);
     }
     else {
         Usage();
         return 1;
     }
+
+    if (bench) {
+        BenchProfiles(lst);
+    }
+    else if (benchIo) {
+        BenchIo(lst);
+    }
+    else {
+        MemoryGovernor governor(memBudget ? memBudget : DefaultMemoryBudget());
+        opt.memory = &governor;
+        ConvertWebpFiles(lst, opt);
+        PrintMemoryStats(governor);
+    }
     return 0;
-}
+}
\ No newline at end of file